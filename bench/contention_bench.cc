@@ -0,0 +1,183 @@
+/*
+ * Scaling of the plugin under concurrent remaps: 1..N threads drive
+ * TSRemapDoRemap of a script with a fixed CPU cost for a while, once
+ * for every way the plugin can run scripts, and the throughput and
+ * latency percentiles of each run are printed.
+ *
+ * All rules share one isolate behind a v8::Locker, so the strategies
+ * are how transactions get to it: inline, every transaction taking the
+ * lock in TSRemapDoRemap, or batched, transactions parked at the
+ * post-remap hook and run N at a time by the batch worker.
+ *
+ * Run from the repository root; see "Benchmarks" in README.md.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "v8.h"
+#include "latency.h"
+#include "ts_mock.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+struct Options {
+  string scripts = "bench/scripts";
+  string v8_flags = "--random-seed=1 --hash-seed=1";
+  vector<int> threads = {1, 2, 4, 8, 16};
+  // Batch sizes; 1 runs the script inline.
+  vector<int> batch_sizes = {1, 8, 32};
+  int work = 1000;
+  double seconds = 5;
+  double warmup = 1;
+  bool csv = false;
+};
+
+struct Result {
+  int64_t requests;
+  double seconds;
+  Latencies latencies;
+};
+
+vector<int> ParseList(const char* text) {
+  vector<int> values;
+  for (const char* p = text; *p != '\0';) {
+    values.push_back(atoi(p));
+    p = strchr(p, ',');
+    if (p == NULL) break;
+    p++;
+  }
+  return values;
+}
+
+void Usage() {
+  fprintf(stderr,
+          "usage: contention_bench [--threads=1,2,4,8,16] [--batch_sizes=1,8,32] [--work=1000]\n"
+          "                        [--seconds=5] [--warmup=1] [--csv] [--scripts=<dir>]\n"
+          "                        [--v8_flags=<flags>]\n");
+}
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--threads=", 10) == 0) {
+      options->threads = ParseList(arg + 10);
+    } else if (strncmp(arg, "--batch_sizes=", 14) == 0) {
+      options->batch_sizes = ParseList(arg + 14);
+    } else if (strncmp(arg, "--work=", 7) == 0) {
+      options->work = atoi(arg + 7);
+    } else if (strncmp(arg, "--seconds=", 10) == 0) {
+      options->seconds = atof(arg + 10);
+    } else if (strncmp(arg, "--warmup=", 9) == 0) {
+      options->warmup = atof(arg + 9);
+    } else if (strcmp(arg, "--csv") == 0) {
+      options->csv = true;
+    } else if (strncmp(arg, "--scripts=", 10) == 0) {
+      options->scripts = arg + 10;
+    } else if (strncmp(arg, "--v8_flags=", 11) == 0) {
+      options->v8_flags += string(" ") + (arg + 11);
+    } else {
+      Usage();
+      return false;
+    }
+  }
+  return true;
+}
+
+// Remap from the given number of threads for the given time, each
+// thread with a transaction of its own.
+Result Run(void* instance, int threads, double seconds) {
+  std::atomic<bool> stop(false);
+  vector<Latencies> latencies(threads);
+  vector<int64_t> requests(threads, 0);
+  vector<std::thread> workers;
+
+  TSHRTime start = TShrtime();
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      mock::Request request;
+      request.path = "images/" + std::to_string(t) + ".png";
+      request.headers.push_back(std::make_pair("User-Agent", "contention_bench"));
+      TSHttpTxn txn = mock::NewTxn(request);
+      // Counted locally so the threads don't share cache lines.
+      Latencies local;
+      int64_t count = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        TSHRTime before = TShrtime();
+        mock::Remap(instance, txn);
+        local.Add(TShrtime() - before);
+        mock::CloseTxn(txn);
+        count++;
+      }
+      mock::DestroyTxn(txn);
+      latencies[t] = std::move(local);
+      requests[t] = count;
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  stop = true;
+  for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+
+  Result result;
+  result.seconds = (TShrtime() - start) / static_cast<double>(TS_HRTIME_SECOND);
+  result.requests = 0;
+  for (int t = 0; t < threads; t++) {
+    result.requests += requests[t];
+    result.latencies.Merge(latencies[t]);
+  }
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) return 1;
+
+  v8::V8::SetFlagsFromString(options.v8_flags.c_str());
+  if (!mock::Init()) return 1;
+
+  if (options.csv) {
+    printf("strategy,threads,requests_per_second,p50_us,p90_us,p99_us,p999_us\n");
+  } else {
+    printf("work=%d, %u CPUs\n", options.work, std::thread::hardware_concurrency());
+    printf("%-10s %7s %12s %9s %9s %9s %9s\n", "strategy", "threads", "requests/s", "p50_us",
+           "p90_us", "p99_us", "p99.9_us");
+  }
+
+  for (size_t b = 0; b < options.batch_sizes.size(); b++) {
+    int batch_size = options.batch_sizes[b];
+    vector<string> instance_options;
+    instance_options.push_back("work=" + std::to_string(options.work));
+    instance_options.push_back("stats=false");
+    if (batch_size > 1) instance_options.push_back("batch_size=" + std::to_string(batch_size));
+    void* instance = mock::NewInstance(options.scripts + "/spin.js", instance_options);
+    if (instance == NULL) return 1;
+
+    string strategy = batch_size > 1 ? "batch=" + std::to_string(batch_size) : "inline";
+    for (size_t i = 0; i < options.threads.size(); i++) {
+      int threads = options.threads[i];
+      // Let the script get optimized and the threads settle first.
+      Run(instance, threads, options.warmup);
+      Result result = Run(instance, threads, options.seconds);
+
+      const char* format = options.csv ? "%s,%d,%.0f,%.1f,%.1f,%.1f,%.1f\n"
+                                       : "%-10s %7d %12.0f %9.1f %9.1f %9.1f %9.1f\n";
+      printf(format, strategy.c_str(), threads, result.requests / result.seconds,
+             result.latencies.PercentileUs(50), result.latencies.PercentileUs(90),
+             result.latencies.PercentileUs(99), result.latencies.PercentileUs(99.9));
+      fflush(stdout);
+    }
+    mock::DeleteInstance(instance);
+  }
+  return 0;
+}
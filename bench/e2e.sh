@@ -0,0 +1,143 @@
+#!/bin/sh
+# End to end numbers through traffic_server on one box: a local origin
+# (python3 http.server), traffic_server in its own runroot, and wrk as
+# the client, all on 127.0.0.1.  Runs the same load with no plugin, an
+# empty script and test.js, and prints requests per second and latency
+# percentiles of each.
+#
+# Needs traffic_server and traffic_layout, python3, curl and wrk.  Run
+# from the repository root after building v8.so:
+#   bench/e2e.sh
+# Settings come from the environment:
+#   TS_BIN       where traffic_server is (/usr/local/bin)
+#   PLUGIN       the plugin (./v8.so)
+#   PORT         proxy port (18080), ORIGIN_PORT origin port (18081)
+#   DURATION     seconds of load per scenario (30), after WARMUP (5)
+#   CONNECTIONS  open connections (32), THREADS wrk threads (2)
+#   TS_CPUS, LOAD_CPUS  taskset CPU lists for traffic_server and wrk
+#   SCENARIOS    which of "none trivial test" to run
+#   KEEP=1       keep the work directory with the logs
+set -e
+
+REPO=$(pwd)
+TS_BIN=${TS_BIN:-/usr/local/bin}
+PLUGIN=${PLUGIN:-$REPO/v8.so}
+PORT=${PORT:-18080}
+ORIGIN_PORT=${ORIGIN_PORT:-18081}
+DURATION=${DURATION:-30}
+WARMUP=${WARMUP:-5}
+CONNECTIONS=${CONNECTIONS:-32}
+THREADS=${THREADS:-2}
+SCENARIOS=${SCENARIOS:-none trivial test}
+
+for tool in "$TS_BIN/traffic_server" "$TS_BIN/traffic_layout" python3 curl wrk; do
+  if ! command -v "$tool" >/dev/null 2>&1; then
+    echo "$tool not found" >&2
+    exit 1
+  fi
+done
+case "$PLUGIN" in /*) ;; *) PLUGIN=$REPO/$PLUGIN ;; esac
+if [ ! -f "$PLUGIN" ]; then
+  echo "$PLUGIN not found, build v8.so first" >&2
+  exit 1
+fi
+
+WORK=$(mktemp -d /tmp/v8-e2e-XXXXXX)
+chmod 755 "$WORK"
+ORIGIN_PID=
+TS_PID=
+
+cleanup() {
+  [ -n "$TS_PID" ] && kill "$TS_PID" 2>/dev/null && wait "$TS_PID" 2>/dev/null
+  [ -n "$ORIGIN_PID" ] && kill "$ORIGIN_PID" 2>/dev/null
+  if [ "$KEEP" = 1 ]; then
+    echo "logs are in $WORK"
+  else
+    rm -rf "$WORK"
+  fi
+}
+trap cleanup EXIT INT TERM
+
+pinned() {
+  cpus=$1
+  shift
+  if [ -n "$cpus" ]; then
+    taskset -c "$cpus" "$@"
+  else
+    "$@"
+  fi
+}
+
+# Wait until url answers with 200.
+wait_for() {
+  for i in $(seq 1 100); do
+    if curl -sf -o /dev/null "$1"; then
+      return 0
+    fi
+    sleep 0.2
+  done
+  echo "$1 did not come up" >&2
+  return 1
+}
+
+# The origin serves one 4KB file.  ATS caches it, so after the first
+# request the origin is out of the way and the runs measure the proxy
+# and the plugin.
+mkdir -p "$WORK/origin"
+head -c 4096 /dev/zero | tr '\0' 'x' > "$WORK/origin/object.txt"
+python3 -m http.server "$ORIGIN_PORT" --bind 127.0.0.1 --directory "$WORK/origin" \
+  > "$WORK/origin.log" 2>&1 &
+ORIGIN_PID=$!
+wait_for "http://127.0.0.1:$ORIGIN_PORT/object.txt"
+
+# A runroot of its own, so the installed configuration is left alone.
+"$TS_BIN/traffic_layout" init --path "$WORK/runroot" > /dev/null
+export TS_RUNROOT=$WORK/runroot
+SYSCONF=$(sed -n 's/^sysconfdir: *//p' "$WORK/runroot/runroot.yaml")
+case "$SYSCONF" in /*) ;; *) SYSCONF=$WORK/runroot/$SYSCONF ;; esac
+
+# Records are set through environment overrides, which work with both
+# records.config and records.yaml.
+export PROXY_CONFIG_HTTP_SERVER_PORTS=$PORT
+export PROXY_CONFIG_HTTP_CACHE_REQUIRED_HEADERS=0
+export PROXY_CONFIG_URL_REMAP_REMAP_REQUIRED=1
+export PROXY_CONFIG_REVERSE_PROXY_ENABLED=1
+export PROXY_CONFIG_DIAGS_DEBUG_ENABLED=0
+# Keep running as the current user, who owns the runroot
+export PROXY_CONFIG_ADMIN_USER_ID='#-1'
+
+printf '%-8s %12s %10s %10s %10s %10s\n' scenario requests/s p50 p90 p99 errors
+
+for scenario in $SCENARIOS; do
+  rule="map http://127.0.0.1:$PORT/ http://127.0.0.1:$ORIGIN_PORT/"
+  case $scenario in
+    none) ;;
+    trivial) rule="$rule @plugin=$PLUGIN @pparam=$REPO/bench/scripts/noop.js" ;;
+    test) rule="$rule @plugin=$PLUGIN @pparam=$REPO/test.js" ;;
+    *) echo "unknown scenario $scenario" >&2; exit 1 ;;
+  esac
+  echo "$rule" > "$SYSCONF/remap.config"
+
+  pinned "$TS_CPUS" "$TS_BIN/traffic_server" > "$WORK/traffic_server.$scenario.log" 2>&1 &
+  TS_PID=$!
+  wait_for "http://127.0.0.1:$PORT/object.txt"
+
+  url="http://127.0.0.1:$PORT/object.txt"
+  pinned "$LOAD_CPUS" wrk -t"$THREADS" -c"$CONNECTIONS" -d"$WARMUP"s "$url" > /dev/null
+  pinned "$LOAD_CPUS" wrk -t"$THREADS" -c"$CONNECTIONS" -d"$DURATION"s --latency "$url" \
+    > "$WORK/wrk.$scenario.txt"
+
+  kill "$TS_PID"
+  wait "$TS_PID" 2>/dev/null || true
+  TS_PID=
+
+  awk -v scenario="$scenario" '
+    /Requests\/sec:/ { rps = $2 }
+    $1 == "50%" { p50 = $2 }
+    $1 == "90%" { p90 = $2 }
+    $1 == "99%" { p99 = $2 }
+    /Non-2xx or 3xx responses:/ { errors += $NF }
+    /Socket errors:/ { errors += $4 + $6 + $8 + $10 }
+    END { printf "%-8s %12s %10s %10s %10s %10d\n", scenario, rps, p50, p90, p99, errors }
+  ' "$WORK/wrk.$scenario.txt"
+done
@@ -0,0 +1,201 @@
+/*
+ * Tail latency caused by GC: runs sustained load through Process for
+ * scripts with different allocation patterns and prints the latency
+ * percentiles next to the GCs and pauses that happened meanwhile.
+ *
+ * V8 flags can only be set before the isolate is created, so each heap
+ * configuration is a separate run; bench/gc_configs.sh runs a set of
+ * them.  Run from the repository root; see "Benchmarks" in README.md.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "v8.h"
+#include "gc_stats.h"
+#include "latency.h"
+#include "ts_mock.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+struct Options {
+  string scripts = "bench/scripts";
+  string v8_flags = "--random-seed=1 --hash-seed=1";
+  // Bench script names, or "test" for test.js.
+  vector<string> suite = {"strings", "objects", "wasm", "test"};
+  vector<string> script_options;
+  int threads = 1;
+  // Requests per second over all threads; 0 sends the next request as
+  // soon as the last one is done.
+  double rate = 0;
+  double seconds = 10;
+  double warmup = 2;
+};
+
+struct Result {
+  int64_t requests;
+  double seconds;
+  Latencies latencies;
+};
+
+string ScriptPath(const Options& options, const string& name) {
+  return name == "test" ? string("test.js") : options.scripts + "/" + name + ".js";
+}
+
+// Load from the given number of threads.  With a rate, each thread
+// sends at its share of it and latency counts from when a request was
+// due, so a stall also shows in the requests queued behind it.
+Result Run(void* instance, const Options& options, double seconds) {
+  std::atomic<bool> stop(false);
+  vector<Latencies> latencies(options.threads);
+  vector<int64_t> requests(options.threads, 0);
+  vector<std::thread> workers;
+  TSHRTime interval =
+      options.rate > 0 ? static_cast<TSHRTime>(TS_HRTIME_SECOND * options.threads / options.rate) : 0;
+
+  TSHRTime start = TShrtime();
+  for (int t = 0; t < options.threads; t++) {
+    workers.emplace_back([&, t] {
+      mock::Request request;
+      request.path = "images/" + std::to_string(t) + "/photo.jpg";
+      request.headers.push_back(std::make_pair("User-Agent", "Mozilla/5.0 (X11; Linux x86_64)"));
+      Latencies local;
+      int64_t count = 0;
+      TSHRTime due = TShrtime();
+      while (!stop.load(std::memory_order_relaxed)) {
+        TSHRTime now = TShrtime();
+        if (interval > 0 && due > now) {
+          std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+        }
+        TSHRTime begin = interval > 0 ? due : TShrtime();
+        TSHttpTxn txn = mock::NewTxn(request);
+        mock::Remap(instance, txn);
+        mock::CloseTxn(txn);
+        mock::DestroyTxn(txn);
+        local.Add(TShrtime() - begin);
+        count++;
+        due += interval;
+      }
+      latencies[t] = std::move(local);
+      requests[t] = count;
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  stop = true;
+  for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+
+  Result result;
+  result.seconds = (TShrtime() - start) / static_cast<double>(TS_HRTIME_SECOND);
+  result.requests = 0;
+  for (int t = 0; t < options.threads; t++) {
+    result.requests += requests[t];
+    result.latencies.Merge(latencies[t]);
+  }
+  return result;
+}
+
+void PrintHeader() {
+  printf("%-8s %9s %8s %8s %9s %9s %6s %6s %9s", "script", "req/s", "p50_us", "p99_us",
+         "p99.9_us", "max_us", "scav", "full", "pause_ms");
+  for (int b = 0; b < GcStats::kBuckets; b++) printf(" %8s", GcStats::BucketNames()[b]);
+  printf("\n");
+}
+
+void Print(const string& name, Result* result, const GcStats& gc) {
+  printf("%-8s %9.0f %8.1f %8.1f %9.1f %9.1f %6lld %6lld %9.1f", name.c_str(),
+         result->requests / result->seconds, result->latencies.PercentileUs(50),
+         result->latencies.PercentileUs(99), result->latencies.PercentileUs(99.9),
+         result->latencies.PercentileUs(100), static_cast<long long>(gc.count[0]),
+         static_cast<long long>(gc.count[1]), gc.TotalPauseUs() / 1000.0);
+  for (int b = 0; b < GcStats::kBuckets; b++) printf(" %8lld", static_cast<long long>(gc.Pauses(b)));
+  printf("\n");
+  fflush(stdout);
+}
+
+vector<string> ParseNames(const char* text) {
+  vector<string> names;
+  for (const char* p = text; *p != '\0';) {
+    const char* comma = strchr(p, ',');
+    names.push_back(comma == NULL ? string(p) : string(p, comma - p));
+    if (comma == NULL) break;
+    p = comma + 1;
+  }
+  return names;
+}
+
+void Usage() {
+  fprintf(stderr,
+          "usage: gc_bench [--suite=strings,objects,wasm,test] [--option=key=value]...\n"
+          "                [--threads=1] [--rate=0] [--seconds=10] [--warmup=2]\n"
+          "                [--scripts=<dir>] [--v8_flags=<flags>]\n");
+}
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--suite=", 8) == 0) {
+      options->suite = ParseNames(arg + 8);
+    } else if (strncmp(arg, "--option=", 9) == 0) {
+      options->script_options.push_back(arg + 9);
+    } else if (strncmp(arg, "--threads=", 10) == 0) {
+      options->threads = atoi(arg + 10);
+    } else if (strncmp(arg, "--rate=", 7) == 0) {
+      options->rate = atof(arg + 7);
+    } else if (strncmp(arg, "--seconds=", 10) == 0) {
+      options->seconds = atof(arg + 10);
+    } else if (strncmp(arg, "--warmup=", 9) == 0) {
+      options->warmup = atof(arg + 9);
+    } else if (strncmp(arg, "--scripts=", 10) == 0) {
+      options->scripts = arg + 10;
+    } else if (strncmp(arg, "--v8_flags=", 11) == 0) {
+      options->v8_flags += string(" ") + (arg + 11);
+    } else {
+      Usage();
+      return false;
+    }
+  }
+  if (options->threads < 1) {
+    Usage();
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) return 1;
+
+  v8::V8::SetFlagsFromString(options.v8_flags.c_str());
+  if (!mock::Init()) return 1;
+
+  printf("v8 flags: %s\nthreads=%d ", options.v8_flags.c_str(), options.threads);
+  if (options.rate > 0) {
+    printf("rate=%.0f/s\n", options.rate);
+  } else {
+    printf("closed loop\n");
+  }
+  PrintHeader();
+  for (size_t i = 0; i < options.suite.size(); i++) {
+    void* instance = mock::NewInstance(ScriptPath(options, options.suite[i]), options.script_options);
+    if (instance == NULL) return 1;
+    Run(instance, options, options.warmup);
+
+    GcStats before = GcStats::Read();
+    Result result = Run(instance, options, options.seconds);
+    GcStats gc = GcStats::Read() - before;
+    Print(options.suite[i], &result, gc);
+    mock::DeleteInstance(instance);
+  }
+  return 0;
+}
@@ -0,0 +1,17 @@
+#!/bin/sh
+# Runs gc_bench once per V8 heap configuration.  V8 flags can only be
+# set before the isolate is created, so each one is a new process.
+# Arguments are passed on to gc_bench, e.g.
+#   bench/gc_configs.sh --rate=5000 --seconds=30
+BENCH=${GC_BENCH:-./gc_bench}
+
+for flags in "" \
+             "--max-semi-space-size=1" \
+             "--max-semi-space-size=16" \
+             "--max-semi-space-size=64" \
+             "--max-old-space-size=128" \
+             "--single-threaded-gc"; do
+  echo "== ${flags:-defaults}"
+  "$BENCH" --v8_flags="$flags" "$@" || exit 1
+  echo
+done
@@ -0,0 +1,83 @@
+/*
+ * The isolate's GC totals as published by the plugin in the
+ * plugin.v8.gc.<type>.* stats, for benchmarks to take differences of.
+ */
+#ifndef V8_BENCH_GC_STATS_H
+#define V8_BENCH_GC_STATS_H
+
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "ts_mock.h"
+
+struct GcStats {
+  enum { kTypes = 5, kBuckets = 6 };
+
+  static const char* const* TypeNames() {
+    static const char* const names[kTypes] = {"scavenge", "mark_sweep", "incremental_marking",
+                                              "weak_callbacks", "other"};
+    return names;
+  }
+
+  static const char* const* BucketNames() {
+    static const char* const names[kBuckets] = {"le_100us", "le_1ms", "le_5ms",
+                                                "le_10ms", "le_50ms", "gt_50ms"};
+    return names;
+  }
+
+  // The current totals.  The plugin folds its stats in once a second,
+  // so this waits for the next fold first.
+  static GcStats Read() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    GcStats stats;
+    for (int t = 0; t < kTypes; t++) {
+      std::string prefix = std::string("plugin.v8.gc.") + TypeNames()[t] + ".";
+      stats.count[t] = mock::Stat(prefix + "count");
+      stats.pause_us[t] = mock::Stat(prefix + "pause_us");
+      stats.freed_bytes[t] = mock::Stat(prefix + "freed_bytes");
+      for (int b = 0; b < kBuckets; b++) {
+        stats.pauses[t][b] = mock::Stat(prefix + "pause." + BucketNames()[b]);
+      }
+    }
+    return stats;
+  }
+
+  GcStats operator-(const GcStats& other) const {
+    GcStats diff;
+    for (int t = 0; t < kTypes; t++) {
+      diff.count[t] = count[t] - other.count[t];
+      diff.pause_us[t] = pause_us[t] - other.pause_us[t];
+      diff.freed_bytes[t] = freed_bytes[t] - other.freed_bytes[t];
+      for (int b = 0; b < kBuckets; b++) diff.pauses[t][b] = pauses[t][b] - other.pauses[t][b];
+    }
+    return diff;
+  }
+
+  int64_t TotalCount() const { return Sum(count); }
+  int64_t TotalPauseUs() const { return Sum(pause_us); }
+  int64_t TotalFreedBytes() const { return Sum(freed_bytes); }
+
+  // Pauses of every type in histogram bucket b.
+  int64_t Pauses(int b) const {
+    int64_t total = 0;
+    for (int t = 0; t < kTypes; t++) total += pauses[t][b];
+    return total;
+  }
+
+  int64_t count[kTypes];
+  int64_t pause_us[kTypes];
+  int64_t freed_bytes[kTypes];
+  int64_t pauses[kTypes][kBuckets];
+
+ private:
+  static int64_t Sum(const int64_t (&values)[kTypes]) {
+    int64_t total = 0;
+    for (int t = 0; t < kTypes; t++) total += values[t];
+    return total;
+  }
+};
+
+#endif  // V8_BENCH_GC_STATS_H
@@ -0,0 +1,177 @@
+/*
+ * What scripted remap rules cost: creates rules through
+ * TSRemapNewInstance up to each of the given counts, with a mix of
+ * scripts and options, and prints the time it took, the process RSS,
+ * the V8 heap and the marginal cost per rule of every step.
+ *
+ * Run from the repository root; see "Benchmarks" in README.md.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "v8.h"
+#include "ts_mock.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+struct Options {
+  string scripts = "bench/scripts";
+  string v8_flags = "--random-seed=1 --hash-seed=1";
+  vector<int> counts = {1000, 10000, 50000};
+  bool stats = false;
+};
+
+struct Sample {
+  int instances;
+  double seconds;
+  int64_t rss_bytes;
+  int64_t heap_used_bytes;
+  int64_t heap_total_bytes;
+};
+
+// The rule mix, cycled through: a script and the options it needs.
+struct Rule {
+  const char* script;
+  const char* option;
+};
+
+const Rule kRules[] = {
+    {"noop.js", "slow_ms=10"},
+    {"rewrite.js", "log_fields=true"},
+    {"map_get.js", "key=value"},
+    {"bindings.js", "binding=add"},
+    {"spin.js", "work=10"},
+    {NULL, NULL},  // test.js
+};
+
+int64_t Rss() {
+  long pages = 0, resident = 0;
+  FILE* file = fopen("/proc/self/statm", "r");
+  if (file == NULL) return 0;
+  if (fscanf(file, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(file);
+  return static_cast<int64_t>(resident) * sysconf(_SC_PAGESIZE);
+}
+
+// Waits for a heap sample covering every context created so far; the
+// plugin samples the heap on the task thread pool.
+bool WaitForHeapSample(int contexts) {
+  for (int i = 0; i < 300; i++) {
+    if (mock::Stat("plugin.v8.heap.used_bytes") > 0 &&
+        mock::Stat("plugin.v8.heap.native_contexts") >= contexts) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  return false;
+}
+
+Sample Measure(int instances, double seconds) {
+  if (!WaitForHeapSample(instances)) fprintf(stderr, "no heap sample, heap sizes are stale\n");
+  Sample sample;
+  sample.instances = instances;
+  sample.seconds = seconds;
+  sample.rss_bytes = Rss();
+  sample.heap_used_bytes = mock::Stat("plugin.v8.heap.used_bytes");
+  sample.heap_total_bytes = mock::Stat("plugin.v8.heap.total_bytes");
+  return sample;
+}
+
+void* NewRule(const Options& options, int i) {
+  const Rule& rule = kRules[i % (sizeof(kRules) / sizeof(kRules[0]))];
+  string script = rule.script != NULL ? options.scripts + "/" + rule.script : "test.js";
+  vector<string> rule_options;
+  if (rule.option != NULL) rule_options.push_back(rule.option);
+  // Sample the heap every second from the first rule on
+  if (i == 0) rule_options.push_back("heap_stats_interval=1");
+  if (!options.stats) rule_options.push_back("stats=false");
+  return mock::NewInstance(script, rule_options, "http://rule" + std::to_string(i) + ".test/");
+}
+
+void Print(const Sample& sample, const Sample& previous) {
+  int added = sample.instances - previous.instances;
+  double per_rule = added > 0 ? 1.0 / added : 0;
+  printf("%9d %9.2f %12.1f %9.1f %9.1f %9.1f %12.1f %12.1f\n", sample.instances, sample.seconds,
+         sample.seconds * 1e6 * per_rule, sample.rss_bytes / 1048576.0,
+         sample.heap_used_bytes / 1048576.0, sample.heap_total_bytes / 1048576.0,
+         (sample.rss_bytes - previous.rss_bytes) * per_rule / 1024,
+         (sample.heap_used_bytes - previous.heap_used_bytes) * per_rule / 1024);
+  fflush(stdout);
+}
+
+vector<int> ParseList(const char* text) {
+  vector<int> values;
+  for (const char* p = text; *p != '\0';) {
+    values.push_back(atoi(p));
+    p = strchr(p, ',');
+    if (p == NULL) break;
+    p++;
+  }
+  return values;
+}
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--counts=", 9) == 0) {
+      options->counts = ParseList(arg + 9);
+    } else if (strcmp(arg, "--stats") == 0) {
+      options->stats = true;
+    } else if (strncmp(arg, "--scripts=", 10) == 0) {
+      options->scripts = arg + 10;
+    } else if (strncmp(arg, "--v8_flags=", 11) == 0) {
+      options->v8_flags += string(" ") + (arg + 11);
+    } else {
+      fprintf(stderr,
+              "usage: instances_bench [--counts=1000,10000,50000] [--stats] [--scripts=<dir>]\n"
+              "                       [--v8_flags=<flags>]\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) return 1;
+
+  v8::V8::SetFlagsFromString(options.v8_flags.c_str());
+  if (!mock::Init()) return 1;
+
+  printf("%9s %9s %12s %9s %9s %9s %12s %12s\n", "rules", "seconds", "us/rule", "rss_MB",
+         "heap_MB", "heap_tot", "rss_KB/rule", "heap_KB/rule");
+  Sample previous = Measure(0, 0);
+  Print(previous, previous);
+
+  // Rules are only added, each step measuring the ones since the last;
+  // the heap does not shrink back if rules were deleted in between
+  vector<void*> instances;
+  for (size_t c = 0; c < options.counts.size(); c++) {
+    int count = options.counts[c];
+    TSHRTime start = TShrtime();
+    while (static_cast<int>(instances.size()) < count) {
+      void* instance = NewRule(options, static_cast<int>(instances.size()));
+      if (instance == NULL) return 1;
+      instances.push_back(instance);
+    }
+    double seconds = (TShrtime() - start) / static_cast<double>(TS_HRTIME_SECOND);
+    Sample sample = Measure(count, seconds);
+    Print(sample, previous);
+    previous = sample;
+  }
+
+  for (size_t i = 0; i < instances.size(); i++) mock::DeleteInstance(instances[i]);
+  return 0;
+}
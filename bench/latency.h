@@ -0,0 +1,45 @@
+/*
+ * Latency samples for the load benchmarks, with percentiles over all of
+ * them.
+ */
+#ifndef V8_BENCH_LATENCY_H
+#define V8_BENCH_LATENCY_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "ts/ts.h"
+
+class Latencies {
+ public:
+  void Add(TSHRTime ns) {
+    samples_.push_back(ns);
+    sorted_ = false;
+  }
+
+  void Merge(const Latencies& other) {
+    samples_.insert(samples_.end(), other.samples_.begin(), other.samples_.end());
+    sorted_ = false;
+  }
+
+  size_t Count() const { return samples_.size(); }
+
+  // Percentile p (0 - 100) in microseconds, 0 without samples.
+  double PercentileUs(double p) {
+    if (samples_.empty()) return 0;
+    if (!sorted_) {
+      std::sort(samples_.begin(), samples_.end());
+      sorted_ = true;
+    }
+    size_t index = static_cast<size_t>(p / 100 * (samples_.size() - 1) + 0.5);
+    return samples_[index] / static_cast<double>(TS_HRTIME_USECOND);
+  }
+
+ private:
+  std::vector<TSHRTime> samples_;
+  bool sorted_ = false;
+};
+
+#endif  // V8_BENCH_LATENCY_H
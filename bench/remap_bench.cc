@@ -0,0 +1,129 @@
+/*
+ * Microbenchmarks of the plugin running against the mocked ATS API:
+ * creating remap instances, remapping requests through scripts of
+ * different cost, the options map and the native bindings.
+ *
+ * Run from the repository root; see "Benchmarks" in README.md.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "v8.h"
+#include "ts_mock.h"
+
+using std::string;
+using std::vector;
+
+// Where the benchmark scripts are, --scripts=<dir>.
+static string scripts_dir = "bench/scripts";
+
+// V8 flags for every run.  A fixed seed keeps hash tables and the like
+// the same from run to run; --v8_flags=<flags> adds to them.
+static string v8_flags = "--random-seed=1 --hash-seed=1";
+
+static string Script(const string& name) {
+  return scripts_dir + "/" + name;
+}
+
+static mock::Request SampleRequest() {
+  mock::Request request;
+  request.host = "test.com";
+  request.path = "images/logo.png";
+  request.client_ip = "192.0.2.1";
+  request.headers.push_back(std::make_pair("Host", "test.com"));
+  request.headers.push_back(std::make_pair("User-Agent", "Mozilla/5.0 (X11; Linux x86_64)"));
+  request.headers.push_back(std::make_pair("Referer", "http://test.com/index.html"));
+  return request;
+}
+
+// Remap the same transaction over and over.  Options are a single
+// key=value, or empty.
+static void RunRemap(benchmark::State& state, const string& script, const string& option) {
+  vector<string> options;
+  if (!option.empty()) options.push_back(option);
+  void* instance = mock::NewInstance(Script(script), options);
+  if (instance == NULL) {
+    state.SkipWithError("unable to create the remap instance");
+    return;
+  }
+  TSHttpTxn txn = mock::NewTxn(SampleRequest());
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(mock::Remap(instance, txn));
+  }
+
+  mock::CloseTxn(txn);
+  mock::DestroyTxn(txn);
+  mock::DeleteInstance(instance);
+}
+
+// TSRemapNewInstance and TSRemapDeleteInstance of a trivial script:
+// reading and compiling it, and a new context.
+static void BM_NewInstance(benchmark::State& state) {
+  for (auto _ : state) {
+    void* instance = mock::NewInstance(Script("noop.js"));
+    if (instance == NULL) {
+      state.SkipWithError("unable to create the remap instance");
+      return;
+    }
+    mock::DeleteInstance(instance);
+  }
+}
+BENCHMARK(BM_NewInstance)->Unit(benchmark::kMicrosecond);
+
+static void BM_DoRemap(benchmark::State& state, const char* script, const char* option) {
+  RunRemap(state, script, option);
+}
+BENCHMARK_CAPTURE(BM_DoRemap, noop, "noop.js", "");
+BENCHMARK_CAPTURE(BM_DoRemap, noop_no_stats, "noop.js", "stats=false");
+BENCHMARK_CAPTURE(BM_DoRemap, noop_log_fields, "noop.js", "log_fields=true");
+BENCHMARK_CAPTURE(BM_DoRemap, rewrite, "rewrite.js", "");
+BENCHMARK_CAPTURE(BM_DoRemap, test_js, "../../test.js", "");
+
+// Property reads and writes of the options object, 100 per remap.
+static void BM_MapGet(benchmark::State& state) {
+  RunRemap(state, "map_get.js", "key=value");
+  state.SetItemsProcessed(state.iterations() * 100);
+}
+BENCHMARK(BM_MapGet);
+
+static void BM_MapSet(benchmark::State& state) {
+  RunRemap(state, "map_set.js", "key=value");
+  state.SetItemsProcessed(state.iterations() * 100);
+}
+BENCHMARK(BM_MapSet);
+
+// Calls of a native binding, 100 per remap.
+static void BM_Binding(benchmark::State& state, const char* binding) {
+  RunRemap(state, "bindings.js", string("binding=") + binding);
+  state.SetItemsProcessed(state.iterations() * 100);
+}
+BENCHMARK_CAPTURE(BM_Binding, performance_now, "now");
+BENCHMARK_CAPTURE(BM_Binding, metrics_add, "add");
+BENCHMARK_CAPTURE(BM_Binding, debug, "debug");
+BENCHMARK_CAPTURE(BM_Binding, request_url, "url");
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--scripts=", 10) == 0) {
+      scripts_dir = argv[i] + 10;
+    } else if (strncmp(argv[i], "--v8_flags=", 11) == 0) {
+      v8_flags += string(" ") + (argv[i] + 11);
+    } else {
+      fprintf(stderr, "unknown argument %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  v8::V8::SetFlagsFromString(v8_flags.c_str());
+  if (!mock::Init()) return 1;
+
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
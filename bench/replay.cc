@@ -0,0 +1,252 @@
+/*
+ * Replays requests captured with capture=<path> against a script, and
+ * optionally against a second version of it, through the mocked ATS
+ * API.  Prints the remap throughput, latency percentiles and how much
+ * the script allocates per request, and the requests the two versions
+ * decide differently.
+ *
+ * Run from the repository root; see "Benchmarks" in README.md.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "v8.h"
+#include "gc_stats.h"
+#include "latency.h"
+#include "ts_mock.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+struct Options {
+  string capture;
+  string script;
+  string compare;
+  vector<string> script_options;
+  string v8_flags = "--random-seed=1 --hash-seed=1";
+  int passes = 3;
+  int warmup_passes = 1;
+  size_t limit = 0;
+  size_t diffs = 10;
+};
+
+// What a script made of a request.
+struct Decision {
+  TSRemapStatus status;
+  string url;
+  bool operator==(const Decision& other) const {
+    return status == other.status && url == other.url;
+  }
+};
+
+struct Result {
+  double seconds;
+  Latencies latencies;
+  vector<Decision> decisions;
+  GcStats gc;
+};
+
+const char kMagic[8] = {'V', '8', 'C', 'A', 'P', 'T', '0', '1'};
+
+// Reads one length prefixed string of a capture record.
+bool ReadString(const char** p, const char* end, string* value) {
+  uint16_t len;
+  if (end - *p < static_cast<ptrdiff_t>(sizeof(len))) return false;
+  memcpy(&len, *p, sizeof(len));
+  *p += sizeof(len);
+  if (end - *p < len) return false;
+  value->assign(*p, len);
+  *p += len;
+  return true;
+}
+
+bool ParseRecord(const char* p, const char* end, mock::Request* request) {
+  uint64_t time_ms;
+  if (end - p < static_cast<ptrdiff_t>(sizeof(time_ms))) return false;
+  p += sizeof(time_ms);
+  if (!ReadString(&p, end, &request->method) || !ReadString(&p, end, &request->scheme) ||
+      !ReadString(&p, end, &request->host) || !ReadString(&p, end, &request->path) ||
+      !ReadString(&p, end, &request->client_ip)) {
+    return false;
+  }
+  uint16_t count;
+  if (end - p < static_cast<ptrdiff_t>(sizeof(count))) return false;
+  memcpy(&count, p, sizeof(count));
+  p += sizeof(count);
+  for (int i = 0; i < count; i++) {
+    std::pair<string, string> header;
+    if (!ReadString(&p, end, &header.first) || !ReadString(&p, end, &header.second)) return false;
+    request->headers.push_back(header);
+  }
+  return true;
+}
+
+// Reads the requests of a capture file, see RequestCapture in v8.cc.
+bool ReadCapture(const string& path, size_t limit, vector<mock::Request>* requests) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == NULL) {
+    fprintf(stderr, "unable to open %s\n", path.c_str());
+    return false;
+  }
+  char magic[sizeof(kMagic)];
+  if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+    fprintf(stderr, "%s is not a capture file\n", path.c_str());
+    fclose(file);
+    return false;
+  }
+
+  vector<char> record;
+  uint32_t len;
+  while ((limit == 0 || requests->size() < limit) && fread(&len, sizeof(len), 1, file) == 1) {
+    record.resize(len);
+    if (len > 0 && fread(&record[0], len, 1, file) != 1) {
+      fprintf(stderr, "%s: truncated record, stopping there\n", path.c_str());
+      break;
+    }
+    mock::Request request;
+    if (!ParseRecord(record.data(), record.data() + len, &request)) {
+      fprintf(stderr, "%s: malformed record, skipped\n", path.c_str());
+      continue;
+    }
+    requests->push_back(request);
+  }
+  fclose(file);
+  return true;
+}
+
+// Run every request through the script once per pass, each in a new
+// transaction.  Decisions are taken from the first measured pass.
+bool Replay(const string& script, const Options& options, const vector<mock::Request>& requests,
+            Result* result) {
+  void* instance = mock::NewInstance(script, options.script_options);
+  if (instance == NULL) return false;
+
+  GcStats gc_start;
+  TSHRTime total = 0;
+  for (int pass = -options.warmup_passes; pass < options.passes; pass++) {
+    if (pass == 0) gc_start = GcStats::Read();
+    for (size_t i = 0; i < requests.size(); i++) {
+      TSHttpTxn txn = mock::NewTxn(requests[i]);
+      TSHRTime start = TShrtime();
+      TSRemapStatus status = mock::Remap(instance, txn);
+      mock::CloseTxn(txn);
+      TSHRTime elapsed = TShrtime() - start;
+      if (pass >= 0) {
+        total += elapsed;
+        result->latencies.Add(elapsed);
+      }
+      if (pass == 0) {
+        Decision decision = {status, mock::Url(txn)};
+        result->decisions.push_back(decision);
+      }
+      mock::DestroyTxn(txn);
+    }
+  }
+  result->gc = GcStats::Read() - gc_start;
+  result->seconds = total / static_cast<double>(TS_HRTIME_SECOND);
+
+  mock::DeleteInstance(instance);
+  return true;
+}
+
+void PrintResult(const string& script, Result* result) {
+  double requests = static_cast<double>(result->latencies.Count());
+  printf("%-24s %10.0f %8.1f %8.1f %8.1f %12.0f %6llu %10.1f\n", script.c_str(),
+         requests / result->seconds, result->latencies.PercentileUs(50),
+         result->latencies.PercentileUs(99), result->latencies.PercentileUs(99.9),
+         result->gc.TotalFreedBytes() / requests,
+         static_cast<unsigned long long>(result->gc.TotalCount()),
+         result->gc.TotalPauseUs() / 1000.0);
+}
+
+void Usage() {
+  fprintf(stderr,
+          "usage: replay --capture=<file> --script=<js> [--compare=<js>] [--option=key=value]...\n"
+          "              [--passes=3] [--warmup_passes=1] [--limit=N] [--diffs=10]\n"
+          "              [--v8_flags=<flags>]\n");
+}
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--capture=", 10) == 0) {
+      options->capture = arg + 10;
+    } else if (strncmp(arg, "--script=", 9) == 0) {
+      options->script = arg + 9;
+    } else if (strncmp(arg, "--compare=", 10) == 0) {
+      options->compare = arg + 10;
+    } else if (strncmp(arg, "--option=", 9) == 0) {
+      options->script_options.push_back(arg + 9);
+    } else if (strncmp(arg, "--passes=", 9) == 0) {
+      options->passes = atoi(arg + 9);
+    } else if (strncmp(arg, "--warmup_passes=", 16) == 0) {
+      options->warmup_passes = atoi(arg + 16);
+    } else if (strncmp(arg, "--limit=", 8) == 0) {
+      options->limit = strtoul(arg + 8, NULL, 10);
+    } else if (strncmp(arg, "--diffs=", 8) == 0) {
+      options->diffs = strtoul(arg + 8, NULL, 10);
+    } else if (strncmp(arg, "--v8_flags=", 11) == 0) {
+      options->v8_flags += string(" ") + (arg + 11);
+    } else {
+      Usage();
+      return false;
+    }
+  }
+  if (options->capture.empty() || options->script.empty() || options->passes < 1) {
+    Usage();
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) return 1;
+
+  vector<mock::Request> requests;
+  if (!ReadCapture(options.capture, options.limit, &requests)) return 1;
+  if (requests.empty()) {
+    fprintf(stderr, "no requests in %s\n", options.capture.c_str());
+    return 1;
+  }
+
+  v8::V8::SetFlagsFromString(options.v8_flags.c_str());
+  if (!mock::Init()) return 1;
+
+  printf("%zu requests from %s, %d passes\n", requests.size(), options.capture.c_str(),
+         options.passes);
+  printf("%-24s %10s %8s %8s %8s %12s %6s %10s\n", "script", "requests/s", "p50_us", "p99_us",
+         "p99.9_us", "alloc_B/req", "gcs", "gc_ms");
+
+  Result result;
+  if (!Replay(options.script, options, requests, &result)) return 1;
+  PrintResult(options.script, &result);
+  if (options.compare.empty()) return 0;
+
+  Result other;
+  if (!Replay(options.compare, options, requests, &other)) return 1;
+  PrintResult(options.compare, &other);
+
+  size_t differ = 0;
+  for (size_t i = 0; i < requests.size(); i++) {
+    const Decision& a = result.decisions[i];
+    const Decision& b = other.decisions[i];
+    if (a == b) continue;
+    if (differ++ < options.diffs) {
+      printf("  %s %s://%s/%s: %d %s | %d %s\n", requests[i].method.c_str(),
+             requests[i].scheme.c_str(), requests[i].host.c_str(), requests[i].path.c_str(),
+             a.status, a.url.c_str(), b.status, b.url.c_str());
+    }
+  }
+  printf("%zu of %zu decisions differ\n", differ, requests.size());
+  return 0;
+}
@@ -0,0 +1,25 @@
+// Calls one native binding 100 times per request; the "binding"
+// option picks which.
+var kCalls = 100;
+var counter = metrics.counter('calls');
+
+var bindings = {
+  now: function(request) {
+    for (var i = 0; i < kCalls; i++) performance.now();
+  },
+  add: function(request) {
+    for (var i = 0; i < kCalls; i++) metrics.add(counter, 1);
+  },
+  debug: function(request) {
+    for (var i = 0; i < kCalls; i++) debug('x');
+  },
+  url: function(request) {
+    for (var i = 0; i < kCalls; i++) request.url;
+  }
+};
+var run = bindings[options.binding];
+
+function Process(request) {
+  run(request);
+  return 0;
+}
@@ -0,0 +1,8 @@
+// Reads the options map 100 times per request.
+function Process(request) {
+  var n = 0;
+  for (var i = 0; i < 100; i++) {
+    n += options.key.length;
+  }
+  return n > 0 ? 0 : 1;
+}
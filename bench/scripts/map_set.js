@@ -0,0 +1,7 @@
+// Writes the options map 100 times per request.
+function Process(request) {
+  for (var i = 0; i < 100; i++) {
+    options.key = 'value';
+  }
+  return 0;
+}
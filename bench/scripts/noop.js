@@ -0,0 +1,4 @@
+// Does nothing; measures the fixed cost of a remap.
+function Process(request) {
+  return 0;
+}
@@ -0,0 +1,21 @@
+// Allocates object graphs on every request and keeps some of them in
+// a bounded cache, so objects survive long enough to be promoted and
+// the old generation has to be collected too.
+var kCacheSize = Number(options.cache_size || 10000);
+var cache = new Map();
+var next = 0;
+
+function Process(request) {
+  var entry = {
+    url: request.url,
+    seen: performance.now(),
+    tags: [],
+    children: []
+  };
+  for (var i = 0; i < 16; i++) {
+    entry.tags.push({ name: 'tag' + i, weight: i * 0.5 });
+    entry.children.push([i, i + 1, i + 2]);
+  }
+  cache.set(next++ % kCacheSize, entry);
+  return 0;
+}
@@ -0,0 +1,9 @@
+// Reads the request and rewrites it, like a typical routing script.
+function Process(request) {
+  if (request.method != 'GET' || request.userAgent.indexOf('bot') >= 0) {
+    return 0;
+  }
+  request.host = 'origin-' + (request.path.length % 4) + '.test';
+  request.path = 'static/' + request.path;
+  return 1;
+}
@@ -0,0 +1,26 @@
+// Burns a fixed amount of CPU per request, set by the "work" option
+// (loop iterations), so lock contention can be measured at a known
+// script cost.
+var kWork = Number(options.work || 0);
+// Keeps the loop from being optimized away.
+var sink = 0;
+
+function Spin() {
+  var x = 0;
+  for (var i = 0; i < kWork; i++) x = (x * 31 + i) | 0;
+  return x;
+}
+
+function Process(request) {
+  sink ^= Spin();
+  return 0;
+}
+
+function ProcessBatch(requests) {
+  var decisions = [];
+  for (var i = 0; i < requests.length; i++) {
+    sink ^= Spin();
+    decisions.push(0);
+  }
+  return decisions;
+}
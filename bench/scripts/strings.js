@@ -0,0 +1,19 @@
+// Builds and takes apart short lived strings on every request, the
+// way header and URL munging scripts do.  Mostly young generation
+// garbage.
+function Process(request) {
+  var parts = request.path.split('/');
+  var key = '';
+  for (var i = 0; i < 20; i++) {
+    var segment = parts[i % parts.length].toUpperCase() + '-' + i;
+    key = key.length > 200 ? segment : key + '/' + segment;
+  }
+  var line = JSON.stringify({
+    url: request.url,
+    host: request.host,
+    agent: request.userAgent,
+    key: key
+  });
+  var tokens = line.replace(/[^a-z0-9]+/gi, ' ').split(' ');
+  return tokens.join('.').length > 0 ? 0 : 1;
+}
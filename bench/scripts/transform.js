@@ -0,0 +1,53 @@
+// TransformBody for bench/transform_check.cc; the "mode" option picks
+// what it does with the body.
+var mode = options.mode;
+
+function Process(request) {
+  return 0;
+}
+
+var transforms = {
+  // Leave every chunk alone.
+  pass: function(chunk, state) {
+    return undefined;
+  },
+  // Write over every chunk but pass it on; the client must still get
+  // the body as it was.
+  scribble: function(chunk, state) {
+    if (chunk !== null) new Uint8Array(chunk).fill(0x2a);
+    return undefined;
+  },
+  // Upper case letters in place and send the chunk, then a trailer.
+  upper: function(chunk, state) {
+    if (chunk === null) return '<end>';
+    var bytes = new Uint8Array(chunk);
+    for (var i = 0; i < bytes.length; i++) {
+      if (bytes[i] >= 0x61 && bytes[i] <= 0x7a) bytes[i] -= 0x20;
+    }
+    return chunk;
+  },
+  // Replace the first chunk and throw on the second.
+  throw: function(chunk, state) {
+    state.calls = (state.calls || 0) + 1;
+    if (state.calls == 2) throw new Error('thrown by transform.js');
+    return 'x';
+  },
+  // Keep every chunk and send them all at the end.
+  retain: function(chunk, state) {
+    if (!state.kept) state.kept = [];
+    if (chunk !== null) {
+      state.kept.push(chunk);
+      return null;
+    }
+    var length = 0;
+    for (var i = 0; i < state.kept.length; i++) length += state.kept[i].byteLength;
+    var body = new Uint8Array(length);
+    var offset = 0;
+    for (var i = 0; i < state.kept.length; i++) {
+      body.set(new Uint8Array(state.kept[i]), offset);
+      offset += state.kept[i].byteLength;
+    }
+    return body;
+  }
+};
+var TransformBody = transforms[mode];
@@ -0,0 +1,26 @@
+// Instantiates a WebAssembly module on every request, as scripts that
+// sandbox untrusted logic do, and feeds it the request bytes through
+// a typed array.  Instances and buffers live outside the JS heap but
+// are only freed by the GC.
+//   (module
+//     (func (export "add") (param i32 i32) (result i32)
+//       get_local 0
+//       get_local 1
+//       i32.add))
+var bytes = new Uint8Array([
+  0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x07, 0x01,
+  0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, 0x03, 0x02, 0x01, 0x00, 0x07,
+  0x07, 0x01, 0x03, 0x61, 0x64, 0x64, 0x00, 0x00, 0x0a, 0x09, 0x01,
+  0x07, 0x00, 0x20, 0x00, 0x20, 0x01, 0x6a, 0x0b
+]);
+var module = new WebAssembly.Module(bytes);
+
+function Process(request) {
+  var add = new WebAssembly.Instance(module).exports.add;
+  var url = request.url;
+  var data = new Uint8Array(url.length * 16);
+  for (var i = 0; i < data.length; i++) data[i] = url.charCodeAt(i % url.length);
+  var sum = 0;
+  for (var i = 0; i < data.length; i++) sum = add(sum, data[i]);
+  return sum < 0 ? 1 : 0;
+}
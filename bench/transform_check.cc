@@ -0,0 +1,129 @@
+/*
+ * Streams response bodies through TransformBody over the mocked
+ * IOBuffers and VIOs and checks what the client gets: chunks passed
+ * on, replaced, written over by the script, kept past their call, and
+ * a script that throws part way through.  Bodies come in several
+ * blocks, some larger than what the transform buffers, so blocks are
+ * also taken in parts.
+ *
+ * Prints one line per case and exits with 1 if any failed.  Run from
+ * the repository root; see "Benchmarks" in README.md.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "v8.h"
+#include "ts_mock.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+struct Case {
+  string name;
+  string mode;
+  int status;
+  vector<string> body;
+  string expected;
+  // Delete the rule before the response arrives, as a config reload
+  // can.
+  bool delete_first;
+};
+
+string Join(const vector<string>& blocks, size_t from = 0) {
+  string joined;
+  for (size_t i = from; i < blocks.size(); i++) joined += blocks[i];
+  return joined;
+}
+
+string Upper(string text) {
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] >= 'a' && text[i] <= 'z') text[i] -= 'a' - 'A';
+  }
+  return text;
+}
+
+// A body of small blocks and one larger than the transform's 64KB of
+// buffered output.
+vector<string> Body() {
+  vector<string> body;
+  body.push_back("hello, ");
+  body.push_back("world\n");
+  string large;
+  while (large.size() < 100000) large += "the quick brown fox jumps over the lazy dog\n";
+  body.push_back(large);
+  body.push_back("bye\n");
+  return body;
+}
+
+vector<Case> Cases() {
+  vector<string> body = Body();
+  vector<Case> cases;
+  cases.push_back({"pass", "pass", 200, body, Join(body), false});
+  cases.push_back({"scribble", "scribble", 200, body, Join(body), false});
+  cases.push_back({"upper", "upper", 200, body, Upper(Join(body)) + "<end>", false});
+  cases.push_back({"not_ok", "upper", 404, body, Join(body), false});
+  cases.push_back({"throw", "throw", 200, body, "x" + Join(body, 1), false});
+  cases.push_back({"retain", "retain", 200, body, Join(body), false});
+  cases.push_back({"deleted_rule", "upper", 200, body, Upper(Join(body)) + "<end>", true});
+  cases.push_back({"empty", "upper", 200, vector<string>(), "<end>", false});
+  return cases;
+}
+
+bool Run(const string& scripts, const Case& c) {
+  vector<string> options;
+  options.push_back("mode=" + c.mode);
+  options.push_back("stats=false");
+  void* instance = mock::NewInstance(scripts + "/transform.js", options);
+  if (instance == NULL) return false;
+
+  TSHttpTxn txn = mock::NewTxn(mock::Request());
+  mock::Remap(instance, txn);
+  if (c.delete_first) mock::DeleteInstance(instance);
+  string got = mock::Respond(txn, c.status, c.body);
+  mock::CloseTxn(txn);
+  mock::DestroyTxn(txn);
+  if (!c.delete_first) mock::DeleteInstance(instance);
+
+  if (got == c.expected) {
+    printf("ok     %s\n", c.name.c_str());
+    return true;
+  }
+  size_t diff = 0;
+  while (diff < got.size() && diff < c.expected.size() && got[diff] == c.expected[diff]) diff++;
+  printf("FAILED %s: got %zu bytes, expected %zu, first difference at byte %zu\n",
+         c.name.c_str(), got.size(), c.expected.size(), diff);
+  return false;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  string scripts = "bench/scripts";
+  string v8_flags = "--random-seed=1 --hash-seed=1";
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--scripts=", 10) == 0) {
+      scripts = argv[i] + 10;
+    } else if (strncmp(argv[i], "--v8_flags=", 11) == 0) {
+      v8_flags += string(" ") + (argv[i] + 11);
+    } else {
+      fprintf(stderr, "usage: %s [--scripts=<dir>] [--v8_flags=<flags>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  v8::V8::SetFlagsFromString(v8_flags.c_str());
+  if (!mock::Init()) return 1;
+
+  vector<Case> cases = Cases();
+  int failed = 0;
+  for (size_t i = 0; i < cases.size(); i++) {
+    if (!Run(scripts, cases[i])) failed++;
+  }
+  printf("%d of %zu cases failed\n", failed, cases.size());
+  return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * The remap plugin interface, as far as v8.cc uses it.  See ts.h.
+ */
+#ifndef V8_BENCH_REMAP_H
+#define V8_BENCH_REMAP_H
+
+#include "ts/ts.h"
+
+typedef struct {
+  unsigned long size;
+  unsigned long tsremap_version;
+} TSRemapInterface;
+
+typedef struct {
+  TSMBuffer requestBufp;
+  TSMLoc requestHdrp;
+  TSMLoc mapFromUrl;
+  TSMLoc mapToUrl;
+  TSMLoc requestUrl;
+  int redirect;
+} TSRemapRequestInfo;
+
+typedef enum {
+  TSREMAP_NO_REMAP = 0,
+  TSREMAP_DID_REMAP = 1,
+  TSREMAP_NO_REMAP_STOP = 2,
+  TSREMAP_DID_REMAP_STOP = 3,
+  TSREMAP_ERROR = -1
+} TSRemapStatus;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+TSReturnCode TSRemapInit(TSRemapInterface* api_info, char* errbuf, int errbuf_size);
+TSReturnCode TSRemapNewInstance(int argc, char* argv[], void** ih, char* errbuf, int errbuf_size);
+void TSRemapDeleteInstance(void* ih);
+TSRemapStatus TSRemapDoRemap(void* ih, TSHttpTxn rh, TSRemapRequestInfo* rri);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // V8_BENCH_REMAP_H
@@ -0,0 +1,205 @@
+/*
+ * A minimal stand-in for the ATS plugin API, declaring only what v8.cc
+ * uses, with the same signatures.  It is implemented by ts_mock.cc so
+ * the plugin can be linked into benchmarks without a running ATS.
+ */
+#ifndef V8_BENCH_TS_H
+#define V8_BENCH_TS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+typedef int64_t TSHRTime;
+
+typedef struct tsapi_httptxn* TSHttpTxn;
+typedef struct tsapi_cont* TSCont;
+typedef struct tsapi_mutex* TSMutex;
+typedef struct tsapi_action* TSAction;
+typedef struct tsapi_mbuffer* TSMBuffer;
+typedef struct tsapi_mloc* TSMLoc;
+typedef struct tsapi_textlogobject* TSTextLogObject;
+typedef struct tsapi_thread* TSThread;
+// A VConn is a continuation, as in ATS.
+typedef struct tsapi_cont* TSVConn;
+typedef struct tsapi_vio* TSVIO;
+typedef struct tsapi_iobuffer* TSIOBuffer;
+typedef struct tsapi_bufferreader* TSIOBufferReader;
+typedef struct tsapi_bufferblock* TSIOBufferBlock;
+
+typedef void* (*TSThreadFunc)(void* data);
+
+typedef enum { TS_ERROR = -1, TS_SUCCESS = 0 } TSReturnCode;
+
+typedef enum {
+  TS_EVENT_NONE = 0,
+  TS_EVENT_IMMEDIATE = 1,
+  TS_EVENT_TIMEOUT = 2,
+  TS_EVENT_ERROR = 3,
+  TS_EVENT_VCONN_WRITE_READY = 103,
+  TS_EVENT_VCONN_WRITE_COMPLETE = 104,
+  TS_EVENT_HTTP_CONTINUE = 60000,
+  TS_EVENT_HTTP_ERROR = 60001,
+  TS_EVENT_HTTP_READ_RESPONSE_HDR = 60006,
+  TS_EVENT_HTTP_POST_REMAP = 60017,
+  TS_EVENT_HTTP_TXN_CLOSE = 60012,
+  TS_EVENT_HTTP_CACHE_LOOKUP_COMPLETE = 60015,
+  TS_EVENT_LIFECYCLE_MSG = 60200
+} TSEvent;
+
+typedef enum {
+  TS_HTTP_TXN_CLOSE_HOOK,
+  TS_HTTP_POST_REMAP_HOOK,
+  TS_HTTP_CACHE_LOOKUP_COMPLETE_HOOK,
+  TS_HTTP_READ_RESPONSE_HDR_HOOK,
+  TS_HTTP_RESPONSE_TRANSFORM_HOOK,
+  TS_HTTP_LAST_HOOK
+} TSHttpHookID;
+
+typedef enum { TS_LIFECYCLE_MSG_HOOK } TSLifecycleHookID;
+
+typedef enum {
+  TS_CACHE_LOOKUP_MISS,
+  TS_CACHE_LOOKUP_HIT_STALE,
+  TS_CACHE_LOOKUP_HIT_FRESH,
+  TS_CACHE_LOOKUP_SKIPPED
+} TSCacheLookupResult;
+
+typedef enum { TS_HTTP_STATUS_NONE = 0, TS_HTTP_STATUS_OK = 200 } TSHttpStatus;
+
+typedef enum { TS_RECORDDATATYPE_NULL = 0, TS_RECORDDATATYPE_INT = 1 } TSRecordDataType;
+typedef enum { TS_STAT_PERSISTENT = 1, TS_STAT_NON_PERSISTENT } TSStatPersistence;
+typedef enum { TS_STAT_SYNC_SUM = 0, TS_STAT_SYNC_COUNT, TS_STAT_SYNC_AVG } TSStatSync;
+typedef enum { TS_THREAD_POOL_NET, TS_THREAD_POOL_TASK } TSThreadPool;
+typedef enum { TS_USER_ARGS_TXN } TSUserArgType;
+
+typedef struct {
+  const char* tag;
+  const void* data;
+  size_t data_size;
+} TSPluginMsg;
+
+#define TS_HRTIME_NSECOND (1LL)
+#define TS_HRTIME_USECOND (1000LL)
+#define TS_HRTIME_MSECOND (1000000LL)
+#define TS_HRTIME_SECOND (1000000000LL)
+
+#define TS_LOG_MODE_ADD_TIMESTAMP 1
+
+#define TS_NULL_MLOC ((TSMLoc)0)
+
+typedef int (*TSEventFunc)(TSCont contp, TSEvent event, void* edata);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void TSDebug(const char* tag, const char* format_str, ...);
+void TSError(const char* fmt, ...);
+
+const char* TSConfigDirGet(void);
+const char* TSRuntimeDirGet(void);
+
+TSHRTime TShrtime(void);
+void* TSmalloc(size_t size);
+void TSfree(void* ptr);
+
+TSMutex TSMutexCreate(void);
+
+TSCont TSContCreate(TSEventFunc funcp, TSMutex mutexp);
+void TSContDestroy(TSCont contp);
+void TSContDataSet(TSCont contp, void* data);
+void* TSContDataGet(TSCont contp);
+TSAction TSContScheduleOnPool(TSCont contp, TSHRTime timeout, TSThreadPool tp);
+TSAction TSContScheduleEveryOnPool(TSCont contp, TSHRTime every, TSThreadPool tp);
+void TSActionCancel(TSAction actionp);
+
+TSThread TSThreadCreate(TSThreadFunc func, void* data);
+
+void TSLifecycleHookAdd(TSLifecycleHookID id, TSCont contp);
+void TSHttpTxnHookAdd(TSHttpTxn txnp, TSHttpHookID id, TSCont contp);
+TSReturnCode TSHttpTxnReenable(TSHttpTxn txnp, TSEvent event);
+int TSContCall(TSCont contp, TSEvent event, void* edata);
+
+TSReturnCode TSTextLogObjectCreate(const char* filename, int mode, TSTextLogObject* new_log_obj);
+TSReturnCode TSTextLogObjectWrite(TSTextLogObject the_object, const char* format, ...);
+TSReturnCode TSTextLogObjectRollingEnabledSet(TSTextLogObject the_object, int rolling_enabled);
+
+int TSStatCreate(const char* the_name, TSRecordDataType the_type, TSStatPersistence persist,
+                 TSStatSync sync);
+TSReturnCode TSStatFindName(const char* name, int* idp);
+void TSStatIntIncrement(int the_stat, int64_t amount);
+void TSStatIntSet(int the_stat, int64_t value);
+
+TSReturnCode TSUserArgIndexReserve(TSUserArgType type, const char* name, const char* description,
+                                   int* arg_idx);
+void TSUserArgSet(void* data, int arg_idx, void* arg);
+void* TSUserArgGet(void* data, int arg_idx);
+
+TSReturnCode TSHttpTxnClientReqGet(TSHttpTxn txnp, TSMBuffer* bufp, TSMLoc* offset);
+const struct sockaddr* TSHttpTxnClientAddrGet(TSHttpTxn txnp);
+TSReturnCode TSHttpTxnServerRespGet(TSHttpTxn txnp, TSMBuffer* bufp, TSMLoc* offset);
+TSReturnCode TSHttpTxnCachedRespGet(TSHttpTxn txnp, TSMBuffer* bufp, TSMLoc* offset);
+TSReturnCode TSHttpTxnCacheLookupStatusGet(TSHttpTxn txnp, int* lookup_status);
+void TSHttpTxnUntransformedRespCache(TSHttpTxn txnp, int on);
+void TSHttpTxnTransformedRespCache(TSHttpTxn txnp, int on);
+
+TSReturnCode TSHandleMLocRelease(TSMBuffer bufp, TSMLoc parent, TSMLoc mloc);
+
+TSReturnCode TSHttpHdrUrlGet(TSMBuffer bufp, TSMLoc offset, TSMLoc* locp);
+const char* TSHttpHdrMethodGet(TSMBuffer bufp, TSMLoc hdr_loc, int* length);
+TSHttpStatus TSHttpHdrStatusGet(TSMBuffer bufp, TSMLoc offset);
+
+char* TSUrlStringGet(TSMBuffer bufp, TSMLoc offset, int* length);
+const char* TSUrlSchemeGet(TSMBuffer bufp, TSMLoc offset, int* length);
+const char* TSUrlHostGet(TSMBuffer bufp, TSMLoc offset, int* length);
+const char* TSUrlPathGet(TSMBuffer bufp, TSMLoc offset, int* length);
+TSReturnCode TSUrlHostSet(TSMBuffer bufp, TSMLoc offset, const char* value, int length);
+TSReturnCode TSUrlPathSet(TSMBuffer bufp, TSMLoc offset, const char* value, int length);
+
+int TSMimeHdrFieldsCount(TSMBuffer bufp, TSMLoc hdr);
+TSMLoc TSMimeHdrFieldGet(TSMBuffer bufp, TSMLoc hdr, int idx);
+const char* TSMimeHdrFieldNameGet(TSMBuffer bufp, TSMLoc hdr, TSMLoc field, int* length);
+TSMLoc TSMimeHdrFieldFind(TSMBuffer bufp, TSMLoc hdr, const char* name, int length);
+const char* TSMimeHdrFieldValueStringGet(TSMBuffer bufp, TSMLoc hdr, TSMLoc field, int idx,
+                                         int* value_len_ptr);
+TSReturnCode TSMimeHdrFieldCreateNamed(TSMBuffer bufp, TSMLoc mh_mloc, const char* name,
+                                       int name_len, TSMLoc* locp);
+TSReturnCode TSMimeHdrFieldValueStringSet(TSMBuffer bufp, TSMLoc hdr, TSMLoc field, int idx,
+                                          const char* value, int length);
+TSReturnCode TSMimeHdrFieldAppend(TSMBuffer bufp, TSMLoc hdr, TSMLoc field);
+
+TSVConn TSTransformCreate(TSEventFunc event_funcp, TSHttpTxn txnp);
+TSVConn TSTransformOutputVConnGet(TSVConn connp);
+int TSVConnClosedGet(TSVConn connp);
+TSVIO TSVConnWriteVIOGet(TSVConn connp);
+TSVIO TSVConnWrite(TSVConn connp, TSCont contp, TSIOBufferReader readerp, int64_t nbytes);
+void TSVConnShutdown(TSVConn connp, int read, int write);
+
+TSIOBuffer TSVIOBufferGet(TSVIO viop);
+TSIOBufferReader TSVIOReaderGet(TSVIO viop);
+TSCont TSVIOContGet(TSVIO viop);
+int64_t TSVIONTodoGet(TSVIO viop);
+int64_t TSVIONDoneGet(TSVIO viop);
+void TSVIONDoneSet(TSVIO viop, int64_t ndone);
+void TSVIONBytesSet(TSVIO viop, int64_t nbytes);
+void TSVIOReenable(TSVIO viop);
+
+TSIOBuffer TSIOBufferCreate(void);
+void TSIOBufferDestroy(TSIOBuffer bufp);
+int64_t TSIOBufferWrite(TSIOBuffer bufp, const void* buf, int64_t length);
+int64_t TSIOBufferCopy(TSIOBuffer bufp, TSIOBufferReader readerp, int64_t length, int64_t offset);
+TSIOBufferReader TSIOBufferReaderAlloc(TSIOBuffer bufp);
+void TSIOBufferReaderFree(TSIOBufferReader readerp);
+int64_t TSIOBufferReaderAvail(TSIOBufferReader readerp);
+void TSIOBufferReaderConsume(TSIOBufferReader readerp, int64_t nbytes);
+TSIOBufferBlock TSIOBufferReaderStart(TSIOBufferReader readerp);
+TSIOBufferBlock TSIOBufferBlockNext(TSIOBufferBlock blockp);
+const char* TSIOBufferBlockReadStart(TSIOBufferBlock blockp, TSIOBufferReader readerp,
+                                     int64_t* avail);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // V8_BENCH_TS_H
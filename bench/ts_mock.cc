@@ -0,0 +1,960 @@
+/*
+ * An in-process implementation of the ATS API declared in ts/ts.h,
+ * good enough to run v8.cc outside of traffic_server: MIME headers and
+ * URLs of a client request, transactions with hooks and user args, a
+ * single thread task pool for scheduled continuations, stats and text
+ * logs written to files.  Responses are only a status; mock::Respond
+ * runs the response hooks and streams a body through the transforms
+ * they add, over in-memory IOBuffers and VIOs.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ts/remap.h"
+#include "ts_mock.h"
+
+using std::string;
+using std::vector;
+
+struct tsapi_mutex {
+};
+
+struct tsapi_cont {
+  TSEventFunc func;
+  void* data;
+  // Transforms: the VIO writing the body to it, the client side it
+  // writes to, and whether it was closed.
+  TSVIO write_vio = NULL;
+  TSVConn output = NULL;
+  int closed = 0;
+  // Client sides: the VIO the transform writes with and what it wrote.
+  TSVIO output_vio = NULL;
+  string received;
+  bool shutdown = false;
+};
+
+struct tsapi_vio {
+  TSCont cont;
+  TSIOBufferReader reader;
+  int64_t nbytes;
+  int64_t ndone;
+  // The client side, for the VIOs transforms write with.
+  TSVConn sink;
+};
+
+// Blocks are never freed before their buffer; data may be shared with
+// blocks of other buffers, as TSIOBufferCopy shares it in ATS.
+struct tsapi_bufferblock {
+  std::shared_ptr<const string> data;
+  size_t begin;
+  size_t len;
+  // Offset of the block in its buffer.
+  int64_t start;
+  TSIOBuffer buffer;
+  size_t index;
+};
+
+struct tsapi_iobuffer {
+  std::deque<tsapi_bufferblock> blocks;
+  int64_t size = 0;
+};
+
+struct tsapi_bufferreader {
+  TSIOBuffer buffer;
+  // Offset of the first unread byte in the buffer.
+  int64_t pos;
+};
+
+struct tsapi_action {
+  TSCont cont;
+  TSHRTime when;
+  // Period in nanoseconds, 0 for one-shot actions.
+  TSHRTime every;
+  bool cancelled;
+};
+
+struct tsapi_textlogobject {
+  FILE* file;
+  bool timestamp;
+  std::mutex mutex;
+};
+
+struct tsapi_thread {
+};
+
+// MIME locations point into the request they belong to.
+struct tsapi_mloc {
+};
+
+namespace {
+
+struct Field : tsapi_mloc {
+  string name;
+  string value;
+};
+
+}  // namespace
+
+// The client request of a transaction; its header and URL locations
+// are the two tags.
+struct tsapi_mbuffer {
+  tsapi_mloc hdr_loc;
+  tsapi_mloc url_loc;
+  // Responses only.
+  int status = 0;
+  string method;
+  string scheme;
+  string host;
+  string path;
+  std::list<Field> fields;
+};
+
+static const int kMaxUserArgs = 16;
+
+struct tsapi_httptxn {
+  tsapi_mbuffer request;
+  tsapi_mbuffer response;
+  struct sockaddr_storage client;
+  void* args[kMaxUserArgs];
+  vector<TSCont> hooks[TS_HTTP_LAST_HOOK];
+
+  std::mutex mutex;
+  std::condition_variable reenabled_cond;
+  bool reenabled;
+};
+
+namespace {
+
+Field* ToField(TSMLoc loc) {
+  return static_cast<Field*>(loc);
+}
+
+/**
+ * The task thread pool, reduced to one thread so callbacks of a
+ * continuation never overlap and runs are repeatable.
+ */
+class TaskPool {
+ public:
+  TSAction Schedule(TSCont cont, TSHRTime delay, TSHRTime every) {
+    TSAction action = new tsapi_action;
+    action->cont = cont;
+    action->when = TShrtime() + delay;
+    action->every = every;
+    action->cancelled = false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!started_) {
+      started_ = true;
+      std::thread(&TaskPool::Run, this).detach();
+    }
+    live_.insert(action);
+    queue_.insert(std::make_pair(action->when, action));
+    cond_.notify_one();
+    return action;
+  }
+
+  // Actions may already have run and be gone.
+  void Cancel(TSAction action) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (live_.count(action)) action->cancelled = true;
+  }
+
+ private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      if (queue_.empty()) {
+        cond_.wait(lock);
+        continue;
+      }
+      TSHRTime now = TShrtime();
+      std::multimap<TSHRTime, TSAction>::iterator next = queue_.begin();
+      if (next->first > now) {
+        cond_.wait_for(lock, std::chrono::nanoseconds(next->first - now));
+        continue;
+      }
+      TSAction action = next->second;
+      queue_.erase(next);
+      if (!action->cancelled) {
+        lock.unlock();
+        action->cont->func(action->cont, TS_EVENT_TIMEOUT, action);
+        lock.lock();
+      }
+      if (action->every > 0 && !action->cancelled) {
+        action->when += action->every;
+        queue_.insert(std::make_pair(action->when, action));
+      } else {
+        live_.erase(action);
+        delete action;
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool started_ = false;
+  std::multimap<TSHRTime, TSAction> queue_;
+  std::set<TSAction> live_;
+};
+
+TaskPool task_pool;
+
+struct Stat {
+  string name;
+  std::atomic<int64_t> value;
+};
+
+std::mutex stats_mutex;
+std::deque<Stat> stats;
+std::map<string, int> stat_ids;
+
+std::mutex lifecycle_mutex;
+vector<TSCont> message_hooks;
+
+std::atomic<int> user_args(0);
+
+string directory;
+
+void Reenable(TSHttpTxn txn) {
+  std::lock_guard<std::mutex> lock(txn->mutex);
+  txn->reenabled = true;
+  txn->reenabled_cond.notify_all();
+}
+
+// Call the continuations of a hook in order, each time waiting for the
+// transaction to be reenabled, and forget them as ATS does.
+void FireHook(TSHttpTxn txn, TSHttpHookID id, TSEvent event) {
+  vector<TSCont> hooks;
+  hooks.swap(txn->hooks[id]);
+  for (size_t i = 0; i < hooks.size(); i++) {
+    {
+      std::lock_guard<std::mutex> lock(txn->mutex);
+      txn->reenabled = false;
+    }
+    hooks[i]->func(hooks[i], event, txn);
+    std::unique_lock<std::mutex> lock(txn->mutex);
+    txn->reenabled_cond.wait(lock, [txn] { return txn->reenabled; });
+  }
+}
+
+void AppendBlock(TSIOBuffer buffer, const std::shared_ptr<const string>& data, size_t begin,
+                 size_t len) {
+  tsapi_bufferblock block;
+  block.data = data;
+  block.begin = begin;
+  block.len = len;
+  block.start = buffer->size;
+  block.buffer = buffer;
+  block.index = buffer->blocks.size();
+  buffer->blocks.push_back(block);
+  buffer->size += len;
+}
+
+// Take everything the reader has, as the client side of a transform
+// does when it is reenabled.
+void ReadAll(TSIOBufferReader reader, string* out) {
+  for (size_t i = 0; i < reader->buffer->blocks.size(); i++) {
+    const tsapi_bufferblock& block = reader->buffer->blocks[i];
+    int64_t skip = std::max<int64_t>(reader->pos - block.start, 0);
+    if (skip >= static_cast<int64_t>(block.len)) continue;
+    out->append(*block.data, block.begin + skip, block.len - skip);
+  }
+  reader->pos = reader->buffer->size;
+}
+
+// The server side of a transform, which only notes what it is told.
+struct Writer {
+  bool ready = false;
+  bool complete = false;
+  bool error = false;
+};
+
+int WriterHandler(TSCont contp, TSEvent event, void* edata) {
+  Writer* writer = static_cast<Writer*>(contp->data);
+  if (event == TS_EVENT_VCONN_WRITE_READY) writer->ready = true;
+  if (event == TS_EVENT_VCONN_WRITE_COMPLETE) writer->complete = true;
+  if (event == TS_EVENT_ERROR) writer->error = true;
+  return 0;
+}
+
+// Write blocks to a transform as ATS would: each block as it arrives,
+// calling the transform again while it makes progress, since it takes
+// no more than its output has room for.  Then let its output complete
+// and close it, which frees it.  Returns what it wrote.
+string StreamThrough(TSVConn transform, const vector<string>& blocks) {
+  TSIOBuffer input = TSIOBufferCreate();
+  TSIOBufferReader reader = TSIOBufferReaderAlloc(input);
+  int64_t total = 0;
+  for (size_t i = 0; i < blocks.size(); i++) total += blocks[i].size();
+
+  Writer writer;
+  TSCont writer_cont = TSContCreate(WriterHandler, NULL);
+  TSContDataSet(writer_cont, &writer);
+  tsapi_vio vio = {writer_cont, reader, total, 0, NULL};
+  transform->write_vio = &vio;
+
+  for (size_t i = 0; i <= blocks.size(); i++) {
+    if (i < blocks.size()) TSIOBufferWrite(input, blocks[i].data(), blocks[i].size());
+    int64_t before;
+    do {
+      before = vio.ndone;
+      transform->func(transform, i == 0 ? TS_EVENT_IMMEDIATE : TS_EVENT_VCONN_WRITE_READY,
+                      &vio);
+    } while (vio.ndone != before && TSIOBufferReaderAvail(reader) > 0);
+    if (writer.complete || writer.error) break;
+  }
+
+  string output;
+  TSVConn sink = transform->output;
+  if (sink != NULL && sink->output_vio != NULL) {
+    if (sink->output_vio->ndone == sink->output_vio->nbytes) {
+      transform->func(transform, TS_EVENT_VCONN_WRITE_COMPLETE, sink->output_vio);
+    }
+    output = sink->received;
+  }
+  if (!writer.complete || (sink != NULL && !sink->shutdown)) {
+    fprintf(stderr, "transform did not finish the body\n");
+  }
+
+  transform->closed = 1;
+  transform->func(transform, TS_EVENT_IMMEDIATE, NULL);
+
+  TSContDestroy(writer_cont);
+  TSIOBufferReaderFree(reader);
+  TSIOBufferDestroy(input);
+  return output;
+}
+
+}  // namespace
+
+extern "C" {
+
+void TSDebug(const char* tag, const char* format_str, ...) {
+  static const bool enabled = getenv("TS_MOCK_DEBUG") != NULL;
+  if (!enabled) return;
+  va_list args;
+  va_start(args, format_str);
+  fprintf(stderr, "[%s] ", tag);
+  vfprintf(stderr, format_str, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+void TSError(const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  fputs("ERROR: ", stderr);
+  vfprintf(stderr, fmt, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+const char* TSConfigDirGet(void) {
+  return mock::Directory().c_str();
+}
+
+const char* TSRuntimeDirGet(void) {
+  return mock::Directory().c_str();
+}
+
+TSHRTime TShrtime(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<TSHRTime>(now.tv_sec) * TS_HRTIME_SECOND + now.tv_nsec;
+}
+
+void* TSmalloc(size_t size) {
+  return malloc(size);
+}
+
+void TSfree(void* ptr) {
+  free(ptr);
+}
+
+TSMutex TSMutexCreate(void) {
+  return new tsapi_mutex;
+}
+
+TSCont TSContCreate(TSEventFunc funcp, TSMutex mutexp) {
+  TSCont cont = new tsapi_cont;
+  cont->func = funcp;
+  cont->data = NULL;
+  return cont;
+}
+
+void TSContDestroy(TSCont contp) {
+  if (contp->output != NULL) {
+    delete contp->output->output_vio;
+    delete contp->output;
+  }
+  delete contp;
+}
+
+void TSContDataSet(TSCont contp, void* data) {
+  contp->data = data;
+}
+
+void* TSContDataGet(TSCont contp) {
+  return contp->data;
+}
+
+TSAction TSContScheduleOnPool(TSCont contp, TSHRTime timeout, TSThreadPool tp) {
+  return task_pool.Schedule(contp, timeout * TS_HRTIME_MSECOND, 0);
+}
+
+TSAction TSContScheduleEveryOnPool(TSCont contp, TSHRTime every, TSThreadPool tp) {
+  return task_pool.Schedule(contp, every * TS_HRTIME_MSECOND, every * TS_HRTIME_MSECOND);
+}
+
+void TSActionCancel(TSAction actionp) {
+  task_pool.Cancel(actionp);
+}
+
+TSThread TSThreadCreate(TSThreadFunc func, void* data) {
+  std::thread(func, data).detach();
+  return new tsapi_thread;
+}
+
+void TSLifecycleHookAdd(TSLifecycleHookID id, TSCont contp) {
+  std::lock_guard<std::mutex> lock(lifecycle_mutex);
+  message_hooks.push_back(contp);
+}
+
+void TSHttpTxnHookAdd(TSHttpTxn txnp, TSHttpHookID id, TSCont contp) {
+  txnp->hooks[id].push_back(contp);
+}
+
+TSReturnCode TSHttpTxnReenable(TSHttpTxn txnp, TSEvent event) {
+  Reenable(txnp);
+  return TS_SUCCESS;
+}
+
+int TSContCall(TSCont contp, TSEvent event, void* edata) {
+  return contp->func(contp, event, edata);
+}
+
+TSReturnCode TSTextLogObjectCreate(const char* filename, int mode, TSTextLogObject* new_log_obj) {
+  string path = mock::Directory() + "/" + filename + ".log";
+  FILE* file = fopen(path.c_str(), "a");
+  if (file == NULL) return TS_ERROR;
+  *new_log_obj = new tsapi_textlogobject;
+  (*new_log_obj)->file = file;
+  (*new_log_obj)->timestamp = (mode & TS_LOG_MODE_ADD_TIMESTAMP) != 0;
+  return TS_SUCCESS;
+}
+
+TSReturnCode TSTextLogObjectWrite(TSTextLogObject the_object, const char* format, ...) {
+  std::lock_guard<std::mutex> lock(the_object->mutex);
+  if (the_object->timestamp) {
+    // Log lines carry wall clock time, unlike TShrtime
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    fprintf(the_object->file, "%ld.%03ld ", static_cast<long>(now.tv_sec), now.tv_nsec / 1000000);
+  }
+  va_list args;
+  va_start(args, format);
+  vfprintf(the_object->file, format, args);
+  va_end(args);
+  fputc('\n', the_object->file);
+  fflush(the_object->file);
+  return TS_SUCCESS;
+}
+
+TSReturnCode TSTextLogObjectRollingEnabledSet(TSTextLogObject the_object, int rolling_enabled) {
+  return TS_SUCCESS;
+}
+
+int TSStatCreate(const char* the_name, TSRecordDataType the_type, TSStatPersistence persist,
+                 TSStatSync sync) {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  if (stat_ids.count(the_name)) return TS_ERROR;
+  stats.emplace_back();
+  stats.back().name = the_name;
+  stats.back().value = 0;
+  int id = static_cast<int>(stats.size()) - 1;
+  stat_ids[the_name] = id;
+  return id;
+}
+
+TSReturnCode TSStatFindName(const char* name, int* idp) {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  std::map<string, int>::iterator it = stat_ids.find(name);
+  if (it == stat_ids.end()) return TS_ERROR;
+  *idp = it->second;
+  return TS_SUCCESS;
+}
+
+void TSStatIntIncrement(int the_stat, int64_t amount) {
+  stats[the_stat].value += amount;
+}
+
+void TSStatIntSet(int the_stat, int64_t value) {
+  stats[the_stat].value = value;
+}
+
+TSReturnCode TSUserArgIndexReserve(TSUserArgType type, const char* name, const char* description,
+                                   int* arg_idx) {
+  int index = user_args++;
+  if (index >= kMaxUserArgs) return TS_ERROR;
+  *arg_idx = index;
+  return TS_SUCCESS;
+}
+
+void TSUserArgSet(void* data, int arg_idx, void* arg) {
+  static_cast<TSHttpTxn>(data)->args[arg_idx] = arg;
+}
+
+void* TSUserArgGet(void* data, int arg_idx) {
+  return static_cast<TSHttpTxn>(data)->args[arg_idx];
+}
+
+TSReturnCode TSHttpTxnClientReqGet(TSHttpTxn txnp, TSMBuffer* bufp, TSMLoc* offset) {
+  *bufp = &txnp->request;
+  *offset = &txnp->request.hdr_loc;
+  return TS_SUCCESS;
+}
+
+const struct sockaddr* TSHttpTxnClientAddrGet(TSHttpTxn txnp) {
+  return reinterpret_cast<const struct sockaddr*>(&txnp->client);
+}
+
+TSReturnCode TSHttpTxnServerRespGet(TSHttpTxn txnp, TSMBuffer* bufp, TSMLoc* offset) {
+  if (txnp->response.status == 0) return TS_ERROR;
+  *bufp = &txnp->response;
+  *offset = &txnp->response.hdr_loc;
+  return TS_SUCCESS;
+}
+
+TSReturnCode TSHttpTxnCachedRespGet(TSHttpTxn txnp, TSMBuffer* bufp, TSMLoc* offset) {
+  return TS_ERROR;
+}
+
+TSReturnCode TSHttpTxnCacheLookupStatusGet(TSHttpTxn txnp, int* lookup_status) {
+  *lookup_status = TS_CACHE_LOOKUP_SKIPPED;
+  return TS_SUCCESS;
+}
+
+void TSHttpTxnUntransformedRespCache(TSHttpTxn txnp, int on) {
+}
+
+void TSHttpTxnTransformedRespCache(TSHttpTxn txnp, int on) {
+}
+
+TSReturnCode TSHandleMLocRelease(TSMBuffer bufp, TSMLoc parent, TSMLoc mloc) {
+  return TS_SUCCESS;
+}
+
+TSReturnCode TSHttpHdrUrlGet(TSMBuffer bufp, TSMLoc offset, TSMLoc* locp) {
+  *locp = &bufp->url_loc;
+  return TS_SUCCESS;
+}
+
+const char* TSHttpHdrMethodGet(TSMBuffer bufp, TSMLoc hdr_loc, int* length) {
+  *length = static_cast<int>(bufp->method.length());
+  return bufp->method.data();
+}
+
+TSHttpStatus TSHttpHdrStatusGet(TSMBuffer bufp, TSMLoc offset) {
+  return static_cast<TSHttpStatus>(bufp->status);
+}
+
+char* TSUrlStringGet(TSMBuffer bufp, TSMLoc offset, int* length) {
+  string url = bufp->scheme + "://" + bufp->host + "/" + bufp->path;
+  char* result = static_cast<char*>(TSmalloc(url.length() + 1));
+  memcpy(result, url.c_str(), url.length() + 1);
+  if (length != NULL) *length = static_cast<int>(url.length());
+  return result;
+}
+
+const char* TSUrlSchemeGet(TSMBuffer bufp, TSMLoc offset, int* length) {
+  *length = static_cast<int>(bufp->scheme.length());
+  return bufp->scheme.data();
+}
+
+const char* TSUrlHostGet(TSMBuffer bufp, TSMLoc offset, int* length) {
+  *length = static_cast<int>(bufp->host.length());
+  return bufp->host.data();
+}
+
+const char* TSUrlPathGet(TSMBuffer bufp, TSMLoc offset, int* length) {
+  *length = static_cast<int>(bufp->path.length());
+  return bufp->path.data();
+}
+
+TSReturnCode TSUrlHostSet(TSMBuffer bufp, TSMLoc offset, const char* value, int length) {
+  bufp->host.assign(value, length);
+  return TS_SUCCESS;
+}
+
+TSReturnCode TSUrlPathSet(TSMBuffer bufp, TSMLoc offset, const char* value, int length) {
+  bufp->path.assign(value, length);
+  return TS_SUCCESS;
+}
+
+int TSMimeHdrFieldsCount(TSMBuffer bufp, TSMLoc hdr) {
+  return static_cast<int>(bufp->fields.size());
+}
+
+TSMLoc TSMimeHdrFieldGet(TSMBuffer bufp, TSMLoc hdr, int idx) {
+  for (std::list<Field>::iterator it = bufp->fields.begin(); it != bufp->fields.end(); ++it) {
+    if (idx-- == 0) return &*it;
+  }
+  return TS_NULL_MLOC;
+}
+
+const char* TSMimeHdrFieldNameGet(TSMBuffer bufp, TSMLoc hdr, TSMLoc field, int* length) {
+  *length = static_cast<int>(ToField(field)->name.length());
+  return ToField(field)->name.data();
+}
+
+TSMLoc TSMimeHdrFieldFind(TSMBuffer bufp, TSMLoc hdr, const char* name, int length) {
+  if (length < 0) length = static_cast<int>(strlen(name));
+  for (std::list<Field>::iterator it = bufp->fields.begin(); it != bufp->fields.end(); ++it) {
+    if (it->name.length() == static_cast<size_t>(length) &&
+        strncasecmp(it->name.data(), name, length) == 0) {
+      return &*it;
+    }
+  }
+  return TS_NULL_MLOC;
+}
+
+const char* TSMimeHdrFieldValueStringGet(TSMBuffer bufp, TSMLoc hdr, TSMLoc field, int idx,
+                                         int* value_len_ptr) {
+  *value_len_ptr = static_cast<int>(ToField(field)->value.length());
+  return ToField(field)->value.data();
+}
+
+TSReturnCode TSMimeHdrFieldCreateNamed(TSMBuffer bufp, TSMLoc mh_mloc, const char* name,
+                                       int name_len, TSMLoc* locp) {
+  // Fields are kept by the buffer from the start; appending is a no-op
+  Field field;
+  field.name.assign(name, name_len);
+  bufp->fields.push_back(field);
+  *locp = &bufp->fields.back();
+  return TS_SUCCESS;
+}
+
+TSReturnCode TSMimeHdrFieldValueStringSet(TSMBuffer bufp, TSMLoc hdr, TSMLoc field, int idx,
+                                          const char* value, int length) {
+  ToField(field)->value.assign(value, length);
+  return TS_SUCCESS;
+}
+
+TSReturnCode TSMimeHdrFieldAppend(TSMBuffer bufp, TSMLoc hdr, TSMLoc field) {
+  return TS_SUCCESS;
+}
+
+TSVConn TSTransformCreate(TSEventFunc event_funcp, TSHttpTxn txnp) {
+  TSVConn connp = TSContCreate(event_funcp, NULL);
+  connp->output = TSContCreate(NULL, NULL);
+  return connp;
+}
+
+TSVConn TSTransformOutputVConnGet(TSVConn connp) {
+  return connp->output;
+}
+
+int TSVConnClosedGet(TSVConn connp) {
+  return connp->closed;
+}
+
+TSVIO TSVConnWriteVIOGet(TSVConn connp) {
+  return connp->write_vio;
+}
+
+TSVIO TSVConnWrite(TSVConn connp, TSCont contp, TSIOBufferReader readerp, int64_t nbytes) {
+  TSVIO vio = new tsapi_vio;
+  vio->cont = contp;
+  vio->reader = readerp;
+  vio->nbytes = nbytes;
+  vio->ndone = 0;
+  vio->sink = connp;
+  delete connp->output_vio;
+  connp->output_vio = vio;
+  return vio;
+}
+
+void TSVConnShutdown(TSVConn connp, int read, int write) {
+  if (write) connp->shutdown = true;
+}
+
+TSIOBuffer TSVIOBufferGet(TSVIO viop) {
+  return viop->reader != NULL ? viop->reader->buffer : NULL;
+}
+
+TSIOBufferReader TSVIOReaderGet(TSVIO viop) {
+  return viop->reader;
+}
+
+TSCont TSVIOContGet(TSVIO viop) {
+  return viop->cont;
+}
+
+int64_t TSVIONTodoGet(TSVIO viop) {
+  return viop->nbytes - viop->ndone;
+}
+
+int64_t TSVIONDoneGet(TSVIO viop) {
+  return viop->ndone;
+}
+
+void TSVIONDoneSet(TSVIO viop, int64_t ndone) {
+  viop->ndone = ndone;
+}
+
+void TSVIONBytesSet(TSVIO viop, int64_t nbytes) {
+  viop->nbytes = nbytes;
+}
+
+// The client side takes all of the output at once.
+void TSVIOReenable(TSVIO viop) {
+  if (viop->sink == NULL) return;
+  int64_t before = viop->reader->pos;
+  ReadAll(viop->reader, &viop->sink->received);
+  viop->ndone += viop->reader->pos - before;
+}
+
+TSIOBuffer TSIOBufferCreate(void) {
+  return new tsapi_iobuffer;
+}
+
+void TSIOBufferDestroy(TSIOBuffer bufp) {
+  delete bufp;
+}
+
+int64_t TSIOBufferWrite(TSIOBuffer bufp, const void* buf, int64_t length) {
+  if (length <= 0) return 0;
+  AppendBlock(bufp, std::make_shared<const string>(static_cast<const char*>(buf), length), 0,
+              length);
+  return length;
+}
+
+int64_t TSIOBufferCopy(TSIOBuffer bufp, TSIOBufferReader readerp, int64_t length, int64_t offset) {
+  int64_t from = readerp->pos + offset;
+  int64_t to = std::min(from + length, readerp->buffer->size);
+  int64_t copied = 0;
+  for (size_t i = 0; i < readerp->buffer->blocks.size() && from < to; i++) {
+    const tsapi_bufferblock& block = readerp->buffer->blocks[i];
+    int64_t end = block.start + static_cast<int64_t>(block.len);
+    if (end <= from) continue;
+    int64_t skip = from - block.start;
+    int64_t len = std::min(end, to) - from;
+    AppendBlock(bufp, block.data, block.begin + skip, len);
+    from += len;
+    copied += len;
+  }
+  return copied;
+}
+
+TSIOBufferReader TSIOBufferReaderAlloc(TSIOBuffer bufp) {
+  TSIOBufferReader reader = new tsapi_bufferreader;
+  reader->buffer = bufp;
+  reader->pos = 0;
+  return reader;
+}
+
+void TSIOBufferReaderFree(TSIOBufferReader readerp) {
+  delete readerp;
+}
+
+int64_t TSIOBufferReaderAvail(TSIOBufferReader readerp) {
+  return readerp->buffer->size - readerp->pos;
+}
+
+void TSIOBufferReaderConsume(TSIOBufferReader readerp, int64_t nbytes) {
+  readerp->pos += std::min(nbytes, TSIOBufferReaderAvail(readerp));
+}
+
+TSIOBufferBlock TSIOBufferReaderStart(TSIOBufferReader readerp) {
+  std::deque<tsapi_bufferblock>& blocks = readerp->buffer->blocks;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    if (blocks[i].start + static_cast<int64_t>(blocks[i].len) > readerp->pos) return &blocks[i];
+  }
+  return NULL;
+}
+
+TSIOBufferBlock TSIOBufferBlockNext(TSIOBufferBlock blockp) {
+  std::deque<tsapi_bufferblock>& blocks = blockp->buffer->blocks;
+  return blockp->index + 1 < blocks.size() ? &blocks[blockp->index + 1] : NULL;
+}
+
+const char* TSIOBufferBlockReadStart(TSIOBufferBlock blockp, TSIOBufferReader readerp,
+                                     int64_t* avail) {
+  int64_t skip = readerp != NULL ? std::max<int64_t>(readerp->pos - blockp->start, 0) : 0;
+  skip = std::min(skip, static_cast<int64_t>(blockp->len));
+  *avail = blockp->len - skip;
+  return blockp->data->data() + blockp->begin + skip;
+}
+
+}  // extern "C"
+
+namespace mock {
+
+void SetDirectory(const string& dir) {
+  directory = dir;
+}
+
+const string& Directory() {
+  if (directory.empty()) {
+    char dir[] = "/tmp/v8-bench-XXXXXX";
+    if (mkdtemp(dir) != NULL) directory = dir;
+  }
+  return directory;
+}
+
+bool Init() {
+  TSRemapInterface api;
+  api.size = sizeof(api);
+  api.tsremap_version = 0x0001;
+  char errbuf[256] = "";
+  if (TSRemapInit(&api, errbuf, sizeof(errbuf)) != TS_SUCCESS) {
+    fprintf(stderr, "TSRemapInit failed: %s\n", errbuf);
+    return false;
+  }
+  return true;
+}
+
+void* NewInstance(const string& script, const vector<string>& options, const string& from) {
+  vector<string> args;
+  args.push_back(from);
+  args.push_back("http://origin.test/");
+  // The plugin looks up relative script paths in the config directory
+  if (!script.empty() && script[0] != '/') {
+    char cwd[4096];
+    args.push_back(getcwd(cwd, sizeof(cwd)) != NULL ? string(cwd) + "/" + script : script);
+  } else {
+    args.push_back(script);
+  }
+  args.insert(args.end(), options.begin(), options.end());
+  vector<char*> argv;
+  for (size_t i = 0; i < args.size(); i++) argv.push_back(const_cast<char*>(args[i].c_str()));
+
+  void* instance = NULL;
+  char errbuf[256] = "";
+  if (TSRemapNewInstance(static_cast<int>(argv.size()), &argv[0], &instance, errbuf,
+                         sizeof(errbuf)) != TS_SUCCESS) {
+    fprintf(stderr, "TSRemapNewInstance(%s) failed: %s\n", script.c_str(), errbuf);
+    return NULL;
+  }
+  return instance;
+}
+
+void DeleteInstance(void* instance) {
+  TSRemapDeleteInstance(instance);
+}
+
+TSHttpTxn NewTxn(const Request& request) {
+  TSHttpTxn txn = new tsapi_httptxn;
+  txn->request.method = request.method;
+  txn->request.scheme = request.scheme;
+  txn->request.host = request.host;
+  txn->request.path = request.path;
+  for (size_t i = 0; i < request.headers.size(); i++) {
+    Field field;
+    field.name = request.headers[i].first;
+    field.value = request.headers[i].second;
+    txn->request.fields.push_back(field);
+  }
+
+  memset(&txn->client, 0, sizeof(txn->client));
+  struct sockaddr_in* v4 = reinterpret_cast<struct sockaddr_in*>(&txn->client);
+  struct sockaddr_in6* v6 = reinterpret_cast<struct sockaddr_in6*>(&txn->client);
+  if (inet_pton(AF_INET, request.client_ip.c_str(), &v4->sin_addr) == 1) {
+    v4->sin_family = AF_INET;
+  } else if (inet_pton(AF_INET6, request.client_ip.c_str(), &v6->sin6_addr) == 1) {
+    v6->sin6_family = AF_INET6;
+  }
+
+  memset(txn->args, 0, sizeof(txn->args));
+  txn->reenabled = false;
+  return txn;
+}
+
+void DestroyTxn(TSHttpTxn txn) {
+  delete txn;
+}
+
+TSRemapStatus Remap(void* instance, TSHttpTxn txn) {
+  TSRemapRequestInfo rri;
+  memset(&rri, 0, sizeof(rri));
+  rri.requestBufp = &txn->request;
+  rri.requestHdrp = &txn->request.hdr_loc;
+  rri.requestUrl = &txn->request.url_loc;
+
+  TSRemapStatus status = TSRemapDoRemap(instance, txn, &rri);
+  FireHook(txn, TS_HTTP_POST_REMAP_HOOK, TS_EVENT_HTTP_POST_REMAP);
+  return status;
+}
+
+string Respond(TSHttpTxn txn, int status, const vector<string>& body) {
+  txn->response.status = status;
+  FireHook(txn, TS_HTTP_CACHE_LOOKUP_COMPLETE_HOOK, TS_EVENT_HTTP_CACHE_LOOKUP_COMPLETE);
+  FireHook(txn, TS_HTTP_READ_RESPONSE_HDR_HOOK, TS_EVENT_HTTP_READ_RESPONSE_HDR);
+
+  vector<TSCont> transforms;
+  transforms.swap(txn->hooks[TS_HTTP_RESPONSE_TRANSFORM_HOOK]);
+  vector<string> blocks = body;
+  for (size_t i = 0; i < transforms.size(); i++) {
+    blocks.assign(1, StreamThrough(transforms[i], blocks));
+  }
+  string result;
+  for (size_t i = 0; i < blocks.size(); i++) result += blocks[i];
+  return result;
+}
+
+void CloseTxn(TSHttpTxn txn) {
+  FireHook(txn, TS_HTTP_TXN_CLOSE_HOOK, TS_EVENT_HTTP_TXN_CLOSE);
+}
+
+string Url(TSHttpTxn txn) {
+  return txn->request.scheme + "://" + txn->request.host + "/" + txn->request.path;
+}
+
+string Header(TSHttpTxn txn, const string& name) {
+  TSMLoc field = TSMimeHdrFieldFind(&txn->request, &txn->request.hdr_loc, name.data(),
+                                    static_cast<int>(name.length()));
+  return field == TS_NULL_MLOC ? string() : ToField(field)->value;
+}
+
+void PluginMessage(const string& tag, const string& text) {
+  TSPluginMsg msg;
+  msg.tag = tag.c_str();
+  msg.data = text.data();
+  msg.data_size = text.length();
+  vector<TSCont> hooks;
+  {
+    std::lock_guard<std::mutex> lock(lifecycle_mutex);
+    hooks = message_hooks;
+  }
+  for (size_t i = 0; i < hooks.size(); i++) {
+    hooks[i]->func(hooks[i], TS_EVENT_LIFECYCLE_MSG, &msg);
+  }
+}
+
+int64_t Stat(const string& name) {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  std::map<string, int>::iterator it = stat_ids.find(name);
+  return it == stat_ids.end() ? 0 : stats[it->second].value.load();
+}
+
+}  // namespace mock
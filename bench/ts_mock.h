@@ -0,0 +1,81 @@
+/*
+ * Helpers for driving the plugin through the mocked ATS API: building
+ * client requests, running transactions through remap and reading the
+ * stats the plugin published.
+ */
+#ifndef V8_BENCH_TS_MOCK_H
+#define V8_BENCH_TS_MOCK_H
+
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ts/remap.h"
+
+namespace mock {
+
+// The parts of a client request the plugin looks at.
+struct Request {
+  std::string method = "GET";
+  std::string scheme = "http";
+  std::string host = "test.com";
+  // Without the leading '/', as ATS stores it.
+  std::string path;
+  std::string client_ip = "127.0.0.1";
+  std::vector<std::pair<std::string, std::string> > headers;
+};
+
+// Where text logs go and what TSConfigDirGet and TSRuntimeDirGet
+// return; by default a fresh directory under /tmp.  Must be called
+// before TSRemapInit to take effect.
+void SetDirectory(const std::string& dir);
+const std::string& Directory();
+
+// Start the task thread pool and call TSRemapInit.  Returns false and
+// prints the error if the plugin refused to start.
+bool Init();
+
+// A remap rule: TSRemapNewInstance with "from", "to", the script and
+// options.
+void* NewInstance(const std::string& script, const std::vector<std::string>& options =
+                                                 std::vector<std::string>(),
+                  const std::string& from = "http://test.com/");
+void DeleteInstance(void* instance);
+
+// A transaction with the given client request.  Transactions can be
+// remapped any number of times; rewrites by the script stick.
+TSHttpTxn NewTxn(const Request& request);
+void DestroyTxn(TSHttpTxn txn);
+
+// Run the transaction through TSRemapDoRemap and the hooks it added,
+// waiting until the post-remap hook is reenabled if the plugin parked
+// the transaction there.  Returns the remap status.
+TSRemapStatus Remap(void* instance, TSHttpTxn txn);
+
+// Answer the transaction with a response of the given status whose
+// body arrives in the given blocks: run the response hooks and stream
+// the body through the transforms they added.  Returns the body as the
+// client gets it.
+std::string Respond(TSHttpTxn txn, int status, const std::vector<std::string>& body);
+
+// Fire the transaction close hooks, as ATS does at the end of every
+// transaction.
+void CloseTxn(TSHttpTxn txn);
+
+// The current URL of a transaction, after any rewrites.
+std::string Url(TSHttpTxn txn);
+
+// Value of a client request header, empty if not set.
+std::string Header(TSHttpTxn txn, const std::string& name);
+
+// Deliver "traffic_ctl plugin msg <tag> <text>".
+void PluginMessage(const std::string& tag, const std::string& text);
+
+// Value of a stat; 0 if it does not exist.
+int64_t Stat(const std::string& name);
+
+}  // namespace mock
+
+#endif  // V8_BENCH_TS_MOCK_H
@@ -1,18 +1,59 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "ts/ts.h"
 #include "ts/remap.h"
 #include "libplatform/libplatform.h"
+#include "libplatform/v8-tracing.h"
 #include "v8.h"
+#include "v8-profiler.h"
+#if V8_MAJOR_VERSION >= 10
+#include "v8-fast-api-calls.h"
+#endif
+// The inspector headers are not part of every V8 install
+#if defined(__has_include)
+#if __has_include("v8-inspector.h")
+#define HAVE_V8_INSPECTOR 1
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "v8-inspector.h"
+#endif
+#endif
 
 using std::map;
 using std::pair;
 using std::string;
+using std::vector;
 
+using v8::Array;
+using v8::ArrayBuffer;
 using v8::Context;
 using v8::EscapableHandleScope;
 using v8::External;
@@ -22,6 +63,7 @@ using v8::Global;
 using v8::HandleScope;
 using v8::Isolate;
 using v8::Local;
+using v8::Maybe;
 using v8::MaybeLocal;
 using v8::Name;
 using v8::NamedPropertyHandlerConfiguration;
@@ -42,383 +84,4824 @@ static std::unique_ptr<v8::Platform> platform = NULL;
 static Isolate::CreateParams create_params;
 static Isolate* isolate = NULL;
 
+// The platform's tracing controller, recording only while "trace
+// start" is in effect.
+static v8::platform::tracing::TracingController* tracing = NULL;
+
 /**
- * The abstract superclass of http request processors.
+ * A span of plugin work, recorded in the "ats" trace category next to
+ * V8's own events while tracing is on.  Costs a load and a branch
+ * otherwise.
  */
-class HttpRequestProcessor {
+class TraceSpan {
  public:
-  virtual ~HttpRequestProcessor() { }
+  explicit TraceSpan(const char* name) : name_(name), handle_(0) {
+#if !defined(V8_USE_PERFETTO)
+    if (*Category()) {
+      handle_ = tracing->AddTraceEvent('X', Category(), name, NULL, 0, 0, 0,
+                                       NULL, NULL, NULL, NULL, 0);
+    }
+#endif
+  }
+  ~TraceSpan() { End(); }
 
-  // Initialize this processor.  The map contains options that control
-  // how requests should be processed.
-  virtual bool Initialize(map<string, string>* options) = 0;
+  // End the span before it goes out of scope.
+  void End() {
+#if !defined(V8_USE_PERFETTO)
+    if (handle_ != 0) tracing->UpdateTraceEventDuration(Category(), name_, handle_);
+#endif
+    handle_ = 0;
+  }
 
-  // Process a single request.
-  virtual TSRemapStatus Process() = 0;
+ private:
+  static const uint8_t* Category() {
+    static const uint8_t* enabled = tracing->GetCategoryGroupEnabled("ats");
+    return enabled;
+  }
 
-  static void Debug(const char* msg);
-  static void Error(const char* msg);
+  const char* name_;
+  uint64_t handle_;
 };
 
-void HttpRequestProcessor::Debug(const char* msg) {
-  TSDebug(PLUGIN_NAME, "%s", msg);
-}
+/**
+ * A single producer, single consumer ring of fixed size records.  The
+ * producer is the thread owning the ring, the consumer is the log
+ * thread; neither ever blocks.  Records longer than kRecordSize are
+ * truncated.
+ */
+template <size_t kSlots, size_t kRecordSize>
+class RecordRing {
+ public:
+  RecordRing() : head_(0), tail_(0) { }
 
-void HttpRequestProcessor::Error(const char* msg) {
-  TSError("[v8] %s", msg);
-}
+  // Producer side.  Returns false if the ring is full.
+  bool Push(const char* data, size_t len) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) >= kSlots) return false;
+    Slot& slot = slots_[head % kSlots];
+    slot.len = len < kRecordSize ? len : kRecordSize;
+    memcpy(slot.data, data, slot.len);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
 
+  // Consumer side.  Returns false if the ring is empty.
+  bool Pop(string* record) {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return false;
+    const Slot& slot = slots_[tail % kSlots];
+    record->assign(slot.data, slot.len);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  struct Slot {
+    size_t len;
+    char data[kRecordSize];
+  };
+
+  std::atomic<uint64_t> head_;
+  std::atomic<uint64_t> tail_;
+  Slot slots_[kSlots];
+};
 
 /**
- * An http request processor that is scriptable using JavaScript.
+ * A stream of records written from any thread and read by the log
+ * thread.  Each writing thread lazily gets its own ring, so the only
+ * lock is taken once per thread, on its first write.
  */
-class JsHttpRequestProcessor : public HttpRequestProcessor {
+template <size_t kSlots, size_t kRecordSize>
+class RecordChannel {
  public:
-  // Creates a new processor that processes requests by invoking the
-  // Process function of the JavaScript script given as an argument.
-  JsHttpRequestProcessor(Isolate* isolate, Local<String> script)
-      : isolate_(isolate), script_(script) {}
-  JsHttpRequestProcessor(Isolate* isolate, string file)
-      : isolate_(isolate), file_(file) {}
-  virtual ~JsHttpRequestProcessor();
+  typedef RecordRing<kSlots, kRecordSize> Ring;
 
-  virtual bool Initialize(map<string, string>* opts);
-  virtual TSRemapStatus Process();
+  explicit RecordChannel(int id) : id_(id), dropped_(0) { }
 
-  Isolate* GetIsolate() { return isolate_; }
+  // Returns false, and counts the record as dropped, if this thread's
+  // ring is full.
+  bool Write(const char* data, size_t len) {
+    if (ThreadRing()->Push(data, len)) return true;
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  // Hand every pending record to fn.  Log thread only.
+  template <typename F>
+  void Drain(F fn) {
+    vector<Ring*> rings;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      rings = rings_;
+    }
+    string record;
+    for (size_t i = 0; i < rings.size(); i++) {
+      while (rings[i]->Pop(&record)) fn(record);
+    }
+  }
+
+  uint64_t TakeDropped() { return dropped_.exchange(0, std::memory_order_relaxed); }
 
  private:
-  // Execute the script associated with this processor and extract the
-  // Process function.  Returns true if this succeeded, otherwise false.
-  bool ExecuteScript(Local<String> script);
+  static const int kMaxChannels = 8;
 
-  // Wrap the options and output map in a JavaScript objects and
-  // install it in the global namespace as 'options' and 'output'.
-  bool InstallMaps(map<string, string>* opts);
+  Ring* ThreadRing() {
+    static thread_local void* rings[kMaxChannels];
+    if (rings[id_] == NULL) {
+      Ring* ring = new Ring();
+      std::lock_guard<std::mutex> lock(mutex_);
+      rings_.push_back(ring);
+      rings[id_] = ring;
+    }
+    return static_cast<Ring*>(rings[id_]);
+  }
 
-  // Constructs the template that describes the JavaScript wrapper
-  // type for requests.
-  //static Local<ObjectTemplate> MakeRequestTemplate(Isolate* isolate);
-  static Local<ObjectTemplate> MakeMapTemplate(Isolate* isolate);
+  int id_;
+  std::atomic<uint64_t> dropped_;
+  std::mutex mutex_;
+  vector<Ring*> rings_;
+};
 
-  // Callbacks that access maps
-  static void MapGet(Local<Name> name, const PropertyCallbackInfo<Value>& info);
-  static void MapSet(Local<Name> name, Local<Value> value,
-                     const PropertyCallbackInfo<Value>& info);
+// Channel ids, one thread local ring slot each.
+enum { kErrorChannel, kEventChannel, kSlowChannel, kCaptureChannel };
 
-  // Utility methods for wrapping C++ objects as JavaScript objects,
-  // and going back again.
-  Local<Object> WrapMap(map<string, string>* obj);
-  static map<string, string>* UnwrapMap(Local<Object> obj);
+/**
+ * Script error messages, written to the v8 text log by the log
+ * thread.  Within each window identical messages are collapsed into
+ * one line with a repeat count, and at most kMaxLines distinct lines
+ * are written; the rest are only counted.  Messages longer than
+ * kRecordSize, such as deep stack traces, are cut short with a marker.
+ */
+class ErrorLog {
+ public:
+  static const int kWindowMs = 1000;
+  static const size_t kRecordSize = 1024;
 
-  MaybeLocal<String> ReadFile(Isolate* isolate, const string& name);
+  static bool Initialize();
+  static bool Write(const char* msg);
 
-  Isolate* isolate_;
-  Local<String> script_;
-  string file_;
-  Global<Context> context_;
-  Global<Function> process_;
-  static Global<ObjectTemplate> map_template_;
+  // Log thread side: collect pending messages, and write out the
+  // current window.
+  static void Drain();
+  static void Flush();
+
+ private:
+  static const size_t kMaxLines = 100;
+
+  static TSTextLogObject log_;
+  static RecordChannel<128, kRecordSize> channel_;
+  // Messages of the current window, in first seen order, with counts.
+  static vector<pair<string, int> > window_;
+  static map<string, size_t> window_index_;
 };
 
-static void DebugCallback(const v8::FunctionCallbackInfo<v8::Value>& args) {
-  if (args.Length() < 1) return;
-  Isolate* isolate = args.GetIsolate();
-  HandleScope scope(isolate);
-  Local<Value> arg = args[0];
-  String::Utf8Value value(isolate, arg);
-  HttpRequestProcessor::Debug(*value);
+TSTextLogObject ErrorLog::log_ = NULL;
+RecordChannel<128, ErrorLog::kRecordSize> ErrorLog::channel_(kErrorChannel);
+vector<pair<string, int> > ErrorLog::window_;
+map<string, size_t> ErrorLog::window_index_;
+
+bool ErrorLog::Initialize() {
+  if (TSTextLogObjectCreate(PLUGIN_NAME, TS_LOG_MODE_ADD_TIMESTAMP, &log_) != TS_SUCCESS) {
+    log_ = NULL;
+    return false;
+  }
+  return true;
+}
+
+bool ErrorLog::Write(const char* msg) {
+  if (log_ == NULL) return false;
+  size_t len = strlen(msg);
+  if (len > kRecordSize) {
+    static const char kTruncated[] = " ... (truncated)";
+    char record[kRecordSize];
+    size_t keep = kRecordSize - (sizeof(kTruncated) - 1);
+    memcpy(record, msg, keep);
+    memcpy(record + keep, kTruncated, sizeof(kTruncated) - 1);
+    channel_.Write(record, kRecordSize);
+  } else {
+    channel_.Write(msg, len);
+  }
+  return true;
 }
 
-static void ErrorCallback(const v8::FunctionCallbackInfo<v8::Value>& args) {
-  if (args.Length() < 1) return;
-  Isolate* isolate = args.GetIsolate();
-  HandleScope scope(isolate);
-  Local<Value> arg = args[0];
-  String::Utf8Value value(isolate, arg);
-  HttpRequestProcessor::Error(*value);
+void ErrorLog::Drain() {
+  if (log_ == NULL) return;
+  channel_.Drain([](const string& msg) {
+    map<string, size_t>::iterator iter = window_index_.find(msg);
+    if (iter != window_index_.end()) {
+      window_[iter->second].second++;
+    } else {
+      window_index_[msg] = window_.size();
+      window_.push_back(pair<string, int>(msg, 1));
+    }
+  });
 }
 
-JsHttpRequestProcessor::~JsHttpRequestProcessor() {
-  // Dispose the persistent handles.  When no one else has any
-  // references to the objects stored in the handles they will be
-  // automatically reclaimed.
-  context_.Reset();
-  process_.Reset();
+void ErrorLog::Flush() {
+  if (log_ == NULL) return;
+  size_t lines = window_.size() < kMaxLines ? window_.size() : kMaxLines;
+  for (size_t i = 0; i < lines; i++) {
+    if (window_[i].second > 1) {
+      TSTextLogObjectWrite(log_, "%s (repeated %d times)", window_[i].first.c_str(), window_[i].second);
+    } else {
+      TSTextLogObjectWrite(log_, "%s", window_[i].first.c_str());
+    }
+  }
+  if (window_.size() > lines) {
+    TSTextLogObjectWrite(log_, "%d more distinct messages suppressed",
+                         static_cast<int>(window_.size() - lines));
+  }
+  uint64_t dropped = channel_.TakeDropped();
+  if (dropped > 0) {
+    TSTextLogObjectWrite(log_, "%llu messages dropped, log buffers full",
+                         static_cast<unsigned long long>(dropped));
+  }
+  window_.clear();
+  window_index_.clear();
 }
 
-Global<ObjectTemplate> JsHttpRequestProcessor::map_template_;
+/**
+ * Analytics events emitted by scripts, one JSON object per line in the
+ * v8_events text log, which ATS rolls like its other logs.  Emitting
+ * only serializes the event into the calling thread's ring.
+ */
+class EventLog {
+ public:
+  static const size_t kRecordSize = 1024;
 
-// Execute the script and fetch the Process method.
-bool JsHttpRequestProcessor::Initialize(map<string, string>* opts) {
-  TSDebug(PLUGIN_NAME, "Initialize()");
+  static bool Initialize();
+  // Record one already serialized event; false if it was dropped.
+  static bool Write(const char* event, size_t len);
 
-  // Create a handle scope to hold the temporary references.
-  HandleScope handle_scope(GetIsolate());
+  // Log thread side.
+  static void Drain();
 
-  // testing code
-  if (!ReadFile(GetIsolate(), file_).ToLocal(&script_)) {
-    return false; 
+ private:
+  static TSTextLogObject log_;
+  static RecordChannel<256, kRecordSize> channel_;
+};
+
+TSTextLogObject EventLog::log_ = NULL;
+RecordChannel<256, EventLog::kRecordSize> EventLog::channel_(kEventChannel);
+
+bool EventLog::Initialize() {
+  if (TSTextLogObjectCreate(PLUGIN_NAME "_events", 0, &log_) != TS_SUCCESS) {
+    log_ = NULL;
+    return false;
   }
+  TSTextLogObjectRollingEnabledSet(log_, 1);
+  return true;
+}
 
-  // Create a template for the global object where we set the
-  // built-in global functions.
-  Local<ObjectTemplate> global = ObjectTemplate::New(GetIsolate());
-  global->Set(String::NewFromUtf8(GetIsolate(), "debug", NewStringType::kNormal)
-                  .ToLocalChecked(),
-              FunctionTemplate::New(GetIsolate(), DebugCallback));
-  global->Set(String::NewFromUtf8(GetIsolate(), "error", NewStringType::kNormal)
-                  .ToLocalChecked(),
-              FunctionTemplate::New(GetIsolate(), ErrorCallback));
+bool EventLog::Write(const char* event, size_t len) {
+  if (log_ == NULL) return false;
+  return channel_.Write(event, len);
+}
 
-  // Each processor gets its own context so different processors don't
-  // affect each other. Context::New returns a persistent handle which
-  // is what we need for the reference to remain after we return from
-  // this method. That persistent handle has to be disposed in the
-  // destructor.
-  v8::Local<v8::Context> context = Context::New(GetIsolate(), NULL, global);
-  context_.Reset(GetIsolate(), context);
+void EventLog::Drain() {
+  if (log_ == NULL) return;
+  channel_.Drain([](const string& event) {
+    TSTextLogObjectWrite(log_, "%s", event.c_str());
+  });
+  uint64_t dropped = channel_.TakeDropped();
+  if (dropped > 0) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "%llu events dropped, event buffers full",
+             static_cast<unsigned long long>(dropped));
+    ErrorLog::Write(msg);
+  }
+}
 
-  // Enter the new context so all the following operations take place
-  // within it.
-  Context::Scope context_scope(context);
+/**
+ * Slow script invocations, one line each in the v8_slow text log.  At
+ * most kMaxLines are written per window; the rest are counted.
+ */
+class SlowLog {
+ public:
+  static bool Initialize();
+  static bool Write(const char* msg, size_t len);
 
-  // Make the options mapping available within the context
-  if (!InstallMaps(opts))
-    return false;
+  // Log thread side.
+  static void Drain();
+  static void Flush();
 
-  // Compile and run the script
-  if (!ExecuteScript(script_))
+ private:
+  static const int kMaxLines = 20;
+
+  static TSTextLogObject log_;
+  static RecordChannel<64, 2048> channel_;
+  static int written_;
+  static int suppressed_;
+};
+
+TSTextLogObject SlowLog::log_ = NULL;
+RecordChannel<64, 2048> SlowLog::channel_(kSlowChannel);
+int SlowLog::written_ = 0;
+int SlowLog::suppressed_ = 0;
+
+bool SlowLog::Initialize() {
+  if (TSTextLogObjectCreate(PLUGIN_NAME "_slow", TS_LOG_MODE_ADD_TIMESTAMP, &log_) != TS_SUCCESS) {
+    log_ = NULL;
     return false;
+  }
+  TSTextLogObjectRollingEnabledSet(log_, 1);
+  return true;
+}
 
-  // The script compiled and ran correctly.  Now we fetch out the
-  // Process function from the global object.
-  Local<String> process_name =
-      String::NewFromUtf8(GetIsolate(), "Process", NewStringType::kNormal)
-          .ToLocalChecked();
-  Local<Value> process_val;
-  // If there is no Process function, or if it is not a function,
-  // bail out
-  if (!context->Global()->Get(context, process_name).ToLocal(&process_val) ||
-      !process_val->IsFunction()) {
+bool SlowLog::Write(const char* msg, size_t len) {
+  if (log_ == NULL) return false;
+  return channel_.Write(msg, len);
+}
+
+void SlowLog::Drain() {
+  if (log_ == NULL) return;
+  channel_.Drain([](const string& msg) {
+    if (written_ < kMaxLines) {
+      TSTextLogObjectWrite(log_, "%s", msg.c_str());
+      written_++;
+    } else {
+      suppressed_++;
+    }
+  });
+}
+
+void SlowLog::Flush() {
+  if (log_ == NULL) return;
+  suppressed_ += static_cast<int>(channel_.TakeDropped());
+  if (suppressed_ > 0) {
+    TSTextLogObjectWrite(log_, "%d more slow calls not logged", suppressed_);
+  }
+  written_ = 0;
+  suppressed_ = 0;
+}
+
+/**
+ * Sampled client requests of rules with capture=<path>, appended by the
+ * log thread to a binary file per path so they can be replayed offline
+ * (bench/replay.cc).  The file starts with the 8 byte magic "V8CAPT01"
+ * followed by records, all integers in host byte order:
+ *
+ *   u32 length of the rest of the record
+ *   u64 capture time, ms since the epoch
+ *   method, scheme, host, path, client address, as u16 length + bytes
+ *   u16 header count, then name and value of each, as above
+ *
+ * Requests that don't fit in kRecordSize are dropped.
+ */
+class RequestCapture {
+ public:
+  static const size_t kRecordSize = 8192;
+  static const char kMagic[8];
+
+  // The id of the capture file at path, opening it if needed; -1 if it
+  // can't be opened.
+  static int Open(const string& path);
+
+  // Serialize the client request into the calling thread's ring.
+  static bool Write(int file, TSHttpTxn txn, TSMBuffer bufp, TSMLoc hdr, TSMLoc url);
+
+  // Log thread side.
+  static void Drain();
+
+ private:
+  // Appends to a record, failing once it is full.
+  class Writer {
+   public:
+    Writer(char* data, size_t size) : data_(data), size_(size), len_(0) { }
+    bool Put(const void* data, size_t len) {
+      if (len > size_ - len_) return false;
+      memcpy(data_ + len_, data, len);
+      len_ += len;
+      return true;
+    }
+    bool PutString(const char* str, int len) {
+      if (str == NULL || len < 0) len = 0;
+      uint16_t len16 = static_cast<uint16_t>(len);
+      return len <= 0xffff && Put(&len16, sizeof(len16)) && Put(str, len);
+    }
+    size_t len() const { return len_; }
+
+   private:
+    char* data_;
+    size_t size_;
+    size_t len_;
+  };
+
+  static RecordChannel<64, kRecordSize> channel_;
+  static std::mutex mutex_;
+  static vector<FILE*> files_;
+  static map<string, int> ids_;
+};
+
+const char RequestCapture::kMagic[8] = {'V', '8', 'C', 'A', 'P', 'T', '0', '1'};
+RecordChannel<64, RequestCapture::kRecordSize> RequestCapture::channel_(kCaptureChannel);
+std::mutex RequestCapture::mutex_;
+vector<FILE*> RequestCapture::files_;
+map<string, int> RequestCapture::ids_;
+
+int RequestCapture::Open(const string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  map<string, int>::iterator iter = ids_.find(path);
+  if (iter != ids_.end()) return iter->second;
+
+  FILE* file = fopen(path.c_str(), "ab");
+  if (file == NULL) return -1;
+  if (ftell(file) == 0) fwrite(kMagic, sizeof(kMagic), 1, file);
+  int id = static_cast<int>(files_.size());
+  files_.push_back(file);
+  ids_[path] = id;
+  return id;
+}
+
+bool RequestCapture::Write(int file, TSHttpTxn txn, TSMBuffer bufp, TSMLoc hdr, TSMLoc url) {
+  // The channel record is the file id followed by the file record
+  char record[kRecordSize];
+  Writer writer(record, sizeof(record));
+  uint32_t id = static_cast<uint32_t>(file);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint64_t now_ms = static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+  bool ok = writer.Put(&id, sizeof(id)) && writer.Put(&now_ms, sizeof(now_ms));
+
+  int len = 0;
+  const char* str = TSHttpHdrMethodGet(bufp, hdr, &len);
+  ok = ok && writer.PutString(str, len);
+  str = TSUrlSchemeGet(bufp, url, &len);
+  ok = ok && writer.PutString(str, len);
+  str = TSUrlHostGet(bufp, url, &len);
+  ok = ok && writer.PutString(str, len);
+  str = TSUrlPathGet(bufp, url, &len);
+  ok = ok && writer.PutString(str, len);
+
+  char ip[INET6_ADDRSTRLEN] = "";
+  const struct sockaddr* addr = TSHttpTxnClientAddrGet(txn);
+  if (addr != NULL && addr->sa_family == AF_INET) {
+    inet_ntop(AF_INET, &((const struct sockaddr_in*)addr)->sin_addr, ip, sizeof(ip));
+  } else if (addr != NULL && addr->sa_family == AF_INET6) {
+    inet_ntop(AF_INET6, &((const struct sockaddr_in6*)addr)->sin6_addr, ip, sizeof(ip));
+  }
+  ok = ok && writer.PutString(ip, static_cast<int>(strlen(ip)));
+
+  int fields = TSMimeHdrFieldsCount(bufp, hdr);
+  uint16_t count = static_cast<uint16_t>(fields < 0 ? 0 : fields > 0xffff ? 0xffff : fields);
+  ok = ok && writer.Put(&count, sizeof(count));
+  for (int i = 0; ok && i < count; i++) {
+    TSMLoc field = TSMimeHdrFieldGet(bufp, hdr, i);
+    if (field == TS_NULL_MLOC) {
+      ok = false;
+      break;
+    }
+    str = TSMimeHdrFieldNameGet(bufp, hdr, field, &len);
+    ok = writer.PutString(str, len);
+    str = TSMimeHdrFieldValueStringGet(bufp, hdr, field, -1, &len);
+    ok = ok && writer.PutString(str, len);
+    TSHandleMLocRelease(bufp, hdr, field);
+  }
+
+  if (!ok) {
+    ErrorLog::Write("request too large to capture");
     return false;
   }
+  return channel_.Write(record, writer.len());
+}
+
+void RequestCapture::Drain() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (files_.empty()) return;
+  channel_.Drain([](const string& record) {
+    uint32_t id;
+    memcpy(&id, record.data(), sizeof(id));
+    if (id >= files_.size()) return;
+    uint32_t len = static_cast<uint32_t>(record.length() - sizeof(id));
+    fwrite(&len, sizeof(len), 1, files_[id]);
+    fwrite(record.data() + sizeof(id), len, 1, files_[id]);
+  });
+  for (size_t i = 0; i < files_.size(); i++) fflush(files_[i]);
+  uint64_t dropped = channel_.TakeDropped();
+  if (dropped > 0) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "%llu captured requests dropped, capture buffers full",
+             static_cast<unsigned long long>(dropped));
+    ErrorLog::Write(msg);
+  }
+}
+
+/**
+ * The background thread draining the log channels.
+ */
+static void* LogThread(void*) {
+  const int drain_interval_ms = 100;
+  int elapsed = 0;
+  for (;;) {
+    usleep(drain_interval_ms * 1000);
+    EventLog::Drain();
+    ErrorLog::Drain();
+    SlowLog::Drain();
+    RequestCapture::Drain();
+    elapsed += drain_interval_ms;
+    if (elapsed >= ErrorLog::kWindowMs) {
+      ErrorLog::Flush();
+      SlowLog::Flush();
+      elapsed = 0;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * A fixed set of counters that can be updated from any thread.  Each
+ * thread adds into one of kShards copies, so threads rarely contend on
+ * a cache line.  Once a second the stats flusher folds the shards and
+ * adds what changed to the ATS stats named <prefix>.<counter name>.
+ */
+class ShardedStats {
+ public:
+  ShardedStats() : count_(0), stride_(0) { }
+  ~ShardedStats();
+
+  // Register the ATS stats, reusing existing ones of the same name (a
+  // reloaded remap rule keeps counting where the old one stopped).
+  // Returns false if ATS ran out of plugin stats.
+  bool Initialize(const string& prefix, const char* const* names, int count);
+
+  void Add(int index, int64_t value) {
+    if (index < 0 || index >= count_) return;
+    values_[ShardIndex() * stride_ + index].fetch_add(value, std::memory_order_relaxed);
+  }
+
+  // Called by the stats flusher.
+  void Publish();
+
+  // Schedule the periodic flush of every registered ShardedStats.
+  static void StartFlusher();
+
+ private:
+  static const int kShards = 8;
+  static const int kFlushIntervalMs = 1000;
+
+  static int ShardIndex() {
+    static std::atomic<int> next_shard(0);
+    static thread_local int shard = next_shard++ % kShards;
+    return shard;
+  }
+
+  static int Flush(TSCont contp, TSEvent event, void* edata);
+
+  int count_;
+  // Counters per shard, rounded up to whole cache lines.
+  int stride_;
+  std::unique_ptr<std::atomic<int64_t>[]> values_;
+  vector<int> ids_;
+  vector<int64_t> published_;
+
+  static std::mutex registry_mutex_;
+  static std::set<ShardedStats*> registry_;
+};
+
+std::mutex ShardedStats::registry_mutex_;
+std::set<ShardedStats*> ShardedStats::registry_;
+
+// Stat names may only hold a limited set of characters.
+static string StatName(const string& name) {
+  string result(name);
+  for (size_t i = 0; i < result.length(); i++) {
+    char c = result[i];
+    if (!isalnum(c) && c != '_' && c != '-' && c != '.') result[i] = '_';
+  }
+  return result;
+}
+
+bool ShardedStats::Initialize(const string& prefix, const char* const* names,
+                              int count) {
+  for (int i = 0; i < count; i++) {
+    string name = prefix + "." + names[i];
+    int id;
+    if (TSStatFindName(name.c_str(), &id) != TS_SUCCESS) {
+      id = TSStatCreate(name.c_str(), TS_RECORDDATATYPE_INT,
+                        TS_STAT_NON_PERSISTENT, TS_STAT_SYNC_SUM);
+      if (id == TS_ERROR) {
+        ids_.clear();
+        return false;
+      }
+    }
+    ids_.push_back(id);
+  }
+
+  stride_ = (count + 7) & ~7;
+  values_.reset(new std::atomic<int64_t>[kShards * stride_]);
+  for (int i = 0; i < kShards * stride_; i++) values_[i] = 0;
+  published_.assign(count, 0);
+  count_ = count;
+
+  std::lock_guard<std::mutex> lock(registry_mutex_);
+  registry_.insert(this);
+  return true;
+}
+
+ShardedStats::~ShardedStats() {
+  std::lock_guard<std::mutex> lock(registry_mutex_);
+  registry_.erase(this);
+}
+
+void ShardedStats::Publish() {
+  for (int i = 0; i < count_; i++) {
+    int64_t total = 0;
+    for (int shard = 0; shard < kShards; shard++) {
+      total += values_[shard * stride_ + i].load(std::memory_order_relaxed);
+    }
+    if (total != published_[i]) {
+      TSStatIntIncrement(ids_[i], total - published_[i]);
+      published_[i] = total;
+    }
+  }
+}
+
+void ShardedStats::StartFlusher() {
+  TSCont flusher = TSContCreate(Flush, TSMutexCreate());
+  TSContScheduleEveryOnPool(flusher, kFlushIntervalMs, TS_THREAD_POOL_TASK);
+}
+
+int ShardedStats::Flush(TSCont contp, TSEvent event, void* edata) {
+  std::lock_guard<std::mutex> lock(registry_mutex_);
+  for (std::set<ShardedStats*>::iterator iter = registry_.begin();
+       iter != registry_.end(); ++iter) {
+    (*iter)->Publish();
+  }
+  return 0;
+}
+
+/**
+ * Per instance counters and Process() latency histogram, published as
+ * plugin.v8.<script>.<rule>.*.
+ */
+class ProcessorStats {
+ public:
+  enum Counter {
+    kInvocations,
+    kExceptions,
+    kTerminations,
+    kJsTimeUs,
+    kStatusNoRemap,
+    kStatusDidRemap,
+    kStatusNoRemapStop,
+    kStatusDidRemapStop,
+    kGcCount,
+    kGcPauseUs,
+    kHeapBytes,
+    kBodyChunks,
+    kBodyBytesIn,
+    kBodyBytesOut,
+    kBodyTimeUs,
+    kLatencyFirst,
+    kCounterCount = kLatencyFirst + 11
+  };
+
+  bool Initialize(const string& name) {
+    return stats_.Initialize("plugin." PLUGIN_NAME "." + StatName(name), kNames, kCounterCount);
+  }
+
+  // Account one call of the script, taking elapsed nanoseconds.
+  void Invocation(TSHRTime elapsed) {
+    int64_t us = elapsed / TS_HRTIME_USECOND;
+    stats_.Add(kInvocations, 1);
+    stats_.Add(kJsTimeUs, us);
+    int bucket = 0;
+    while (bucket < kCounterCount - kLatencyFirst - 1 && us > kBucketLimitsUs[bucket]) bucket++;
+    stats_.Add(kLatencyFirst + bucket, 1);
+  }
+
+  void Status(TSRemapStatus status) {
+    if (status >= TSREMAP_NO_REMAP && status <= TSREMAP_DID_REMAP_STOP) {
+      stats_.Add(kStatusNoRemap + status, 1);
+    }
+  }
+
+  void Exception(bool terminated) {
+    stats_.Add(terminated ? kTerminations : kExceptions, 1);
+  }
+
+  // The latest measured heap size of the instance's context.  Only
+  // called by the heap sampler.
+  void HeapBytes(int64_t bytes) {
+    stats_.Add(kHeapBytes, bytes - heap_bytes_);
+    heap_bytes_ = bytes;
+  }
+
+  // A GC pause that happened while this instance's script was running.
+  void GcPause(TSHRTime pause) {
+    stats_.Add(kGcCount, 1);
+    stats_.Add(kGcPauseUs, pause / TS_HRTIME_USECOND);
+  }
+
+  // A run of TransformBody over part of a response body.
+  void Body(int chunks, TSHRTime elapsed, int64_t bytes_in, int64_t bytes_out) {
+    stats_.Add(kBodyChunks, chunks);
+    stats_.Add(kBodyBytesIn, bytes_in);
+    stats_.Add(kBodyBytesOut, bytes_out);
+    stats_.Add(kBodyTimeUs, elapsed / TS_HRTIME_USECOND);
+  }
+
+ private:
+  static const char* const kNames[kCounterCount];
+  static const int64_t kBucketLimitsUs[kCounterCount - kLatencyFirst - 1];
+
+  ShardedStats stats_;
+  int64_t heap_bytes_ = 0;
+};
+
+const char* const ProcessorStats::kNames[kCounterCount] = {
+    "invocations",       "exceptions",        "terminations",
+    "js_time_us",        "status.no_remap",   "status.did_remap",
+    "status.no_remap_stop", "status.did_remap_stop",
+    "gc.count",          "gc.pause_us",       "heap_bytes",
+    "body.chunks",       "body.bytes_in",     "body.bytes_out",
+    "body.time_us",
+    "latency.le_10us",   "latency.le_50us",   "latency.le_100us",
+    "latency.le_250us",  "latency.le_500us",  "latency.le_1ms",
+    "latency.le_2500us", "latency.le_5ms",    "latency.le_10ms",
+    "latency.le_50ms",   "latency.gt_50ms"};
+
+const int64_t ProcessorStats::kBucketLimitsUs[kCounterCount - kLatencyFirst - 1] = {
+    10, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 50000};
+
+/**
+ * Counters and histograms a script registers while it loads, published
+ * next to its instance's stats as script.<name>.  Registering returns
+ * the id that updates take.  A histogram counts observations into
+ * buckets by upper bound, plus their count and sum.
+ */
+class ScriptMetrics {
+ public:
+  static const int kMaxSlots = 256;
+  static const int kMaxBounds = 32;
+
+  ScriptMetrics() : closed_(false) { }
+
+  // Register a metric; -1 once the script has loaded or out of slots.
+  int Counter(const string& name);
+  int Histogram(const string& name, vector<double> bounds);
+
+  // End registration, once the script's top level has run.  Requests
+  // may run on any thread, so the metrics can't change after this.
+  void Close() { closed_ = true; }
+
+  // Create the stats, after the script has loaded.
+  bool Publish(const string& name);
+
+  void Add(int id, int64_t n) {
+    if (static_cast<size_t>(id) >= metrics_.size() || !metrics_[id].bounds.empty()) return;
+    stats_.Add(metrics_[id].slot, n);
+  }
+
+  void Observe(int id, double value) {
+    if (static_cast<size_t>(id) >= metrics_.size() || metrics_[id].bounds.empty()) return;
+    if (isnan(value)) return;
+    const Metric& metric = metrics_[id];
+    size_t bucket = 0;
+    while (bucket < metric.bounds.size() && value > metric.bounds[bucket]) bucket++;
+    int count = metric.slot + static_cast<int>(metric.bounds.size()) + 1;
+    stats_.Add(metric.slot + static_cast<int>(bucket), 1);
+    stats_.Add(count, 1);
+    // The sum saturates rather than overflow the conversion
+    int64_t sum;
+    if (value >= 9223372036854775807.0) {
+      sum = INT64_MAX;
+    } else if (value <= -9223372036854775808.0) {
+      sum = INT64_MIN;
+    } else {
+      sum = static_cast<int64_t>(floor(value));
+    }
+    stats_.Add(count + 1, sum);
+  }
+
+  // The JavaScript API: metrics.counter, .histogram, .add, .observe and
+  // performance.now.
+  static int32_t JsCounter(const string& name);
+  static int32_t JsHistogram(const string& name, Local<Value> bounds);
+  static void JsAdd(int32_t id, int32_t n);
+  static void JsObserve(int32_t id, double value);
+  static double JsNow();
+
+  // Origin of performance.now().
+  static TSHRTime time_origin;
+
+ private:
+  struct Metric {
+    int slot;
+    // Empty for counters.
+    vector<double> bounds;
+  };
+
+  bool Reserve(size_t slots) {
+    return !closed_ && names_.size() + slots <= static_cast<size_t>(kMaxSlots);
+  }
+
+  bool closed_;
+  vector<Metric> metrics_;
+  vector<string> names_;
+  ShardedStats stats_;
+};
+
+TSHRTime ScriptMetrics::time_origin = 0;
+
+int ScriptMetrics::Counter(const string& name) {
+  if (!Reserve(1)) return -1;
+  Metric metric;
+  metric.slot = static_cast<int>(names_.size());
+  names_.push_back(StatName(name));
+  metrics_.push_back(metric);
+  return static_cast<int>(metrics_.size()) - 1;
+}
+
+int ScriptMetrics::Histogram(const string& name, vector<double> bounds) {
+  if (bounds.empty()) {
+    const double defaults[] = {1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000};
+    bounds.assign(defaults, defaults + sizeof(defaults) / sizeof(defaults[0]));
+  }
+  std::sort(bounds.begin(), bounds.end());
+  bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+  if (bounds.size() > static_cast<size_t>(kMaxBounds) || !Reserve(bounds.size() + 3)) return -1;
+
+  Metric metric;
+  metric.slot = static_cast<int>(names_.size());
+  metric.bounds = bounds;
+  string prefix = StatName(name) + ".";
+  for (size_t i = 0; i < bounds.size(); i++) {
+    char bound[32];
+    snprintf(bound, sizeof(bound), "%g", bounds[i]);
+    // a '.' would start a new stat name component
+    for (char* c = bound; *c; c++) {
+      if (*c == '.') *c = '_';
+    }
+    names_.push_back(prefix + "le_" + StatName(bound));
+  }
+  names_.push_back(names_.back());
+  names_.back().replace(prefix.length(), 2, "gt");
+  names_.push_back(prefix + "count");
+  names_.push_back(prefix + "sum");
+  metrics_.push_back(metric);
+  return static_cast<int>(metrics_.size()) - 1;
+}
+
+bool ScriptMetrics::Publish(const string& name) {
+  if (names_.empty()) return true;
+  vector<const char*> names;
+  for (size_t i = 0; i < names_.size(); i++) names.push_back(names_[i].c_str());
+  return stats_.Initialize("plugin." PLUGIN_NAME "." + StatName(name) + ".script",
+                           &names[0], static_cast<int>(names.size()));
+}
+
+/**
+ * A simplified http request.
+ */
+class HttpRequest {
+ public:
+  HttpRequest() : rewrite_host_(false), rewrite_path_(false) { }
+  virtual ~HttpRequest() { }
+
+  virtual const string& Url() = 0;
+  virtual const string& Method() = 0;
+  virtual const string& Host() = 0;
+  // The path as ATS stores it, i.e. without the leading '/'.
+  virtual const string& Path() = 0;
+  virtual const string& ClientIp() = 0;
+  virtual const string& UserAgent() = 0;
+  virtual const string& Referrer() = 0;
+
+  // Rewrites requested by the script.  They only take effect when the
+  // script's decision for the request is to remap it.
+  void SetHost(const string& host) { new_host_ = host; rewrite_host_ = true; }
+  void SetPath(const string& path) { new_path_ = path; rewrite_path_ = true; }
+  bool HasRewrites() const { return rewrite_host_ || rewrite_path_; }
+
+  // The value the script sees: the rewrite if there is one.
+  const string& CurrentHost() { return rewrite_host_ ? new_host_ : Host(); }
+  const string& CurrentPath() { return rewrite_path_ ? new_path_ : Path(); }
+
+  // Write the requested rewrites into the given URL.
+  void ApplyRewrites(TSMBuffer bufp, TSMLoc url) const;
+
+ private:
+  string new_host_;
+  string new_path_;
+  bool rewrite_host_;
+  bool rewrite_path_;
+};
+
+void HttpRequest::ApplyRewrites(TSMBuffer bufp, TSMLoc url) const {
+  if (rewrite_host_) {
+    TSUrlHostSet(bufp, url, new_host_.data(), static_cast<int>(new_host_.length()));
+  }
+  if (rewrite_path_) {
+    TSUrlPathSet(bufp, url, new_path_.data(), static_cast<int>(new_path_.length()));
+  }
+}
+
+/**
+ * An http request backed by the transaction's client request.  Fields
+ * are only fetched from the MIME buffers when the script asks for them.
+ */
+class TxnHttpRequest : public HttpRequest {
+ public:
+  TxnHttpRequest(TSHttpTxn txn, TSMBuffer bufp, TSMLoc hdr, TSMLoc url)
+      : txn_(txn), bufp_(bufp), hdr_(hdr), url_(url) {
+    memset(loaded_, 0, sizeof(loaded_));
+  }
+
+  const string& Url() { return Get(kUrl); }
+  const string& Method() { return Get(kMethod); }
+  const string& Host() { return Get(kHost); }
+  const string& Path() { return Get(kPath); }
+  const string& ClientIp() { return Get(kClientIp); }
+  const string& UserAgent() { return Get(kUserAgent); }
+  const string& Referrer() { return Get(kReferrer); }
+
+ private:
+  enum Field { kUrl, kMethod, kHost, kPath, kClientIp, kUserAgent, kReferrer, kFieldCount };
+
+  const string& Get(Field field);
+  void GetHeader(const char* name, int name_len, string* value);
+
+  TSHttpTxn txn_;
+  TSMBuffer bufp_;
+  TSMLoc hdr_;
+  TSMLoc url_;
+  string values_[kFieldCount];
+  bool loaded_[kFieldCount];
+};
+
+const string& TxnHttpRequest::Get(Field field) {
+  string* value = &values_[field];
+  if (loaded_[field]) return *value;
+  loaded_[field] = true;
+
+  int len = 0;
+  const char* str = NULL;
+  switch (field) {
+    case kUrl: {
+      char* url = TSUrlStringGet(bufp_, url_, &len);
+      if (url != NULL) {
+        value->assign(url, len);
+        TSfree(url);
+      }
+      break;
+    }
+    case kMethod:
+      str = TSHttpHdrMethodGet(bufp_, hdr_, &len);
+      break;
+    case kHost:
+      str = TSUrlHostGet(bufp_, url_, &len);
+      if (str == NULL || len == 0) {
+        GetHeader("Host", 4, value);
+        return *value;
+      }
+      break;
+    case kPath:
+      str = TSUrlPathGet(bufp_, url_, &len);
+      break;
+    case kClientIp: {
+      const struct sockaddr* addr = TSHttpTxnClientAddrGet(txn_);
+      char buf[INET6_ADDRSTRLEN];
+      if (addr != NULL && addr->sa_family == AF_INET) {
+        str = inet_ntop(AF_INET, &((const struct sockaddr_in*)addr)->sin_addr, buf, sizeof(buf));
+      } else if (addr != NULL && addr->sa_family == AF_INET6) {
+        str = inet_ntop(AF_INET6, &((const struct sockaddr_in6*)addr)->sin6_addr, buf, sizeof(buf));
+      }
+      if (str != NULL) value->assign(str);
+      return *value;
+    }
+    case kUserAgent:
+      GetHeader("User-Agent", 10, value);
+      return *value;
+    case kReferrer:
+      GetHeader("Referer", 7, value);
+      return *value;
+    default:
+      break;
+  }
+
+  if (str != NULL) value->assign(str, len);
+  return *value;
+}
+
+void TxnHttpRequest::GetHeader(const char* name, int name_len, string* value) {
+  TSMLoc field = TSMimeHdrFieldFind(bufp_, hdr_, name, name_len);
+  if (field == TS_NULL_MLOC) return;
+
+  int len = 0;
+  const char* str = TSMimeHdrFieldValueStringGet(bufp_, hdr_, field, -1, &len);
+  if (str != NULL) value->assign(str, len);
+  TSHandleMLocRelease(bufp_, hdr_, field);
+}
+
+/**
+ * An http request holding its own copy of every field, so it can
+ * outlive the hook or remap call it was captured in.
+ */
+class StringHttpRequest : public HttpRequest {
+ public:
+  explicit StringHttpRequest(HttpRequest* request)
+      : url_(request->Url()),
+        method_(request->Method()),
+        host_(request->Host()),
+        path_(request->Path()),
+        client_ip_(request->ClientIp()),
+        user_agent_(request->UserAgent()),
+        referrer_(request->Referrer()) { }
+
+  const string& Url() { return url_; }
+  const string& Method() { return method_; }
+  const string& Host() { return host_; }
+  const string& Path() { return path_; }
+  const string& ClientIp() { return client_ip_; }
+  const string& UserAgent() { return user_agent_; }
+  const string& Referrer() { return referrer_; }
+
+ private:
+  string url_;
+  string method_;
+  string host_;
+  string path_;
+  string client_ip_;
+  string user_agent_;
+  string referrer_;
+};
+
+class JsHttpRequestProcessor;
+
+/**
+ * Per isolate state, stored in an isolate data slot.  The templates
+ * are created once when the isolate is set up, so wrapping an object
+ * only costs a pointer load.  The rest is only touched by the thread
+ * holding the isolate.
+ */
+struct IsolateData {
+  static const uint32_t kSlot = 0;
+
+  // Embedder data index of a context pointing at its processor.
+  static const int kContextProcessorIndex = 1;
+
+  IsolateData() : running(NULL), gc_count(0), gc_pause(0), lock_wait(0) { }
+
+  static IsolateData* Get(Isolate* isolate) {
+    return static_cast<IsolateData*>(isolate->GetData(kSlot));
+  }
+
+  Global<ObjectTemplate> global_template;
+  Global<ObjectTemplate> map_template;
+  Global<ObjectTemplate> request_template;
+
+  // The processor whose script is running, if any.
+  JsHttpRequestProcessor* running;
+
+  // GC pauses so far, and their total length.
+  uint64_t gc_count;
+  TSHRTime gc_pause;
+
+  // How long the current holder of the isolate waited for its lock.
+  TSHRTime lock_wait;
+};
+
+/**
+ * Script time of a transaction, kept in a transaction user arg and
+ * written into internal client request headers when the transaction
+ * closes, before it is logged, so access logs can show them as
+ * %<{@X-V8-Remap-Time}cqh> and the like.  ATS does not pass headers
+ * starting with '@' on to origins.  Times are in microseconds and add
+ * up over every script call of the transaction.
+ */
+class TxnScriptTime {
+ public:
+  enum Kind { kRemap, kHook, kLockWait, kKindCount };
+
+  // Reserve the user arg.  Returns false if ATS is out of them.
+  static bool Initialize();
+
+  // Start recording the transaction's script time.  Must be called
+  // from the transaction's thread.
+  static void Track(TSHttpTxn txn);
+
+  // Add to a tracked transaction's time; may be called from any thread
+  // while the transaction waits for the caller.
+  static void Add(TSHttpTxn txn, Kind kind, TSHRTime elapsed);
+
+ private:
+  static int Close(TSCont contp, TSEvent event, void* edata);
+  static void WriteHeader(TSMBuffer bufp, TSMLoc hdr, Kind kind, TSHRTime time);
+
+  static const char* const kHeaders[kKindCount];
+  static int arg_index_;
+  static TSCont close_cont_;
+};
+
+const char* const TxnScriptTime::kHeaders[kKindCount] = {
+    "@X-V8-Remap-Time", "@X-V8-Hook-Time", "@X-V8-Lock-Wait"};
+int TxnScriptTime::arg_index_ = -1;
+TSCont TxnScriptTime::close_cont_ = NULL;
+
+bool TxnScriptTime::Initialize() {
+  if (TSUserArgIndexReserve(TS_USER_ARGS_TXN, PLUGIN_NAME, "script time of the transaction",
+                            &arg_index_) != TS_SUCCESS) {
+    arg_index_ = -1;
+    return false;
+  }
+  close_cont_ = TSContCreate(Close, NULL);
+  return true;
+}
+
+void TxnScriptTime::Track(TSHttpTxn txn) {
+  if (arg_index_ < 0 || TSUserArgGet(txn, arg_index_) != NULL) return;
+  TSUserArgSet(txn, arg_index_, new TSHRTime[kKindCount]());
+  TSHttpTxnHookAdd(txn, TS_HTTP_TXN_CLOSE_HOOK, close_cont_);
+}
+
+void TxnScriptTime::Add(TSHttpTxn txn, Kind kind, TSHRTime elapsed) {
+  if (arg_index_ < 0) return;
+  TSHRTime* times = static_cast<TSHRTime*>(TSUserArgGet(txn, arg_index_));
+  if (times != NULL) times[kind] += elapsed;
+}
+
+int TxnScriptTime::Close(TSCont contp, TSEvent event, void* edata) {
+  TSHttpTxn txn = static_cast<TSHttpTxn>(edata);
+  TSHRTime* times = static_cast<TSHRTime*>(TSUserArgGet(txn, arg_index_));
+  TSMBuffer bufp;
+  TSMLoc hdr;
+  if (times != NULL && TSHttpTxnClientReqGet(txn, &bufp, &hdr) == TS_SUCCESS) {
+    for (int kind = 0; kind < kKindCount; kind++) {
+      if (times[kind] > 0) WriteHeader(bufp, hdr, static_cast<Kind>(kind), times[kind]);
+    }
+    TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr);
+  }
+  delete[] times;
+  TSUserArgSet(txn, arg_index_, NULL);
+  TSHttpTxnReenable(txn, TS_EVENT_HTTP_CONTINUE);
+  return 0;
+}
+
+void TxnScriptTime::WriteHeader(TSMBuffer bufp, TSMLoc hdr, Kind kind, TSHRTime time) {
+  const char* name = kHeaders[kind];
+  int name_len = static_cast<int>(strlen(name));
+  TSMLoc field = TSMimeHdrFieldFind(bufp, hdr, name, name_len);
+  if (field == TS_NULL_MLOC && TSMimeHdrFieldCreateNamed(bufp, hdr, name, name_len, &field) == TS_SUCCESS) {
+    TSMimeHdrFieldAppend(bufp, hdr, field);
+  }
+  if (field != TS_NULL_MLOC) {
+    char value[32];
+    int len = snprintf(value, sizeof(value), "%lld",
+                       static_cast<long long>(time / TS_HRTIME_USECOND));
+    TSMimeHdrFieldValueStringSet(bufp, hdr, field, -1, value, len);
+    TSHandleMLocRelease(bufp, hdr, field);
+  }
+}
+
+/**
+ * A Chrome DevTools endpoint for the isolate, turned on by setting
+ * TS_V8_INSPECTOR in traffic_server's environment to a port, listened
+ * on at 127.0.0.1 only, or to the path of a Unix socket.  It serves
+ * one client at a time over a minimal HTTP and WebSocket server on its
+ * own thread.  Clients get the profiler, heap profiler and read-only
+ * runtime domains; the debugger, and with it anything that could pause
+ * the isolate or run code in it, is refused.  Replies are queued by
+ * whichever thread holds the isolate and written by the inspector
+ * thread, so a stalled client never holds up requests.
+ */
+class Inspector {
+ public:
+  // Start listening if TS_V8_INSPECTOR is set.  Called with the
+  // isolate locked.
+  static void Start(Isolate* isolate);
+
+  // Announce a processor's context to DevTools, or withdraw it.
+  // Called with the isolate locked.
+  static void ContextCreated(Local<Context> context, const string& name);
+  static void ContextDestroyed(Local<Context> context);
+
+#ifdef HAVE_V8_INSPECTOR
+ private:
+  static const int kContextGroupId = 1;
+  static const size_t kMaxMessage = 16 * 1024 * 1024;
+  // Replies a client may fall behind by before it is dropped.
+  static const size_t kMaxOutbox = 64 * 1024 * 1024;
+
+  class Client : public v8_inspector::V8InspectorClient {
+   public:
+    double currentTimeMS() override {
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+    }
+  };
+
+  // Runs on whichever thread holds the isolate.
+  class Channel : public v8_inspector::V8Inspector::Channel {
+   public:
+    void sendResponse(int call_id,
+                      std::unique_ptr<v8_inspector::StringBuffer> message) override {
+      Queue(ToUtf8(message->string()));
+    }
+    void sendNotification(std::unique_ptr<v8_inspector::StringBuffer> message) override {
+      Queue(ToUtf8(message->string()));
+    }
+    void flushProtocolNotifications() override { }
+  };
+
+  enum Opcode { kContinuation = 0, kText = 1, kClose = 8, kPing = 9, kPong = 10 };
+
+  static void* Serve(void*);
+  static bool Handshake(int fd);
+  static void RunSession(int fd);
+  static bool ReadFrame(int fd, int* opcode, string* payload);
+  static bool SendFrame(int opcode, const string& payload);
+  static void Queue(const string& message);
+  static bool SendQueued();
+  static bool Allowed(const string& method);
+  static string Dispatch(const string& message);
+  static string ErrorReply(Local<Context> context, Local<Value> id, int code,
+                           const string& message);
+
+  static string ToUtf8(const v8_inspector::StringView& view);
+
+  static Isolate* isolate_;
+  static int listen_fd_;
+  // Where DevTools is told to connect; empty for a Unix socket, which
+  // is reached through whatever forward the client used.
+  static string endpoint_;
+  // The WebSocket path, a random UUID as node uses, so only clients
+  // that could read the discovery endpoint can attach.
+  static string path_;
+  static Client client_;
+  static Channel channel_;
+  static std::unique_ptr<v8_inspector::V8Inspector> inspector_;
+  static std::unique_ptr<v8_inspector::V8InspectorSession> session_;
+  // For parsing client messages.
+  static Global<Context> context_;
+  // Only touched by the inspector thread.
+  static int client_fd_;
+
+  // Replies waiting for the inspector thread, which is woken through
+  // wake_fds_.
+  static std::mutex outbox_mutex_;
+  static std::deque<string> outbox_;
+  static size_t outbox_bytes_;
+  static bool connected_;
+  static bool overflowed_;
+  static int wake_fds_[2];
+#endif
+};
+
+#ifdef HAVE_V8_INSPECTOR
+Isolate* Inspector::isolate_ = NULL;
+int Inspector::listen_fd_ = -1;
+string Inspector::endpoint_;
+string Inspector::path_;
+Inspector::Client Inspector::client_;
+Inspector::Channel Inspector::channel_;
+std::unique_ptr<v8_inspector::V8Inspector> Inspector::inspector_;
+std::unique_ptr<v8_inspector::V8InspectorSession> Inspector::session_;
+Global<Context> Inspector::context_;
+int Inspector::client_fd_ = -1;
+std::mutex Inspector::outbox_mutex_;
+std::deque<string> Inspector::outbox_;
+size_t Inspector::outbox_bytes_ = 0;
+bool Inspector::connected_ = false;
+bool Inspector::overflowed_ = false;
+int Inspector::wake_fds_[2] = {-1, -1};
+
+void Inspector::Start(Isolate* isolate) {
+  const char* where = getenv("TS_V8_INSPECTOR");
+  if (where == NULL || *where == '\0') return;
+
+  if (where[0] == '/') {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(where) >= sizeof(addr.sun_path)) {
+      TSError("[v8] inspector socket path too long: %s", where);
+      return;
+    }
+    strcpy(addr.sun_path, where);
+    unlink(where);
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    // Only traffic_server's user may connect, whatever the umask
+    if (listen_fd_ >= 0 &&
+        (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+         chmod(where, 0600) != 0)) {
+      close(listen_fd_);
+      listen_fd_ = -1;
+    }
+  } else {
+    int port = atoi(where);
+    if (port <= 0 || port > 65535) {
+      TSError("[v8] TS_V8_INSPECTOR must be a port or a socket path, not %s", where);
+      return;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    if (listen_fd_ >= 0) setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (listen_fd_ >= 0 &&
+        bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+      close(listen_fd_);
+      listen_fd_ = -1;
+    }
+    char endpoint[32];
+    snprintf(endpoint, sizeof(endpoint), "127.0.0.1:%d", port);
+    endpoint_ = endpoint;
+  }
+  if (listen_fd_ < 0 || listen(listen_fd_, 1) != 0) {
+    TSError("[v8] unable to listen for the inspector on %s: %s", where, strerror(errno));
+    return;
+  }
+  if (pipe(wake_fds_) != 0 || fcntl(wake_fds_[0], F_SETFL, O_NONBLOCK) != 0 ||
+      fcntl(wake_fds_[1], F_SETFL, O_NONBLOCK) != 0) {
+    TSError("[v8] unable to create the inspector's wakeup pipe: %s", strerror(errno));
+    return;
+  }
+  unsigned char uuid[16];
+  if (RAND_bytes(uuid, sizeof(uuid)) != 1) {
+    TSError("[v8] unable to generate the inspector's session id");
+    return;
+  }
+  uuid[6] = (uuid[6] & 0x0f) | 0x40;
+  uuid[8] = (uuid[8] & 0x3f) | 0x80;
+  char path[40];
+  snprintf(path, sizeof(path),
+           "/%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x", uuid[0],
+           uuid[1], uuid[2], uuid[3], uuid[4], uuid[5], uuid[6], uuid[7], uuid[8], uuid[9],
+           uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15]);
+  path_ = path;
+
+  isolate_ = isolate;
+  {
+    HandleScope handle_scope(isolate);
+    context_.Reset(isolate, Context::New(isolate));
+  }
+  inspector_ = v8_inspector::V8Inspector::create(isolate, &client_);
+  TSThreadCreate(Serve, NULL);
+  TSDebug(PLUGIN_NAME, "inspector listening on %s", where);
+}
+
+void Inspector::ContextCreated(Local<Context> context, const string& name) {
+  if (!inspector_) return;
+  inspector_->contextCreated(v8_inspector::V8ContextInfo(
+      context, kContextGroupId,
+      v8_inspector::StringView(reinterpret_cast<const uint8_t*>(name.data()), name.length())));
+}
+
+void Inspector::ContextDestroyed(Local<Context> context) {
+  if (!inspector_) return;
+  inspector_->contextDestroyed(context);
+}
+
+void* Inspector::Serve(void*) {
+  for (;;) {
+    int fd = accept(listen_fd_, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR) usleep(100000);
+      continue;
+    }
+    if (Handshake(fd)) RunSession(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+static string Base64(const unsigned char* data, size_t len) {
+  static const char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  string out;
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t n = data[i] << 16;
+    if (i + 1 < len) n |= data[i + 1] << 8;
+    if (i + 2 < len) n |= data[i + 2];
+    out += kAlphabet[(n >> 18) & 63];
+    out += kAlphabet[(n >> 12) & 63];
+    out += i + 1 < len ? kAlphabet[(n >> 6) & 63] : '=';
+    out += i + 2 < len ? kAlphabet[n & 63] : '=';
+  }
+  return out;
+}
+
+static bool WriteAll(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool ReadAll(int fd, char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = recv(fd, data, len, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+// The value of a request header, looked up case insensitively.
+static string HeaderValue(const string& request, const char* name) {
+  string lower(request);
+  for (size_t i = 0; i < lower.length(); i++) lower[i] = tolower(lower[i]);
+  size_t pos = lower.find(string("\r\n") + name + ":");
+  if (pos == string::npos) return "";
+  pos += strlen(name) + 3;
+  size_t end = request.find("\r\n", pos);
+  while (pos < end && isspace(request[pos])) pos++;
+  while (end > pos && isspace(request[end - 1])) end--;
+  return request.substr(pos, end - pos);
+}
+
+// True if a Host header names the loopback interface, so the request
+// can't have come from a web page through DNS rebinding.
+static bool LoopbackHost(const string& host) {
+  size_t colon = host.find(':', !host.empty() && host[0] == '[' ? host.find(']') : 0);
+  string name = host.substr(0, colon);
+  // It goes into the discovery JSON, so the port must be just digits
+  if (colon != string::npos) {
+    if (colon + 1 == host.length()) return false;
+    for (size_t i = colon + 1; i < host.length(); i++) {
+      if (!isdigit(host[i])) return false;
+    }
+  }
+  for (size_t i = 0; i < name.length(); i++) name[i] = tolower(name[i]);
+  return name == "localhost" || name == "127.0.0.1" || name == "[::1]";
+}
+
+// Answers the DevTools discovery requests under /json, and upgrades
+// requests for the session path to a WebSocket.  Requests naming
+// another host or sent by a web page are refused.
+bool Inspector::Handshake(int fd) {
+  string request;
+  char buf[1024];
+  while (request.find("\r\n\r\n") == string::npos) {
+    if (request.length() > 16 * 1024) return false;
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    request.append(buf, n);
+  }
+  size_t path_start = request.find(' ');
+  size_t path_end = path_start == string::npos ? string::npos : request.find(' ', path_start + 1);
+  if (path_end == string::npos) return false;
+  string path = request.substr(path_start + 1, path_end - path_start - 1);
+
+  string host = HeaderValue(request, "host");
+  string origin = HeaderValue(request, "origin");
+  string key = HeaderValue(request, "sec-websocket-key");
+  const char* status = NULL;
+  if (!LoopbackHost(host) || (!origin.empty() && origin != "devtools://devtools")) {
+    status = "403 Forbidden";
+  } else if (!key.empty() && path != path_) {
+    status = "404 Not Found";
+  } else if (!key.empty()) {
+    static const char kGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    string accept_key = key + kGuid;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    EVP_Digest(accept_key.data(), accept_key.length(), digest, &digest_len, EVP_sha1(), NULL);
+    string response =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: " + Base64(digest, digest_len) + "\r\n\r\n";
+    return WriteAll(fd, response.data(), response.length());
+  }
+
+  // On a Unix socket only the client knows the address it forwards from
+  string address = endpoint_.empty() ? host : endpoint_;
+  string body;
+  if (status == NULL && (path == "/json" || path == "/json/list")) {
+    body = "[{\"description\":\"traffic_server v8 plugin\","
+           "\"devtoolsFrontendUrl\":\"devtools://devtools/bundled/js_app.html?v8only=true&ws=" +
+           address + path_ + "\","
+           "\"id\":\"" + path_.substr(1) + "\",\"title\":\"traffic_server\",\"type\":\"node\","
+           "\"url\":\"file://\",\"webSocketDebuggerUrl\":\"ws://" + address + path_ + "\"}]";
+  } else if (status == NULL && path == "/json/version") {
+    body = "{\"Browser\":\"traffic_server/" + string(v8::V8::GetVersion()) +
+           "\",\"Protocol-Version\":\"1.3\"}";
+  }
+  if (status == NULL) status = body.empty() ? "404 Not Found" : "200 OK";
+  char head[160];
+  snprintf(head, sizeof(head),
+           "HTTP/1.1 %s\r\nContent-Type: application/json; charset=UTF-8\r\n"
+           "Content-Length: %d\r\nConnection: close\r\n\r\n",
+           status, static_cast<int>(body.length()));
+  WriteAll(fd, head, strlen(head));
+  WriteAll(fd, body.data(), body.length());
+  return false;
+}
+
+void Inspector::RunSession(int fd) {
+  {
+    v8::Locker locker(isolate_);
+    isolate_->Enter();
+#if V8_MAJOR_VERSION >= 11
+    session_ = inspector_->connect(kContextGroupId, &channel_, v8_inspector::StringView(),
+                                   v8_inspector::V8Inspector::kFullyTrusted);
+#else
+    session_ = inspector_->connect(kContextGroupId, &channel_, v8_inspector::StringView());
+#endif
+    isolate_->Exit();
+  }
+  {
+    std::lock_guard<std::mutex> lock(outbox_mutex_);
+    connected_ = true;
+    overflowed_ = false;
+  }
+  client_fd_ = fd;
+  TSDebug(PLUGIN_NAME, "inspector client connected");
+
+  int opcode;
+  string message;
+  for (;;) {
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fds_[0];
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (fds[1].revents & POLLIN) {
+      char drain[64];
+      while (read(wake_fds_[0], drain, sizeof(drain)) > 0) { }
+    }
+    if (!SendQueued()) break;
+    if (fds[0].revents == 0) continue;
+
+    if (!ReadFrame(fd, &opcode, &message) || opcode == kClose) break;
+    if (opcode == kPing) {
+      SendFrame(kPong, message);
+    } else if (opcode == kText) {
+      string reply = Dispatch(message);
+      if (!reply.empty()) SendFrame(kText, reply);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(outbox_mutex_);
+    connected_ = false;
+    outbox_.clear();
+    outbox_bytes_ = 0;
+  }
+  client_fd_ = -1;
+  v8::Locker locker(isolate_);
+  isolate_->Enter();
+  session_.reset();
+  isolate_->Exit();
+  TSDebug(PLUGIN_NAME, "inspector client disconnected");
+}
+
+// Read one message, joining fragments; control frames in between are
+// returned as they come.
+bool Inspector::ReadFrame(int fd, int* opcode, string* payload) {
+  payload->clear();
+  for (;;) {
+    unsigned char head[2];
+    if (!ReadAll(fd, reinterpret_cast<char*>(head), 2)) return false;
+    bool fin = head[0] & 0x80;
+    int op = head[0] & 0x0f;
+    uint64_t len = head[1] & 0x7f;
+    if (len == 126 || len == 127) {
+      unsigned char ext[8];
+      int n = len == 126 ? 2 : 8;
+      if (!ReadAll(fd, reinterpret_cast<char*>(ext), n)) return false;
+      len = 0;
+      for (int i = 0; i < n; i++) len = (len << 8) | ext[i];
+    }
+    if (payload->length() + len > kMaxMessage) return false;
+    unsigned char mask[4] = {0, 0, 0, 0};
+    if ((head[1] & 0x80) && !ReadAll(fd, reinterpret_cast<char*>(mask), 4)) return false;
+    size_t start = payload->length();
+    payload->resize(start + len);
+    if (len > 0 && !ReadAll(fd, &(*payload)[start], len)) return false;
+    for (uint64_t i = 0; i < len; i++) (*payload)[start + i] ^= mask[i % 4];
+
+    if (op >= kClose) {
+      // control frames are never fragmented
+      *opcode = op;
+      if (start > 0) payload->erase(0, start);
+      return true;
+    }
+    if (op != kContinuation) *opcode = op;
+    if (fin) return true;
+  }
+}
+
+bool Inspector::SendFrame(int opcode, const string& payload) {
+  if (client_fd_ < 0) return false;
+  unsigned char head[10];
+  size_t head_len = 2;
+  head[0] = 0x80 | opcode;
+  if (payload.length() < 126) {
+    head[1] = payload.length();
+  } else if (payload.length() <= 0xffff) {
+    head[1] = 126;
+    head[2] = payload.length() >> 8;
+    head[3] = payload.length() & 0xff;
+    head_len = 4;
+  } else {
+    head[1] = 127;
+    for (int i = 0; i < 8; i++) head[2 + i] = (static_cast<uint64_t>(payload.length()) >> (56 - 8 * i)) & 0xff;
+    head_len = 10;
+  }
+  return WriteAll(client_fd_, reinterpret_cast<char*>(head), head_len) &&
+         WriteAll(client_fd_, payload.data(), payload.length());
+}
+
+// Called with the isolate locked, so it must not block on the client.
+void Inspector::Queue(const string& message) {
+  std::lock_guard<std::mutex> lock(outbox_mutex_);
+  if (!connected_) return;
+  if (outbox_bytes_ + message.length() > kMaxOutbox) {
+    overflowed_ = true;
+  } else {
+    outbox_.push_back(message);
+    outbox_bytes_ += message.length();
+  }
+  char wake = 0;
+  if (write(wake_fds_[1], &wake, 1) < 0) {
+    // Full means a wakeup is pending already
+  }
+}
+
+// Write what was queued; false if the client is gone or fell too far
+// behind.
+bool Inspector::SendQueued() {
+  std::deque<string> messages;
+  {
+    std::lock_guard<std::mutex> lock(outbox_mutex_);
+    if (overflowed_) {
+      TSError("[v8] inspector client too slow, disconnecting it");
+      return false;
+    }
+    messages.swap(outbox_);
+    outbox_bytes_ = 0;
+  }
+  for (size_t i = 0; i < messages.size(); i++) {
+    if (!SendFrame(kText, messages[i])) return false;
+  }
+  return true;
+}
+
+// Only the methods that cannot pause the isolate, stop a script or run
+// code in it get through.
+bool Inspector::Allowed(const string& method) {
+  string domain = method.substr(0, method.find('.'));
+  if (domain == "Profiler" || domain == "HeapProfiler" || domain == "Schema") return true;
+  if (domain == "Runtime") {
+    return method != "Runtime.evaluate" && method != "Runtime.callFunctionOn" &&
+           method != "Runtime.compileScript" && method != "Runtime.runScript" &&
+           method != "Runtime.terminateExecution" && method != "Runtime.addBinding";
+  }
+  return false;
+}
+
+/**
+ * Hand a client message to the session, or return the JSON-RPC error
+ * to answer it with.  The message is parsed, and the session gets it
+ * serialized again, so the method that was checked is the one the
+ * session sees: neither escapes nor a repeated "method" key can get
+ * another one past the check.
+ */
+string Inspector::Dispatch(const string& message) {
+  string reply;
+  v8::Locker locker(isolate_);
+  isolate_->Enter();
+  {
+    HandleScope handle_scope(isolate_);
+    Local<Context> context = Local<Context>::New(isolate_, context_);
+    Context::Scope context_scope(context);
+    TryCatch try_catch(isolate_);
+
+    Local<String> text;
+    Local<Value> parsed;
+    Local<String> canonical;
+    if (message.length() > static_cast<size_t>(String::kMaxLength) ||
+        !String::NewFromUtf8(isolate_, message.data(), NewStringType::kNormal,
+                             static_cast<int>(message.length())).ToLocal(&text) ||
+        !v8::JSON::Parse(context, text).ToLocal(&parsed) || !parsed->IsObject() ||
+        !v8::JSON::Stringify(context, parsed).ToLocal(&canonical)) {
+      reply = ErrorReply(context, v8::Undefined(isolate_), -32700, "unable to parse the message");
+    } else {
+      Local<Object> request = parsed.As<Object>();
+      Local<Value> id = request->Get(context, String::NewFromUtf8(isolate_, "id",
+                                                                  NewStringType::kNormal)
+                                                  .ToLocalChecked())
+                            .FromMaybe(Local<Value>());
+      Local<Value> method_val = request->Get(context, String::NewFromUtf8(isolate_, "method",
+                                                                          NewStringType::kNormal)
+                                                          .ToLocalChecked())
+                                    .FromMaybe(Local<Value>());
+      string method;
+      if (!method_val.IsEmpty() && method_val->IsString()) {
+        String::Utf8Value utf8(isolate_, method_val);
+        method.assign(*utf8, utf8.length());
+      }
+      if (id.IsEmpty()) id = v8::Undefined(isolate_);
+      if (!Allowed(method)) {
+        reply = ErrorReply(context, id, -32601,
+                           method.substr(0, 100) + " is not allowed on a production server");
+      } else {
+        String::Value utf16(isolate_, canonical);
+        session_->dispatchProtocolMessage(v8_inspector::StringView(
+            reinterpret_cast<const uint16_t*>(*utf16), utf16.length()));
+      }
+    }
+  }
+  isolate_->Exit();
+  return reply;
+}
+
+string Inspector::ErrorReply(Local<Context> context, Local<Value> id, int code,
+                             const string& message) {
+  Local<Object> error = Object::New(isolate_);
+  error->Set(context, String::NewFromUtf8(isolate_, "code", NewStringType::kNormal)
+                          .ToLocalChecked(),
+             v8::Integer::New(isolate_, code)).FromJust();
+  error->Set(context, String::NewFromUtf8(isolate_, "message", NewStringType::kNormal)
+                          .ToLocalChecked(),
+             String::NewFromUtf8(isolate_, message.data(), NewStringType::kNormal,
+                                 static_cast<int>(message.length())).ToLocalChecked())
+      .FromJust();
+  Local<Object> reply = Object::New(isolate_);
+  reply->Set(context, String::NewFromUtf8(isolate_, "id", NewStringType::kNormal)
+                          .ToLocalChecked(),
+             id->IsNumber() ? id : Local<Value>(v8::Integer::New(isolate_, 0))).FromJust();
+  reply->Set(context, String::NewFromUtf8(isolate_, "error", NewStringType::kNormal)
+                          .ToLocalChecked(),
+             error).FromJust();
+  Local<String> json;
+  if (!v8::JSON::Stringify(context, reply).ToLocal(&json)) return "";
+  String::Utf8Value utf8(isolate_, json);
+  return string(*utf8, utf8.length());
+}
+
+string Inspector::ToUtf8(const v8_inspector::StringView& view) {
+  string out;
+  out.reserve(view.length());
+  for (size_t i = 0; i < view.length(); i++) {
+    uint32_t c = view.is8Bit() ? view.characters8()[i] : view.characters16()[i];
+    if (!view.is8Bit() && c >= 0xd800 && c < 0xdc00 && i + 1 < view.length()) {
+      uint32_t low = view.characters16()[i + 1];
+      if (low >= 0xdc00 && low < 0xe000) {
+        c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+        i++;
+      }
+    }
+    if (c < 0x80) {
+      out += static_cast<char>(c);
+    } else if (c < 0x800) {
+      out += static_cast<char>(0xc0 | (c >> 6));
+      out += static_cast<char>(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+      out += static_cast<char>(0xe0 | (c >> 12));
+      out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+      out += static_cast<char>(0x80 | (c & 0x3f));
+    } else {
+      out += static_cast<char>(0xf0 | (c >> 18));
+      out += static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+      out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+      out += static_cast<char>(0x80 | (c & 0x3f));
+    }
+  }
+  return out;
+}
+
+#else
+void Inspector::Start(Isolate* isolate) {
+  if (getenv("TS_V8_INSPECTOR") != NULL) {
+    TSError("[v8] TS_V8_INSPECTOR is set, but the plugin was built without v8-inspector.h");
+  }
+}
+
+void Inspector::ContextCreated(Local<Context> context, const string& name) { }
+void Inspector::ContextDestroyed(Local<Context> context) { }
+#endif
+
+/**
+ * The abstract superclass of http request processors.
+ */
+class HttpRequestProcessor {
+ public:
+  virtual ~HttpRequestProcessor() { }
+
+  // Initialize this processor.  The map contains options that control
+  // how requests should be processed.
+  virtual bool Initialize(map<string, string>* options) = 0;
+
+  // Process a single request.
+  virtual TSRemapStatus Process(HttpRequest* request) = 0;
+
+  // Returns true if the status means the request URL was rewritten.
+  static bool IsRemapped(TSRemapStatus status) {
+    return status == TSREMAP_DID_REMAP || status == TSREMAP_DID_REMAP_STOP;
+  }
+
+  static void Debug(const char* msg);
+  static void Error(const char* msg);
+
+  // Serialize an analytics event and queue it for the event log.
+  static bool Emit(Local<Value> event);
+};
+
+void HttpRequestProcessor::Debug(const char* msg) {
+  TSDebug(PLUGIN_NAME, "%s", msg);
+}
+
+void HttpRequestProcessor::Error(const char* msg) {
+  // Fall back to the diagnostics log until the error log is running
+  if (!ErrorLog::Write(msg)) TSError("[v8] %s", msg);
+}
+
+bool HttpRequestProcessor::Emit(Local<Value> event) {
+  Isolate* isolate = Isolate::GetCurrent();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  // Strings hold already serialized events.  They are parsed and
+  // serialized again, so what is logged is one line of valid JSON.
+  TryCatch try_catch(isolate);
+  Local<Value> value = event;
+  if (event->IsString() && !v8::JSON::Parse(context, event.As<String>()).ToLocal(&value)) {
+    Error("emit(): event string is not JSON, dropped");
+    return false;
+  }
+  // Stringify gives "undefined" for what JSON has no form of, and
+  // throws for cycles and throwing toJSON methods
+  Local<String> json;
+  if (value->IsUndefined() || value->IsFunction() || value->IsSymbol() ||
+      !v8::JSON::Stringify(context, value).ToLocal(&json) ||
+      json->StrictEquals(String::NewFromUtf8(isolate, "undefined", NewStringType::kNormal)
+                             .ToLocalChecked())) {
+    Error("emit(): event is not serializable, dropped");
+    return false;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  char record[EventLog::kRecordSize];
+  int prefix = snprintf(record, sizeof(record), "{\"time\":%lld,\"event\":",
+                        static_cast<long long>(now.tv_sec) * 1000 + now.tv_nsec / 1000000);
+  int len = json->WriteUtf8(isolate, record + prefix,
+                            static_cast<int>(sizeof(record)) - prefix - 1, NULL,
+                            String::NO_NULL_TERMINATION);
+  // Truncating would leave broken JSON; drop oversized events instead
+  if (json->Utf8Length(isolate) != len) {
+    Error("emit(): event too large, dropped");
+    return false;
+  }
+  record[prefix + len] = '}';
+  return EventLog::Write(record, prefix + len + 1);
+}
+
+/**
+ * Runs a candidate version of a rule's script on a sample of the
+ * rule's requests, off the transactions' path.  The live side copies a
+ * sampled request's inputs before its script runs and hands the copy
+ * over with the live decision; a worker on the task thread pool runs
+ * the candidate over it and compares the decisions.  The candidate is
+ * disabled if it goes over its time budget too often.
+ */
+class Shadow {
+ public:
+  // A sampled request with the live script's decision.
+  struct Entry {
+    explicit Entry(HttpRequest* r) : request(r), status(TSREMAP_NO_REMAP) { }
+    StringHttpRequest request;
+    TSRemapStatus status;
+    // The live rewrites, if the request was remapped.
+    string host;
+    string path;
+  };
+
+  Shadow(JsHttpRequestProcessor* candidate, uint32_t sample, TSHRTime budget);
+  ~Shadow();
+
+  // Take no more samples and wait for the worker to finish the call it
+  // may be making.  Must not be called with the isolate locked, since
+  // that call takes the lock.
+  void Stop();
+
+  // Register the shadow_* stats under the live rule's name.
+  bool Initialize(const string& name);
+
+  // Live side.  Copy the request if it is sampled, before the live
+  // script has rewritten it; NULL if it is not.
+  Entry* Sample(HttpRequest* request);
+  // Hand over a sampled request with the live decision for it.
+  void Submit(Entry* entry, TSRemapStatus status, HttpRequest* request);
+
+ private:
+  enum Counter { kSampled, kDropped, kCompared, kDiffs, kOverBudget, kDisabled, kCounterCount };
+  static const char* const kNames[kCounterCount];
+
+  static const size_t kMaxQueue = 256;
+  // More than kMaxOverBudget calls over budget in a window of
+  // kBudgetWindow calls disable the candidate.
+  static const int kBudgetWindow = 1000;
+  static const int kMaxOverBudget = 10;
+  static const int kMaxLoggedDiffs = 100;
+
+  static int WorkerHandler(TSCont contp, TSEvent event, void* edata);
+  void Run();
+  void Compare(Entry* entry);
+
+  std::unique_ptr<JsHttpRequestProcessor> candidate_;
+  uint32_t sample_;
+  TSHRTime budget_;
+  std::atomic<uint32_t> seen_;
+  std::atomic<bool> disabled_;
+  ShardedStats stats_;
+
+  // action_ is set from when the worker is scheduled until it returns.
+  TSCont worker_;
+  TSAction action_;
+  bool stopping_;
+  std::mutex mutex_;
+  std::condition_variable idle_;
+  std::deque<Entry*> queue_;
+
+  // Only touched by the worker.
+  int window_calls_;
+  int window_over_budget_;
+  int logged_diffs_;
+};
+
+/**
+ * An http request processor that is scriptable using JavaScript.
+ */
+class JsHttpRequestProcessor : public HttpRequestProcessor {
+ public:
+  // Creates a new processor that processes requests by invoking the
+  // Process function of the JavaScript script given as an argument.
+  JsHttpRequestProcessor(Isolate* isolate, Local<String> script)
+      : isolate_(isolate), script_(script), slow_(0), log_fields_(false),
+        capture_file_(-1), capture_sample_(1), capture_seen_(0), response_cont_(NULL), batch_size_(0), batch_wait_ms_(0), batch_worker_(NULL), batch_action_(NULL), refs_(1) {}
+  JsHttpRequestProcessor(Isolate* isolate, string file)
+      : isolate_(isolate), file_(file), slow_(0), log_fields_(false),
+        capture_file_(-1), capture_sample_(1), capture_seen_(0), response_cont_(NULL), batch_size_(0), batch_wait_ms_(0), batch_worker_(NULL), batch_action_(NULL), refs_(1) {}
+  virtual ~JsHttpRequestProcessor();
+
+  // The remap instance holds the first reference, and transactions
+  // and body transforms that still use this processor one each.
+  // Dropping the last one deletes the processor, with the isolate
+  // locked.
+  // Release must be called without the isolate locked.
+  void Retain() { refs_.fetch_add(1, std::memory_order_relaxed); }
+  void Release();
+
+  virtual bool Initialize(map<string, string>* opts);
+  virtual TSRemapStatus Process(HttpRequest* request);
+
+  Isolate* GetIsolate() { return isolate_; }
+
+  // The name this processor's stats are published under.
+  void SetName(const string& name) { name_ = name; }
+  const string& name() const { return name_; }
+  const string& file() const { return file_; }
+  ProcessorStats* stats() { return &stats_; }
+  ScriptMetrics* metrics() { return &metrics_; }
+
+  // Create the templates of a new isolate and attach them to it.  Must
+  // be called with the isolate locked, before any processor uses it.
+  static void SetupIsolate(Isolate* isolate);
+
+  // True if script time is recorded for the access log.
+  bool LogsFields() const { return log_fields_; }
+
+  // Write the client request to the capture file if this rule captures
+  // requests and this one is sampled.
+  void Capture(TSHttpTxn txn, TSRemapRequestInfo* rri) {
+    if (capture_file_ < 0) return;
+    if (capture_seen_.fetch_add(1, std::memory_order_relaxed) % capture_sample_ != 0) return;
+    RequestCapture::Write(capture_file_, txn, rri->requestBufp, rri->requestHdrp, rri->requestUrl);
+  }
+
+  // The candidate script running in shadow of this one, if any.
+  Shadow* shadow() { return shadow_.get(); }
+
+  // Have the response body streamed through TransformBody, if the
+  // script has one and the request can get a body back.  The
+  // transaction holds a reference until it closes.
+  void HookResponse(TSHttpTxn txn, TSRemapRequestInfo* rri);
+
+  // Hand the next len bytes of a response body to TransformBody, one
+  // buffer block per call, or a null chunk for the end of the body if
+  // reader is NULL.  What comes back is written to output, blocks left
+  // alone by reference.  state is created on the first call.  After an
+  // exception *failed is set and the rest is passed on as it is.  Must
+  // be called with the isolate locked; returns the bytes written.
+  int64_t TransformBody(Global<Object>* state, TSIOBufferReader reader, int64_t len,
+                        TSIOBuffer output, bool* failed);
+
+  // True if requests are handed to ProcessBatch instead of Process.
+  bool IsBatching() const { return batch_size_ > 1; }
+
+  // Capture the request and park the transaction at the post-remap
+  // hook until the batch worker has run ProcessBatch over it.  The
+  // transaction holds a reference until it closes.
+  TSRemapStatus QueueRequest(TSHttpTxn txn, TSRemapRequestInfo* rri);
+
+ private:
+  // Marks this processor as the one running on its isolate while in
+  // scope, so GC pauses can be attributed to it.
+  class RunningScope {
+   public:
+    explicit RunningScope(JsHttpRequestProcessor* processor)
+        : data_(IsolateData::Get(processor->GetIsolate())), previous_(data_->running) {
+      data_->running = processor;
+    }
+    ~RunningScope() { data_->running = previous_; }
+
+   private:
+    IsolateData* data_;
+    JsHttpRequestProcessor* previous_;
+  };
+
+  // A transaction waiting for its batch to be processed.
+  struct BatchEntry {
+    BatchEntry(JsHttpRequestProcessor* p, TSHttpTxn t, HttpRequest* r)
+        : processor(p), txn(t), cont(NULL), request(r),
+          status(TSREMAP_NO_REMAP) {}
+    JsHttpRequestProcessor* processor;
+    TSHttpTxn txn;
+    TSCont cont;
+    StringHttpRequest request;
+    TSRemapStatus status;
+  };
+
+  // Execute the script associated with this processor and extract the
+  // Process function.  Returns true if this succeeded, otherwise false.
+  bool ExecuteScript(Local<String> script);
+
+  // Wrap the options and output map in a JavaScript objects and
+  // install it in the global namespace as 'options' and 'output'.
+  bool InstallMaps(map<string, string>* opts);
+
+  // Load the candidate script given by the shadow option.
+  void InitializeShadow(map<string, string>* opts);
+
+  // Read the batching options and look up the ProcessBatch function.
+  bool InitializeBatching(Local<Context> context, map<string, string>* opts);
+
+  // Write a call of Process that took longer than slow_ms to the slow
+  // log, with what is needed to replay it.
+  void LogSlowCall(HttpRequest* request, TSHRTime elapsed, uint64_t gc_count,
+                   TSHRTime gc_pause, const char* outcome);
+
+  // Run ProcessBatch over the entries, storing each entry's decision.
+  void ProcessBatch(const vector<BatchEntry*>& entries);
+
+  // Call TransformBody on one chunk and write out what it returned.
+  // Returns false if the chunk is to be passed on as it is.
+  bool CallTransformBody(Local<Context> context, Local<Value> chunk, Local<Object> state,
+                         TSIOBuffer output, int64_t* written, bool* failed);
+
+  // Continuation handler for the response hooks, which start the body
+  // transform on 200 responses.
+  static int ResponseHandler(TSCont contp, TSEvent event, void* edata);
+
+  // Turn a value returned by the script into a remap status.  Numbers
+  // are taken as a TSRemapStatus, anything else means "remap if the
+  // request was rewritten".
+  static TSRemapStatus ToRemapStatus(Local<Value> decision,
+                                     HttpRequest* request);
+
+  // Continuation handlers for the post-remap and close hooks of
+  // batched transactions and for the batch worker.
+  static int BatchHookHandler(TSCont contp, TSEvent event, void* edata);
+  static int BatchWorkerHandler(TSCont contp, TSEvent event, void* edata);
+  void EnqueueBatchEntry(BatchEntry* entry);
+  void RunBatch();
+
+  // Constructs the template that describes the JavaScript wrapper
+  // type for requests.
+  static Local<ObjectTemplate> MakeRequestTemplate(Isolate* isolate);
+  static Local<ObjectTemplate> MakeMapTemplate(Isolate* isolate);
+
+  // Constructs the template for the global object of each context,
+  // holding the built-in global functions.
+  static Local<ObjectTemplate> MakeGlobalTemplate(Isolate* isolate);
+
+  // Callbacks that access the individual fields of request objects.
+  static void GetUrl(Local<Name> name, const PropertyCallbackInfo<Value>& info);
+  static void GetMethod(Local<Name> name, const PropertyCallbackInfo<Value>& info);
+  static void GetHost(Local<Name> name, const PropertyCallbackInfo<Value>& info);
+  static void SetHost(Local<Name> name, Local<Value> value,
+                      const PropertyCallbackInfo<void>& info);
+  static void GetPath(Local<Name> name, const PropertyCallbackInfo<Value>& info);
+  static void SetPath(Local<Name> name, Local<Value> value,
+                      const PropertyCallbackInfo<void>& info);
+  static void GetClientIp(Local<Name> name, const PropertyCallbackInfo<Value>& info);
+  static void GetUserAgent(Local<Name> name, const PropertyCallbackInfo<Value>& info);
+  static void GetReferrer(Local<Name> name, const PropertyCallbackInfo<Value>& info);
+
+  // Callbacks that access maps
+  static void MapGet(Local<Name> name, const PropertyCallbackInfo<Value>& info);
+  static void MapSet(Local<Name> name, Local<Value> value,
+                     const PropertyCallbackInfo<Value>& info);
+
+  // Utility methods for wrapping C++ objects as JavaScript objects,
+  // and going back again.
+  Local<Object> WrapMap(map<string, string>* obj);
+  static map<string, string>* UnwrapMap(Local<Object> obj);
+  Local<Object> WrapRequest(HttpRequest* obj);
+  static HttpRequest* UnwrapRequest(Local<Object> obj);
+
+  // Detach a request wrapper from its C++ object, so a script that
+  // holds on to it cannot reach the request after it is gone.
+  void ReleaseRequest(Local<Object> obj);
+
+  MaybeLocal<String> ReadFile(Isolate* isolate, const string& name);
+
+  Isolate* isolate_;
+  Local<String> script_;
+  string file_;
+  string name_;
+  ProcessorStats stats_;
+  ScriptMetrics metrics_;
+  Global<Context> context_;
+  Global<Function> process_;
+  Global<Function> process_batch_;
+  Global<Function> transform_body_;
+  // Calls of Process taking longer go to the slow log; 0 if off.
+  TSHRTime slow_;
+  bool log_fields_;
+  // Every capture_sample_th request goes to the capture file, if any.
+  int capture_file_;
+  uint32_t capture_sample_;
+  std::atomic<uint32_t> capture_seen_;
+  std::unique_ptr<Shadow> shadow_;
+  // Set if the script has TransformBody.
+  TSCont response_cont_;
+
+  // Batching state.  The queue is filled from the transactions'
+  // threads and drained by the batch worker on the task thread pool.
+  int batch_size_;
+  int batch_wait_ms_;
+  TSCont batch_worker_;
+  TSAction batch_action_;
+  std::mutex batch_mutex_;
+  std::deque<BatchEntry*> batch_queue_;
+
+  std::atomic<int> refs_;
+};
+
+/**
+ * Bindings generated from plain C++ function signatures.
+ *
+ * JS_BINDING(fn) is a FunctionTemplate factory for the C++ function fn.
+ * Each parameter is converted by the JsArg specialization for its type
+ * and the result goes back through JsResult, so a new TS API binding is
+ * just a C++ function.  As with hand-written callbacks, a call with too
+ * few arguments does nothing and returns undefined, and so does one
+ * whose argument conversion throws, with the exception left for the
+ * script to see.  Trailing Local<Value> parameters are optional and get
+ * undefined.  Functions taking and returning only numbers and booleans
+ * also get a V8 Fast API entry point where the engine supports it.
+ */
+struct JsRawArg {
+  Isolate* isolate;
+  Local<Value> value;
+};
+
+template <typename T>
+struct JsArg;
+
+template <>
+struct JsArg<const char*> {
+  explicit JsArg(const JsRawArg& arg) : value_(arg.isolate, arg.value) {}
+  bool Ok() { return *value_ != NULL; }
+  const char* Get() { return *value_; }
+  String::Utf8Value value_;
+};
+
+template <>
+struct JsArg<const string&> {
+  explicit JsArg(const JsRawArg& arg) : ok_(false) {
+    String::Utf8Value utf8_value(arg.isolate, arg.value);
+    if (*utf8_value == NULL) return;
+    value_.assign(*utf8_value, utf8_value.length());
+    ok_ = true;
+  }
+  bool Ok() { return ok_; }
+  const string& Get() { return value_; }
+  string value_;
+  bool ok_;
+};
+
+template <>
+struct JsArg<int32_t> {
+  explicit JsArg(const JsRawArg& arg)
+      : value_(arg.value->Int32Value(arg.isolate->GetCurrentContext())) {}
+  bool Ok() { return value_.IsJust(); }
+  int32_t Get() { return value_.FromJust(); }
+  Maybe<int32_t> value_;
+};
+
+template <>
+struct JsArg<int64_t> {
+  explicit JsArg(const JsRawArg& arg)
+      : value_(arg.value->IntegerValue(arg.isolate->GetCurrentContext())) {}
+  bool Ok() { return value_.IsJust(); }
+  int64_t Get() { return value_.FromJust(); }
+  Maybe<int64_t> value_;
+};
+
+template <>
+struct JsArg<double> {
+  explicit JsArg(const JsRawArg& arg)
+      : value_(arg.value->NumberValue(arg.isolate->GetCurrentContext())) {}
+  bool Ok() { return value_.IsJust(); }
+  double Get() { return value_.FromJust(); }
+  Maybe<double> value_;
+};
+
+template <>
+struct JsArg<bool> {
+  explicit JsArg(const JsRawArg& arg) : value_(arg.value->BooleanValue(arg.isolate)) {}
+  bool Ok() { return true; }
+  bool Get() { return value_; }
+  bool value_;
+};
+
+template <>
+struct JsArg<Local<Value> > {
+  explicit JsArg(const JsRawArg& arg) : value_(arg.value) {}
+  bool Ok() { return true; }
+  Local<Value> Get() { return value_; }
+  Local<Value> value_;
+};
+
+template <typename R>
+struct JsResult {
+  template <typename F, typename... A>
+  static void Call(const v8::FunctionCallbackInfo<Value>& args, F fn, A&&... a) {
+    Set(args, fn(std::forward<A>(a)...));
+  }
+  static void Set(const v8::FunctionCallbackInfo<Value>& args, R value) {
+    args.GetReturnValue().Set(value);
+  }
+};
+
+template <>
+struct JsResult<void> {
+  template <typename F, typename... A>
+  static void Call(const v8::FunctionCallbackInfo<Value>& /*args*/, F fn, A&&... a) {
+    fn(std::forward<A>(a)...);
+  }
+};
+
+template <>
+inline void JsResult<string>::Set(const v8::FunctionCallbackInfo<Value>& args,
+                                  string value) {
+  args.GetReturnValue().Set(
+      String::NewFromUtf8(args.GetIsolate(), value.c_str(),
+                          NewStringType::kNormal,
+                          static_cast<int>(value.length())).ToLocalChecked());
+}
+
+template <>
+inline void JsResult<int64_t>::Set(const v8::FunctionCallbackInfo<Value>& args,
+                                   int64_t value) {
+  args.GetReturnValue().Set(static_cast<double>(value));
+}
+
+// Types the V8 Fast API can pass without touching the heap.
+template <typename T>
+struct JsFastType {
+  static const bool value = std::is_same<T, bool>::value ||
+                            std::is_same<T, int32_t>::value ||
+                            std::is_same<T, double>::value;
+};
+
+template <>
+struct JsFastType<void> {
+  static const bool value = true;
+};
+
+template <typename... T>
+struct JsAllFast;
+
+template <>
+struct JsAllFast<> {
+  static const bool value = true;
+};
+
+template <typename T, typename... Rest>
+struct JsAllFast<T, Rest...> {
+  static const bool value = JsFastType<T>::value && JsAllFast<Rest...>::value;
+};
+
+// The number of parameters up to the last one that isn't a
+// Local<Value>.
+template <typename... T>
+struct JsRequiredArgs;
+
+template <>
+struct JsRequiredArgs<> {
+  static const int value = 0;
+};
+
+template <typename T, typename... Rest>
+struct JsRequiredArgs<T, Rest...> {
+  static const int value =
+      JsRequiredArgs<Rest...>::value > 0 || !std::is_same<T, Local<Value> >::value
+          ? 1 + JsRequiredArgs<Rest...>::value
+          : 0;
+};
+
+template <typename Sig, Sig fn>
+struct JsBinding;
+
+template <typename R, typename... Args, R (*fn)(Args...)>
+struct JsBinding<R (*)(Args...), fn> {
+  static const bool kFast = JsFastType<R>::value && JsAllFast<Args...>::value;
+
+  static void Callback(const v8::FunctionCallbackInfo<Value>& args) {
+    if (args.Length() < JsRequiredArgs<Args...>::value) return;
+    Dispatch(args, std::index_sequence_for<Args...>());
+  }
+
+  template <size_t... I>
+  static void Dispatch(const v8::FunctionCallbackInfo<Value>& args,
+                       std::index_sequence<I...>) {
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+    std::tuple<JsArg<Args>...> converted(JsRawArg{isolate, args[I]}...);
+    // A conversion that threw (say, a valueOf that throws) leaves the
+    // exception pending; fn must not run on a made-up value.
+    bool ok[] = {true, std::get<I>(converted).Ok()...};
+    for (bool arg_ok : ok) {
+      if (!arg_ok) return;
+    }
+    JsResult<R>::Call(args, fn, std::get<I>(converted).Get()...);
+    (void)isolate;
+    (void)converted;
+  }
+
+#if V8_MAJOR_VERSION >= 10
+  static R FastCallback(Local<Object> receiver, Args... args) {
+    return fn(args...);
+  }
+
+  static const v8::CFunction* FastFunction(std::true_type) {
+    static const v8::CFunction c_function = v8::CFunction::Make(FastCallback);
+    return &c_function;
+  }
+
+  static const v8::CFunction* FastFunction(std::false_type) { return NULL; }
+#endif
+
+  static Local<FunctionTemplate> New(Isolate* isolate) {
+#if V8_MAJOR_VERSION >= 10
+    return FunctionTemplate::New(
+        isolate, Callback, Local<Value>(), Local<v8::Signature>(),
+        JsRequiredArgs<Args...>::value, v8::ConstructorBehavior::kThrow,
+        v8::SideEffectType::kHasSideEffect,
+        FastFunction(std::integral_constant<bool, kFast>()));
+#else
+    return FunctionTemplate::New(
+        isolate, Callback, Local<Value>(), Local<v8::Signature>(),
+        JsRequiredArgs<Args...>::value, v8::ConstructorBehavior::kThrow);
+#endif
+  }
+};
+
+#define JS_BINDING(fn) JsBinding<decltype(&fn), &fn>
+
+// Registration runs while the script loads, before any request, so the
+// processor comes from the context.  Updates run inside Process or
+// ProcessBatch and take the running processor, which keeps them free
+// of handles and eligible for fast calls.
+int32_t ScriptMetrics::JsCounter(const string& name) {
+  Local<Context> context = Isolate::GetCurrent()->GetCurrentContext();
+  JsHttpRequestProcessor* processor = static_cast<JsHttpRequestProcessor*>(
+      context->GetAlignedPointerFromEmbedderData(IsolateData::kContextProcessorIndex));
+  if (processor == NULL) return -1;
+  int id = processor->metrics()->Counter(name);
+  if (id < 0) HttpRequestProcessor::Error("metrics.counter() only works while the script loads");
+  return id;
+}
+
+int32_t ScriptMetrics::JsHistogram(const string& name, Local<Value> bounds) {
+  Local<Context> context = Isolate::GetCurrent()->GetCurrentContext();
+  JsHttpRequestProcessor* processor = static_cast<JsHttpRequestProcessor*>(
+      context->GetAlignedPointerFromEmbedderData(IsolateData::kContextProcessorIndex));
+  if (processor == NULL) return -1;
+
+  vector<double> limits;
+  if (bounds->IsArray()) {
+    Local<Array> array = bounds.As<Array>();
+    for (uint32_t i = 0; i < array->Length(); i++) {
+      Local<Value> bound;
+      if (!array->Get(context, i).ToLocal(&bound) || !bound->IsNumber()) continue;
+      limits.push_back(bound.As<v8::Number>()->Value());
+    }
+  }
+  int id = processor->metrics()->Histogram(name, limits);
+  if (id < 0) {
+    HttpRequestProcessor::Error("metrics.histogram() only works while the script loads, "
+                                "with at most 32 bounds");
+  }
+  return id;
+}
+
+void ScriptMetrics::JsAdd(int32_t id, int32_t n) {
+  JsHttpRequestProcessor* processor = IsolateData::Get(Isolate::GetCurrent())->running;
+  if (processor != NULL) processor->metrics()->Add(id, n);
+}
+
+void ScriptMetrics::JsObserve(int32_t id, double value) {
+  JsHttpRequestProcessor* processor = IsolateData::Get(Isolate::GetCurrent())->running;
+  if (processor != NULL) processor->metrics()->Observe(id, value);
+}
+
+double ScriptMetrics::JsNow() {
+  return static_cast<double>(TShrtime() - time_origin) / TS_HRTIME_MSECOND;
+}
+
+JsHttpRequestProcessor::~JsHttpRequestProcessor() {
+  // Stop the shadow worker before anything it uses goes away
+  shadow_.reset();
+
+  // The context may outlive us until it is collected
+  if (!context_.IsEmpty()) {
+    HandleScope handle_scope(GetIsolate());
+    Local<Context> context = Local<Context>::New(GetIsolate(), context_);
+    context->SetAlignedPointerInEmbedderData(IsolateData::kContextProcessorIndex, NULL);
+    Inspector::ContextDestroyed(context);
+  }
+
+  // Dispose the persistent handles.  When no one else has any
+  // references to the objects stored in the handles they will be
+  // automatically reclaimed.
+  context_.Reset();
+  process_.Reset();
+  process_batch_.Reset();
+  transform_body_.Reset();
+
+  // Every transaction hooked to it has closed by now
+  if (response_cont_ != NULL) TSContDestroy(response_cont_);
+  // Batched transactions hold references, so none is queued by now
+  if (batch_worker_ != NULL) {
+    if (batch_action_ != NULL) TSActionCancel(batch_action_);
+    TSContDestroy(batch_worker_);
+  }
+}
+
+void JsHttpRequestProcessor::Release() {
+  if (refs_.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+  // Before the lock, which the shadow worker may be waiting for
+  if (shadow_ != NULL) shadow_->Stop();
+  Isolate* isolate = GetIsolate();
+  v8::Locker locker(isolate);
+  isolate->Enter();
+  delete this;
+  isolate->Exit();
+}
+
+void JsHttpRequestProcessor::SetupIsolate(Isolate* isolate) {
+  HandleScope handle_scope(isolate);
+
+  IsolateData* data = new IsolateData();
+  data->global_template.Reset(isolate, MakeGlobalTemplate(isolate));
+  data->map_template.Reset(isolate, MakeMapTemplate(isolate));
+  data->request_template.Reset(isolate, MakeRequestTemplate(isolate));
+  isolate->SetData(IsolateData::kSlot, data);
+}
+
+Local<ObjectTemplate> JsHttpRequestProcessor::MakeGlobalTemplate(
+    Isolate* isolate) {
+  EscapableHandleScope handle_scope(isolate);
+
+  Local<ObjectTemplate> global = ObjectTemplate::New(isolate);
+  global->Set(String::NewFromUtf8(isolate, "debug", NewStringType::kNormal)
+                  .ToLocalChecked(),
+              JS_BINDING(HttpRequestProcessor::Debug)::New(isolate));
+  global->Set(String::NewFromUtf8(isolate, "error", NewStringType::kNormal)
+                  .ToLocalChecked(),
+              JS_BINDING(HttpRequestProcessor::Error)::New(isolate));
+  global->Set(String::NewFromUtf8(isolate, "emit", NewStringType::kNormal)
+                  .ToLocalChecked(),
+              JS_BINDING(HttpRequestProcessor::Emit)::New(isolate));
+
+  Local<ObjectTemplate> metrics = ObjectTemplate::New(isolate);
+  metrics->Set(String::NewFromUtf8(isolate, "counter", NewStringType::kNormal)
+                   .ToLocalChecked(),
+               JS_BINDING(ScriptMetrics::JsCounter)::New(isolate));
+  metrics->Set(String::NewFromUtf8(isolate, "histogram", NewStringType::kNormal)
+                   .ToLocalChecked(),
+               JS_BINDING(ScriptMetrics::JsHistogram)::New(isolate));
+  metrics->Set(String::NewFromUtf8(isolate, "add", NewStringType::kNormal)
+                   .ToLocalChecked(),
+               JS_BINDING(ScriptMetrics::JsAdd)::New(isolate));
+  metrics->Set(String::NewFromUtf8(isolate, "observe", NewStringType::kNormal)
+                   .ToLocalChecked(),
+               JS_BINDING(ScriptMetrics::JsObserve)::New(isolate));
+  global->Set(String::NewFromUtf8(isolate, "metrics", NewStringType::kNormal)
+                  .ToLocalChecked(),
+              metrics);
+
+  Local<ObjectTemplate> performance = ObjectTemplate::New(isolate);
+  performance->Set(String::NewFromUtf8(isolate, "now", NewStringType::kNormal)
+                       .ToLocalChecked(),
+                   JS_BINDING(ScriptMetrics::JsNow)::New(isolate));
+  global->Set(String::NewFromUtf8(isolate, "performance", NewStringType::kNormal)
+                  .ToLocalChecked(),
+              performance);
+
+  return handle_scope.Escape(global);
+}
+
+// Execute the script and fetch the Process method.
+bool JsHttpRequestProcessor::Initialize(map<string, string>* opts) {
+  TSDebug(PLUGIN_NAME, "Initialize()");
+
+  // Create a handle scope to hold the temporary references.
+  HandleScope handle_scope(GetIsolate());
+
+  // testing code
+  if (!ReadFile(GetIsolate(), file_).ToLocal(&script_)) {
+    return false; 
+  }
+
+  // Fetch the template for the global object where the built-in
+  // global functions are set.
+  Local<ObjectTemplate> global = Local<ObjectTemplate>::New(
+      GetIsolate(), IsolateData::Get(GetIsolate())->global_template);
+
+  // Each processor gets its own context so different processors don't
+  // affect each other. Context::New returns a persistent handle which
+  // is what we need for the reference to remain after we return from
+  // this method. That persistent handle has to be disposed in the
+  // destructor.
+  v8::Local<v8::Context> context = Context::New(GetIsolate(), NULL, global);
+  context_.Reset(GetIsolate(), context);
+  context->SetAlignedPointerInEmbedderData(IsolateData::kContextProcessorIndex, this);
+  Inspector::ContextCreated(context, name_);
+
+  // Enter the new context so all the following operations take place
+  // within it.
+  Context::Scope context_scope(context);
+
+  // Make the options mapping available within the context
+  if (!InstallMaps(opts))
+    return false;
+
+  // Compile and run the script
+  if (!ExecuteScript(script_))
+    return false;
+  metrics_.Close();
+
+  // The script compiled and ran correctly.  Now we fetch out the
+  // Process function from the global object.
+  Local<String> process_name =
+      String::NewFromUtf8(GetIsolate(), "Process", NewStringType::kNormal)
+          .ToLocalChecked();
+  Local<Value> process_val;
+  // If there is no Process function, or if it is not a function,
+  // bail out
+  if (!context->Global()->Get(context, process_name).ToLocal(&process_val) ||
+      !process_val->IsFunction()) {
+    return false;
+  }
+
+  // It is a function; cast it to a Function
+  Local<Function> process_fun = Local<Function>::Cast(process_val);
+
+  // Store the function in a Global handle, since we also want
+  // that to remain after this call returns
+  process_.Reset(GetIsolate(), process_fun);
+
+  if (!InitializeBatching(context, opts))
+    return false;
+
+  // TransformBody is optional; with it the rule's response bodies are
+  // streamed through the script
+  Local<String> transform_name =
+      String::NewFromUtf8(GetIsolate(), "TransformBody", NewStringType::kNormal)
+          .ToLocalChecked();
+  Local<Value> transform_val;
+  if (context->Global()->Get(context, transform_name).ToLocal(&transform_val) &&
+      transform_val->IsFunction()) {
+    transform_body_.Reset(GetIsolate(), Local<Function>::Cast(transform_val));
+    response_cont_ = TSContCreate(ResponseHandler, NULL);
+    TSContDataSet(response_cont_, this);
+  }
+
+  // Per instance stats, unless turned off with stats=false
+  map<string, string>::iterator stats_opt = opts->find("stats");
+  if (stats_opt == opts->end() || stats_opt->second != "false") {
+    if (!stats_.Initialize(name_)) {
+      Error("unable to create stats, out of plugin stats?");
+    }
+    if (!metrics_.Publish(name_)) {
+      Error("unable to create the script's metrics, out of plugin stats?");
+    }
+  }
+
+  map<string, string>::iterator slow_opt = opts->find("slow_ms");
+  if (slow_opt != opts->end()) {
+    slow_ = static_cast<TSHRTime>(atof(slow_opt->second.c_str()) * TS_HRTIME_MSECOND);
+  }
+
+  map<string, string>::iterator log_fields_opt = opts->find("log_fields");
+  log_fields_ = log_fields_opt != opts->end() && log_fields_opt->second == "true";
+
+  map<string, string>::iterator capture_opt = opts->find("capture");
+  if (capture_opt != opts->end() && !capture_opt->second.empty()) {
+    string path = capture_opt->second;
+    if (path[0] != '/') path = string(TSRuntimeDirGet()) + "/" + path;
+    capture_file_ = RequestCapture::Open(path);
+    if (capture_file_ < 0) Error(("unable to open capture file " + path).c_str());
+    map<string, string>::iterator sample_opt = opts->find("capture_sample");
+    int sample = sample_opt == opts->end() ? 100 : atoi(sample_opt->second.c_str());
+    capture_sample_ = sample > 1 ? sample : 1;
+  }
+
+  InitializeShadow(opts);
+
+  // All done; all went well
+  return true;
+}
+
+void JsHttpRequestProcessor::InitializeShadow(map<string, string>* opts) {
+  map<string, string>::iterator iter = opts->find("shadow");
+  if (iter == opts->end() || iter->second.empty()) return;
+  string file = iter->second;
+  if (file[0] != '/') file = string(TSConfigDirGet()) + "/" + file;
+
+  // The candidate sees the same options, minus what only makes sense
+  // for the live rule
+  map<string, string> candidate_opts(*opts);
+  candidate_opts.erase("shadow");
+  candidate_opts.erase("batch_size");
+  candidate_opts.erase("capture");
+
+  iter = opts->find("shadow_sample");
+  int sample = iter == opts->end() ? 100 : atoi(iter->second.c_str());
+  iter = opts->find("shadow_budget_ms");
+  double budget_ms = iter == opts->end() ? 1 : atof(iter->second.c_str());
+
+  JsHttpRequestProcessor* candidate = new JsHttpRequestProcessor(GetIsolate(), file);
+  candidate->SetName(name_ + ".shadow");
+  shadow_.reset(new Shadow(candidate, sample > 1 ? sample : 1,
+                           static_cast<TSHRTime>(budget_ms * TS_HRTIME_MSECOND)));
+  // A broken candidate leaves the live rule running without it
+  if (!candidate->Initialize(&candidate_opts)) {
+    Error(("unable to load shadow script " + file).c_str());
+    shadow_.reset();
+    return;
+  }
+  if (candidate_opts["stats"] != "false" && !shadow_->Initialize(name_)) {
+    Error("unable to create the shadow stats, out of plugin stats?");
+  }
+}
+
+bool JsHttpRequestProcessor::InitializeBatching(Local<Context> context,
+                                                map<string, string>* opts) {
+  map<string, string>::iterator iter = opts->find("batch_size");
+  if (iter == opts->end()) return true;
+  batch_size_ = atoi(iter->second.c_str());
+  if (!IsBatching()) return true;
+
+  iter = opts->find("batch_wait_ms");
+  batch_wait_ms_ = iter == opts->end() ? 1 : atoi(iter->second.c_str());
+
+  // Batching needs the script to provide ProcessBatch(requests)
+  Local<String> batch_name =
+      String::NewFromUtf8(GetIsolate(), "ProcessBatch", NewStringType::kNormal)
+          .ToLocalChecked();
+  Local<Value> batch_val;
+  if (!context->Global()->Get(context, batch_name).ToLocal(&batch_val) ||
+      !batch_val->IsFunction()) {
+    Error("batch_size is set but the script has no ProcessBatch function");
+    return false;
+  }
+  process_batch_.Reset(GetIsolate(), Local<Function>::Cast(batch_val));
+
+  batch_worker_ = TSContCreate(BatchWorkerHandler, TSMutexCreate());
+  TSContDataSet(batch_worker_, this);
+  return true;
+}
+
+bool JsHttpRequestProcessor::InstallMaps(map<string, string>* opts) {
+  HandleScope handle_scope(GetIsolate());
+
+  // Wrap the map object in a JavaScript wrapper
+  Local<Object> opts_obj = WrapMap(opts);
+
+  v8::Local<v8::Context> context =
+      v8::Local<v8::Context>::New(GetIsolate(), context_);
+
+  // Set the options object as a property on the global object.
+  context->Global()
+      ->Set(context,
+            String::NewFromUtf8(GetIsolate(), "options", NewStringType::kNormal)
+                .ToLocalChecked(),
+            opts_obj)
+      .FromJust();
+
+  return true;
+}
+
+// Utility function that wraps a C++ http request object in a
+// JavaScript object.
+Local<Object> JsHttpRequestProcessor::WrapMap(map<string, string>* obj) {
+  // Local scope for temporary handles.
+  EscapableHandleScope handle_scope(GetIsolate());
+
+  // Fetch the template for creating JavaScript map wrappers.
+  Local<ObjectTemplate> templ = Local<ObjectTemplate>::New(
+      GetIsolate(), IsolateData::Get(GetIsolate())->map_template);
+
+  // Create an empty map wrapper.
+  Local<Object> result =
+      templ->NewInstance(GetIsolate()->GetCurrentContext()).ToLocalChecked();
+
+  // Wrap the raw C++ pointer in an External so it can be referenced
+  // from within JavaScript.
+  Local<External> map_ptr = External::New(GetIsolate(), obj);
+
+  // Store the map pointer in the JavaScript wrapper.
+  result->SetInternalField(0, map_ptr);
+
+  // Return the result through the current handle scope.  Since each
+  // of these handles will go away when the handle scope is deleted
+  // we need to call Close to let one, the result, escape into the
+  // outer handle scope.
+  return handle_scope.Escape(result);
+}
+
+// Utility function that extracts the C++ map pointer from a wrapper
+// object.
+map<string, string>* JsHttpRequestProcessor::UnwrapMap(Local<Object> obj) {
+  Local<External> field = Local<External>::Cast(obj->GetInternalField(0));
+  void* ptr = field->Value();
+  return static_cast<map<string, string>*>(ptr);
+}
+
+// Convert a JavaScript string to a std::string.  To not bother too
+// much with string encodings we just use ascii.
+string ObjectToString(v8::Isolate* isolate, Local<Value> value) {
+  String::Utf8Value utf8_value(isolate, value);
+  return string(*utf8_value);
+}
+
+// Utility function that wraps a C++ http request object in a
+// JavaScript object.
+Local<Object> JsHttpRequestProcessor::WrapRequest(HttpRequest* request) {
+  // Local scope for temporary handles.
+  EscapableHandleScope handle_scope(GetIsolate());
+
+  // Fetch the template for creating JavaScript http request wrappers.
+  Local<ObjectTemplate> templ = Local<ObjectTemplate>::New(
+      GetIsolate(), IsolateData::Get(GetIsolate())->request_template);
+
+  // Create an empty http request wrapper.
+  Local<Object> result =
+      templ->NewInstance(GetIsolate()->GetCurrentContext()).ToLocalChecked();
+
+  // Wrap the raw C++ pointer in an External so it can be referenced
+  // from within JavaScript.
+  Local<External> request_ptr = External::New(GetIsolate(), request);
+
+  // Store the request pointer in the JavaScript wrapper.
+  result->SetInternalField(0, request_ptr);
+
+  return handle_scope.Escape(result);
+}
+
+void JsHttpRequestProcessor::ReleaseRequest(Local<Object> obj) {
+  obj->SetInternalField(0, External::New(GetIsolate(), NULL));
+}
+
+// Utility function that extracts the C++ http request object from a
+// wrapper object.  Returns NULL once the request has been released.
+HttpRequest* JsHttpRequestProcessor::UnwrapRequest(Local<Object> obj) {
+  Local<External> field = Local<External>::Cast(obj->GetInternalField(0));
+  void* ptr = field->Value();
+  return static_cast<HttpRequest*>(ptr);
+}
+
+static void ReturnString(const PropertyCallbackInfo<Value>& info,
+                         const string& value) {
+  info.GetReturnValue().Set(
+      String::NewFromUtf8(info.GetIsolate(), value.c_str(),
+                          NewStringType::kNormal,
+                          static_cast<int>(value.length())).ToLocalChecked());
+}
+
+void JsHttpRequestProcessor::GetUrl(Local<Name> name,
+                                    const PropertyCallbackInfo<Value>& info) {
+  HttpRequest* request = UnwrapRequest(info.Holder());
+  if (request == NULL) return;
+  ReturnString(info, request->Url());
+}
+
+void JsHttpRequestProcessor::GetMethod(Local<Name> name,
+                                       const PropertyCallbackInfo<Value>& info) {
+  HttpRequest* request = UnwrapRequest(info.Holder());
+  if (request == NULL) return;
+  ReturnString(info, request->Method());
+}
+
+void JsHttpRequestProcessor::GetHost(Local<Name> name,
+                                     const PropertyCallbackInfo<Value>& info) {
+  HttpRequest* request = UnwrapRequest(info.Holder());
+  if (request == NULL) return;
+  ReturnString(info, request->CurrentHost());
+}
+
+void JsHttpRequestProcessor::SetHost(Local<Name> name, Local<Value> value,
+                                     const PropertyCallbackInfo<void>& info) {
+  HttpRequest* request = UnwrapRequest(info.Holder());
+  if (request == NULL) return;
+  request->SetHost(ObjectToString(info.GetIsolate(), value));
+}
+
+void JsHttpRequestProcessor::GetPath(Local<Name> name,
+                                     const PropertyCallbackInfo<Value>& info) {
+  HttpRequest* request = UnwrapRequest(info.Holder());
+  if (request == NULL) return;
+  ReturnString(info, request->CurrentPath());
+}
+
+void JsHttpRequestProcessor::SetPath(Local<Name> name, Local<Value> value,
+                                     const PropertyCallbackInfo<void>& info) {
+  HttpRequest* request = UnwrapRequest(info.Holder());
+  if (request == NULL) return;
+  request->SetPath(ObjectToString(info.GetIsolate(), value));
+}
+
+void JsHttpRequestProcessor::GetClientIp(Local<Name> name,
+                                         const PropertyCallbackInfo<Value>& info) {
+  HttpRequest* request = UnwrapRequest(info.Holder());
+  if (request == NULL) return;
+  ReturnString(info, request->ClientIp());
+}
+
+void JsHttpRequestProcessor::GetUserAgent(Local<Name> name,
+                                          const PropertyCallbackInfo<Value>& info) {
+  HttpRequest* request = UnwrapRequest(info.Holder());
+  if (request == NULL) return;
+  ReturnString(info, request->UserAgent());
+}
+
+void JsHttpRequestProcessor::GetReferrer(Local<Name> name,
+                                         const PropertyCallbackInfo<Value>& info) {
+  HttpRequest* request = UnwrapRequest(info.Holder());
+  if (request == NULL) return;
+  ReturnString(info, request->Referrer());
+}
+
+Local<ObjectTemplate> JsHttpRequestProcessor::MakeRequestTemplate(
+    Isolate* isolate) {
+  EscapableHandleScope handle_scope(isolate);
+
+  Local<ObjectTemplate> result = ObjectTemplate::New(isolate);
+  result->SetInternalFieldCount(1);
+
+  // Add accessors for each of the fields of the request.
+  result->SetAccessor(
+      String::NewFromUtf8(isolate, "url", NewStringType::kInternalized)
+          .ToLocalChecked(),
+      GetUrl);
+  result->SetAccessor(
+      String::NewFromUtf8(isolate, "method", NewStringType::kInternalized)
+          .ToLocalChecked(),
+      GetMethod);
+  result->SetAccessor(
+      String::NewFromUtf8(isolate, "host", NewStringType::kInternalized)
+          .ToLocalChecked(),
+      GetHost, SetHost);
+  result->SetAccessor(
+      String::NewFromUtf8(isolate, "path", NewStringType::kInternalized)
+          .ToLocalChecked(),
+      GetPath, SetPath);
+  result->SetAccessor(
+      String::NewFromUtf8(isolate, "clientIp", NewStringType::kInternalized)
+          .ToLocalChecked(),
+      GetClientIp);
+  result->SetAccessor(
+      String::NewFromUtf8(isolate, "userAgent", NewStringType::kInternalized)
+          .ToLocalChecked(),
+      GetUserAgent);
+  result->SetAccessor(
+      String::NewFromUtf8(isolate, "referrer", NewStringType::kInternalized)
+          .ToLocalChecked(),
+      GetReferrer);
+
+  // Again, return the result through the current handle scope.
+  return handle_scope.Escape(result);
+}
+
+void JsHttpRequestProcessor::MapGet(Local<Name> name,
+                                    const PropertyCallbackInfo<Value>& info) {
+  if (name->IsSymbol()) return;
+
+  // Fetch the map wrapped by this object.
+  map<string, string>* obj = UnwrapMap(info.Holder());
+
+  // Convert the JavaScript string to a std::string.
+  string key = ObjectToString(info.GetIsolate(), Local<String>::Cast(name));
+
+  // Look up the value if it exists using the standard STL ideom.
+  map<string, string>::iterator iter = obj->find(key);
+
+  // If the key is not present return an empty handle as signal
+  if (iter == obj->end()) return;
+
+  // Otherwise fetch the value and wrap it in a JavaScript string
+  const string& value = (*iter).second;
+  info.GetReturnValue().Set(
+      String::NewFromUtf8(info.GetIsolate(), value.c_str(),
+                          NewStringType::kNormal,
+                          static_cast<int>(value.length())).ToLocalChecked());
+}
+
+void JsHttpRequestProcessor::MapSet(Local<Name> name, Local<Value> value_obj,
+                                    const PropertyCallbackInfo<Value>& info) {
+  if (name->IsSymbol()) return;
+
+  // Fetch the map wrapped by this object.
+  map<string, string>* obj = UnwrapMap(info.Holder());
+
+  // Convert the key and value to std::strings.
+  string key = ObjectToString(info.GetIsolate(), Local<String>::Cast(name));
+  string value = ObjectToString(info.GetIsolate(), value_obj);
+
+  // Update the map.
+  (*obj)[key] = value;
+
+  // Return the value; any non-empty handle will work.
+  info.GetReturnValue().Set(value_obj);
+}
+
+Local<ObjectTemplate> JsHttpRequestProcessor::MakeMapTemplate(
+    Isolate* isolate) {
+  EscapableHandleScope handle_scope(isolate);
+
+  Local<ObjectTemplate> result = ObjectTemplate::New(isolate);
+  result->SetInternalFieldCount(1);
+  result->SetHandler(NamedPropertyHandlerConfiguration(MapGet, MapSet));
+
+  // Again, return the result through the current handle scope.
+  return handle_scope.Escape(result);
+}
+
+bool JsHttpRequestProcessor::ExecuteScript(Local<String> script) {
+  HandleScope handle_scope(GetIsolate());
+  RunningScope running(this);
+
+  // We're just about to compile the script; set up an error handler to
+  // catch any exceptions the script might throw.
+  TryCatch try_catch(GetIsolate());
+
+  Local<Context> context(GetIsolate()->GetCurrentContext());
+
+  // Name the script after its file, so errors and profiles point at it.
+  Local<String> file_name =
+      String::NewFromUtf8(GetIsolate(), file_.c_str(), NewStringType::kNormal)
+          .ToLocalChecked();
+#if V8_MAJOR_VERSION >= 9
+  v8::ScriptOrigin origin(GetIsolate(), file_name);
+#else
+  v8::ScriptOrigin origin(file_name);
+#endif
+
+  // Compile the script and check for errors.
+  Local<Script> compiled_script;
+  if (!Script::Compile(context, script, &origin).ToLocal(&compiled_script)) {
+    String::Utf8Value error(GetIsolate(), try_catch.Exception());
+    Error(*error);
+    // The script failed to compile; bail out.
+    return false;
+  }
+
+  // Run the script!
+  Local<Value> result;
+  if (!compiled_script->Run(context).ToLocal(&result)) {
+    // The TryCatch above is still in effect and will have caught the error.
+    String::Utf8Value error(GetIsolate(), try_catch.Exception());
+    Error(*error);
+    // Running the script failed; bail out.
+    return false;
+  }
+
+  return true;
+}
+
+TSRemapStatus JsHttpRequestProcessor::Process(HttpRequest* request) {
+ 
+  // Create a handle scope to keep the temporary object references.
+  HandleScope handle_scope(GetIsolate());
+
+  v8::Local<v8::Context> context =
+      v8::Local<v8::Context>::New(GetIsolate(), context_);
+
+  // Enter this processor's context so all the remaining operations
+  // take place there
+  Context::Scope context_scope(context);
+
+  RunningScope running(this);
+
+  // Wrap the C++ request object in a JavaScript wrapper
+  Local<Object> request_obj = WrapRequest(request);
+
+  // Set up an exception handler before calling the Process function
+  TryCatch try_catch(GetIsolate());
+
+  // Invoke the process function, giving the global object as 'this'
+  // and one argument, the request.
+  const int argc = 1;
+  Local<Value> argv[argc] = {request_obj};
+  v8::Local<v8::Function> process =
+      v8::Local<v8::Function>::New(GetIsolate(), process_);
+  Local<Value> result;
+  IsolateData* data = IsolateData::Get(GetIsolate());
+  uint64_t gc_count = data->gc_count;
+  TSHRTime gc_pause = data->gc_pause;
+  TraceSpan span("Process");
+  TSHRTime start = TShrtime();
+  bool ok = process->Call(context, context->Global(), argc, argv).ToLocal(&result);
+  TSHRTime elapsed = TShrtime() - start;
+  stats_.Invocation(elapsed);
+  span.End();
+  ReleaseRequest(request_obj);
+  if (!ok) {
+    stats_.Exception(try_catch.HasTerminated());
+    stats_.Status(TSREMAP_NO_REMAP);
+    String::Utf8Value error(GetIsolate(), try_catch.Exception());
+    Error(*error);
+    if (slow_ > 0 && elapsed >= slow_) {
+      LogSlowCall(request, elapsed, data->gc_count - gc_count, data->gc_pause - gc_pause,
+                  try_catch.HasTerminated() ? "terminated" : "exception");
+    }
+    return TSREMAP_NO_REMAP;
+  }
+  TSRemapStatus status = ToRemapStatus(result, request);
+  stats_.Status(status);
+  if (slow_ > 0 && elapsed >= slow_) {
+    LogSlowCall(request, elapsed, data->gc_count - gc_count, data->gc_pause - gc_pause,
+                IsRemapped(status) ? "remap" : "no_remap");
+  }
+  return status;
+}
+
+// Runs with the isolate locked, so lock_wait is this call's.  Header
+// values are quoted as they are; the line is cut at the record size.
+void JsHttpRequestProcessor::LogSlowCall(HttpRequest* request, TSHRTime elapsed,
+                                         uint64_t gc_count, TSHRTime gc_pause,
+                                         const char* outcome) {
+  char msg[2048];
+  int len = snprintf(msg, sizeof(msg),
+                     "%s js_us=%lld lock_wait_us=%lld gc=%llu gc_us=%lld result=%s "
+                     "method=%s url=\"%s\" host=\"%s\" client=%s user_agent=\"%s\" referer=\"%s\"",
+                     name_.c_str(), static_cast<long long>(elapsed / TS_HRTIME_USECOND),
+                     static_cast<long long>(IsolateData::Get(GetIsolate())->lock_wait / TS_HRTIME_USECOND),
+                     static_cast<unsigned long long>(gc_count),
+                     static_cast<long long>(gc_pause / TS_HRTIME_USECOND), outcome,
+                     request->Method().c_str(), request->Url().c_str(), request->Host().c_str(),
+                     request->ClientIp().c_str(), request->UserAgent().c_str(),
+                     request->Referrer().c_str());
+  if (len < 0) return;
+  SlowLog::Write(msg, static_cast<size_t>(len) < sizeof(msg) ? len : sizeof(msg) - 1);
+}
+
+TSRemapStatus JsHttpRequestProcessor::ToRemapStatus(Local<Value> decision,
+                                                    HttpRequest* request) {
+  if (decision->IsInt32()) {
+    int32_t status = decision.As<v8::Int32>()->Value();
+    if (status >= TSREMAP_NO_REMAP && status <= TSREMAP_DID_REMAP_STOP) {
+      return static_cast<TSRemapStatus>(status);
+    }
+  }
+  return request->HasRewrites() ? TSREMAP_DID_REMAP : TSREMAP_NO_REMAP;
+}
+
+void JsHttpRequestProcessor::ProcessBatch(const vector<BatchEntry*>& entries) {
+  HandleScope handle_scope(GetIsolate());
+
+  v8::Local<v8::Context> context =
+      v8::Local<v8::Context>::New(GetIsolate(), context_);
+  Context::Scope context_scope(context);
+  RunningScope running(this);
+
+  // Wrap every request of the batch and pass them as one array
+  int count = static_cast<int>(entries.size());
+  Local<Array> requests = Array::New(GetIsolate(), count);
+  for (int i = 0; i < count; i++) {
+    requests->Set(context, i, WrapRequest(&entries[i]->request)).FromJust();
+  }
+
+  TryCatch try_catch(GetIsolate());
+
+  const int argc = 1;
+  Local<Value> argv[argc] = {requests};
+  v8::Local<v8::Function> process_batch =
+      v8::Local<v8::Function>::New(GetIsolate(), process_batch_);
+  Local<Value> result;
+  TSHRTime start = TShrtime();
+  bool ok = process_batch->Call(context, context->Global(), argc, argv)
+                .ToLocal(&result);
+  stats_.Invocation(TShrtime() - start);
+
+  for (int i = 0; i < count; i++) {
+    Local<Value> request_obj = requests->Get(context, i).ToLocalChecked();
+    if (request_obj->IsObject()) ReleaseRequest(request_obj.As<Object>());
+  }
+
+  if (!ok) {
+    stats_.Exception(try_catch.HasTerminated());
+    String::Utf8Value error(GetIsolate(), try_catch.Exception());
+    Error(*error);
+  } else if (!result->IsArray()) {
+    Error("ProcessBatch must return an array of decisions");
+  } else {
+    // Pick up one decision per request; missing ones leave it untouched
+    Local<Array> decisions = Local<Array>::Cast(result);
+    for (int i = 0; i < count; i++) {
+      Local<Value> decision;
+      if (!decisions->Get(context, i).ToLocal(&decision)) break;
+      entries[i]->status = ToRemapStatus(decision, &entries[i]->request);
+    }
+  }
+
+  for (int i = 0; i < count; i++) stats_.Status(entries[i]->status);
+}
+
+TSRemapStatus JsHttpRequestProcessor::QueueRequest(TSHttpTxn txn,
+                                                   TSRemapRequestInfo* rri) {
+  TxnHttpRequest request(txn, rri->requestBufp, rri->requestHdrp, rri->requestUrl);
+  BatchEntry* entry = new BatchEntry(this, txn, &request);
+
+  // The transaction is parked at the post-remap hook; the entry is only
+  // queued once it gets there, so the worker never reenables it early.
+  // It is freed when the transaction closes, whether or not it got to
+  // the post-remap hook.
+  Retain();
+  if (log_fields_) TxnScriptTime::Track(txn);
+  entry->cont = TSContCreate(BatchHookHandler, NULL);
+  TSContDataSet(entry->cont, entry);
+  TSHttpTxnHookAdd(txn, TS_HTTP_POST_REMAP_HOOK, entry->cont);
+  TSHttpTxnHookAdd(txn, TS_HTTP_TXN_CLOSE_HOOK, entry->cont);
+
+  return TSREMAP_NO_REMAP;
+}
+
+int JsHttpRequestProcessor::BatchHookHandler(TSCont contp, TSEvent event,
+                                             void* edata) {
+  BatchEntry* entry = static_cast<BatchEntry*>(TSContDataGet(contp));
+  if (event == TS_EVENT_HTTP_TXN_CLOSE) {
+    JsHttpRequestProcessor* processor = entry->processor;
+    delete entry;
+    TSContDestroy(contp);
+    TSHttpTxnReenable(static_cast<TSHttpTxn>(edata), TS_EVENT_HTTP_CONTINUE);
+    processor->Release();
+    return 0;
+  }
+  TraceSpan span("post-remap hook");
+  entry->processor->EnqueueBatchEntry(entry);
+  return 0;
+}
+
+void JsHttpRequestProcessor::EnqueueBatchEntry(BatchEntry* entry) {
+  std::lock_guard<std::mutex> lock(batch_mutex_);
+  batch_queue_.push_back(entry);
+
+  // Run at once when a full batch is waiting, otherwise give more
+  // requests a short time to join.
+  if (batch_action_ == NULL) {
+    int delay = static_cast<int>(batch_queue_.size()) >= batch_size_ ? 0 : batch_wait_ms_;
+    batch_action_ = TSContScheduleOnPool(batch_worker_, delay, TS_THREAD_POOL_TASK);
+  }
+}
+
+int JsHttpRequestProcessor::BatchWorkerHandler(TSCont contp, TSEvent event,
+                                               void* edata) {
+  JsHttpRequestProcessor* processor =
+      static_cast<JsHttpRequestProcessor*>(TSContDataGet(contp));
+  processor->RunBatch();
+  return 0;
+}
+
+void JsHttpRequestProcessor::RunBatch() {
+  vector<BatchEntry*> entries;
+
+  {
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    while (!batch_queue_.empty() &&
+           static_cast<int>(entries.size()) < batch_size_) {
+      entries.push_back(batch_queue_.front());
+      batch_queue_.pop_front();
+    }
+    // Leftovers go out in the next batch right away
+    batch_action_ = batch_queue_.empty()
+        ? NULL
+        : TSContScheduleOnPool(batch_worker_, 0, TS_THREAD_POOL_TASK);
+  }
+
+  if (entries.empty()) return;
+
+  {
+    TraceSpan wait("lock wait");
+    TSHRTime wait_start = TShrtime();
+    v8::Locker locker(GetIsolate());
+    wait.End();
+    TraceSpan span("ProcessBatch");
+    GetIsolate()->Enter();
+    TSHRTime start = TShrtime();
+    IsolateData::Get(GetIsolate())->lock_wait = start - wait_start;
+    ProcessBatch(entries);
+    GetIsolate()->Exit();
+
+    // Each transaction waited for the lock and gets its share of the
+    // script time
+    if (log_fields_) {
+      TSHRTime share = (TShrtime() - start) / entries.size();
+      for (size_t i = 0; i < entries.size(); i++) {
+        TxnScriptTime::Add(entries[i]->txn, TxnScriptTime::kLockWait, start - wait_start);
+        TxnScriptTime::Add(entries[i]->txn, TxnScriptTime::kHook, share);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < entries.size(); i++) {
+    BatchEntry* entry = entries[i];
+    if (shadow_ != NULL) {
+      Shadow::Entry* shadowed = shadow_->Sample(&entry->request);
+      if (shadowed != NULL) shadow_->Submit(shadowed, entry->status, &entry->request);
+    }
+    if (IsRemapped(entry->status) && entry->request.HasRewrites()) {
+      TSMBuffer bufp;
+      TSMLoc hdr, url;
+      if (TSHttpTxnClientReqGet(entry->txn, &bufp, &hdr) == TS_SUCCESS) {
+        if (TSHttpHdrUrlGet(bufp, hdr, &url) == TS_SUCCESS) {
+          entry->request.ApplyRewrites(bufp, url);
+          TSHandleMLocRelease(bufp, hdr, url);
+        }
+        TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr);
+      }
+    }
+    TSHttpTxnReenable(entry->txn, TS_EVENT_HTTP_CONTINUE);
+  }
+}
+
+const char* const Shadow::kNames[kCounterCount] = {
+    "shadow_sampled", "shadow_dropped", "shadow_compared", "shadow_diffs",
+    "shadow_over_budget", "shadow_disabled"};
+
+Shadow::Shadow(JsHttpRequestProcessor* candidate, uint32_t sample, TSHRTime budget)
+    : candidate_(candidate), sample_(sample), budget_(budget), seen_(0), disabled_(false),
+      action_(NULL), stopping_(false), window_calls_(0), window_over_budget_(0),
+      logged_diffs_(0) {
+  worker_ = TSContCreate(WorkerHandler, TSMutexCreate());
+  TSContDataSet(worker_, this);
+}
+
+Shadow::~Shadow() {
+  Stop();
+  TSContDestroy(worker_);
+  for (size_t i = 0; i < queue_.size(); i++) delete queue_[i];
+}
+
+// A scheduled worker still runs, so it is waited for instead of being
+// canceled, which would race with its start.
+void Shadow::Stop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  stopping_ = true;
+  idle_.wait(lock, [this] { return action_ == NULL; });
+}
+
+bool Shadow::Initialize(const string& name) {
+  return stats_.Initialize("plugin." PLUGIN_NAME "." + StatName(name), kNames, kCounterCount);
+}
+
+Shadow::Entry* Shadow::Sample(HttpRequest* request) {
+  if (disabled_.load(std::memory_order_relaxed)) return NULL;
+  if (seen_.fetch_add(1, std::memory_order_relaxed) % sample_ != 0) return NULL;
+  stats_.Add(kSampled, 1);
+  return new Entry(request);
+}
+
+void Shadow::Submit(Entry* entry, TSRemapStatus status, HttpRequest* request) {
+  entry->status = status;
+  if (HttpRequestProcessor::IsRemapped(status)) {
+    entry->host = request->CurrentHost();
+    entry->path = request->CurrentPath();
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (queue_.size() >= kMaxQueue) {
+    // The candidate can't keep up; shed the sample
+    stats_.Add(kDropped, 1);
+    delete entry;
+    return;
+  }
+  if (stopping_) {
+    delete entry;
+    return;
+  }
+  queue_.push_back(entry);
+  if (action_ == NULL) action_ = TSContScheduleOnPool(worker_, 0, TS_THREAD_POOL_TASK);
+}
+
+int Shadow::WorkerHandler(TSCont contp, TSEvent event, void* edata) {
+  static_cast<Shadow*>(TSContDataGet(contp))->Run();
+  return 0;
+}
+
+// Takes the isolate lock once per request, so live requests never wait
+// for more than one candidate call.
+void Shadow::Run() {
+  for (;;) {
+    Entry* entry;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (queue_.empty() || stopping_) {
+        action_ = NULL;
+        idle_.notify_all();
+        return;
+      }
+      entry = queue_.front();
+      queue_.pop_front();
+    }
+    if (!disabled_.load(std::memory_order_relaxed)) Compare(entry);
+    delete entry;
+  }
+}
+
+void Shadow::Compare(Entry* entry) {
+  Isolate* isolate = candidate_->GetIsolate();
+  TSRemapStatus status;
+  TSHRTime elapsed;
+  {
+    TraceSpan wait("lock wait");
+    v8::Locker locker(isolate);
+    wait.End();
+    TraceSpan span("shadow");
+    isolate->Enter();
+    TSHRTime start = TShrtime();
+    status = candidate_->Process(&entry->request);
+    elapsed = TShrtime() - start;
+    isolate->Exit();
+  }
+  stats_.Add(kCompared, 1);
+
+  if (elapsed > budget_) {
+    stats_.Add(kOverBudget, 1);
+    window_over_budget_++;
+  }
+  if (window_over_budget_ > kMaxOverBudget) {
+    disabled_ = true;
+    stats_.Add(kDisabled, 1);
+    char msg[256];
+    snprintf(msg, sizeof(msg), "%s disabled: %d of the last %d calls took over %.3f ms",
+             candidate_->name().c_str(), window_over_budget_, window_calls_ + 1,
+             static_cast<double>(budget_) / TS_HRTIME_MSECOND);
+    HttpRequestProcessor::Error(msg);
+  }
+  if (++window_calls_ >= kBudgetWindow) {
+    window_calls_ = 0;
+    window_over_budget_ = 0;
+  }
+
+  bool same = status == entry->status;
+  if (same && HttpRequestProcessor::IsRemapped(status)) {
+    same = entry->request.CurrentHost() == entry->host &&
+           entry->request.CurrentPath() == entry->path;
+  }
+  if (same) return;
+  stats_.Add(kDiffs, 1);
+  if (logged_diffs_ < kMaxLoggedDiffs) {
+    char msg[2048];
+    snprintf(msg, sizeof(msg), "%s differs on %s %s: live %d %s/%s, candidate %d %s/%s%s",
+             candidate_->name().c_str(), entry->request.Method().c_str(),
+             entry->request.Url().c_str(), entry->status, entry->host.c_str(),
+             entry->path.c_str(), status,
+             HttpRequestProcessor::IsRemapped(status) ? entry->request.CurrentHost().c_str() : "",
+             HttpRequestProcessor::IsRemapped(status) ? entry->request.CurrentPath().c_str() : "",
+             ++logged_diffs_ == kMaxLoggedDiffs ? " (further differences are only counted)" : "");
+    HttpRequestProcessor::Error(msg);
+  }
+}
+
+/**
+ * Streams a response body through the script's TransformBody, one
+ * buffer block per call.  The script gets a copy of each block, and
+ * blocks it leaves alone are passed on by reference.  Input is only taken while the client
+ * side has room for more output, so a slow client holds the origin
+ * back instead of the body piling up in the transform.
+ */
+class BodyTransform {
+ public:
+  // Stream the transaction's response body through processor's script.
+  // The transform holds a reference to processor until it is closed.
+  static void Add(JsHttpRequestProcessor* processor, TSHttpTxn txn);
+
+ private:
+  // Output the client side has not taken yet, beyond which no more
+  // input is read.
+  static const int64_t kMaxBuffered = 64 * 1024;
+
+  explicit BodyTransform(JsHttpRequestProcessor* processor)
+      : processor_(processor), output_vio_(NULL), output_buffer_(NULL), output_reader_(NULL),
+        written_(0), failed_(false), done_(false) { }
+  ~BodyTransform();
+
+  static int Handler(TSCont contp, TSEvent event, void* edata);
+  void Transform(TSCont contp);
+  // Run the script over the next len bytes of reader, or over the end
+  // of the body if reader is NULL.
+  void Run(TSIOBufferReader reader, int64_t len);
+
+  JsHttpRequestProcessor* processor_;
+  TSVIO output_vio_;
+  TSIOBuffer output_buffer_;
+  TSIOBufferReader output_reader_;
+  int64_t written_;
+  // What the script keeps between chunks.  Only touched with the
+  // isolate locked.
+  Global<Object> state_;
+  // The script threw; the rest of the body is passed on as it is.
+  bool failed_;
+  bool done_;
+};
+
+void BodyTransform::Add(JsHttpRequestProcessor* processor, TSHttpTxn txn) {
+  processor->Retain();
+  TSVConn connp = TSTransformCreate(Handler, txn);
+  TSContDataSet(connp, new BodyTransform(processor));
+  TSHttpTxnHookAdd(txn, TS_HTTP_RESPONSE_TRANSFORM_HOOK, connp);
+}
+
+BodyTransform::~BodyTransform() {
+  if (!state_.IsEmpty()) {
+    // The body was cut short; the state can only go with the isolate
+    Isolate* isolate = processor_->GetIsolate();
+    v8::Locker locker(isolate);
+    isolate->Enter();
+    state_.Reset();
+    isolate->Exit();
+  }
+  if (output_buffer_ != NULL) {
+    TSIOBufferReaderFree(output_reader_);
+    TSIOBufferDestroy(output_buffer_);
+  }
+  processor_->Release();
+}
+
+int BodyTransform::Handler(TSCont contp, TSEvent event, void* edata) {
+  BodyTransform* transform = static_cast<BodyTransform*>(TSContDataGet(contp));
+  if (TSVConnClosedGet(contp)) {
+    delete transform;
+    TSContDestroy(contp);
+    return 0;
+  }
+
+  switch (event) {
+    case TS_EVENT_ERROR: {
+      // Pass the error on to whoever writes the body to us
+      TSVIO input_vio = TSVConnWriteVIOGet(contp);
+      TSContCall(TSVIOContGet(input_vio), TS_EVENT_ERROR, input_vio);
+      break;
+    }
+    case TS_EVENT_VCONN_WRITE_COMPLETE:
+      // The client side has all of the body
+      TSVConnShutdown(TSTransformOutputVConnGet(contp), 0, 1);
+      break;
+    default:
+      // More input, or the client side took some of the output
+      transform->Transform(contp);
+      break;
+  }
+  return 0;
+}
+
+void BodyTransform::Transform(TSCont contp) {
+  if (done_) return;
+  if (output_vio_ == NULL) {
+    output_buffer_ = TSIOBufferCreate();
+    output_reader_ = TSIOBufferReaderAlloc(output_buffer_);
+    // The length is only known at the end
+    output_vio_ = TSVConnWrite(TSTransformOutputVConnGet(contp), contp, output_reader_, INT64_MAX);
+  }
+
+  TSVIO input_vio = TSVConnWriteVIOGet(contp);
+  if (TSVIOBufferGet(input_vio) == NULL) {
+    // The writer went away; end the output with what it got
+    done_ = true;
+    TSVIONBytesSet(output_vio_, written_);
+    TSVIOReenable(output_vio_);
+    return;
+  }
+
+  TSIOBufferReader reader = TSVIOReaderGet(input_vio);
+  int64_t len = std::min(TSVIONTodoGet(input_vio), TSIOBufferReaderAvail(reader));
+  int64_t room = kMaxBuffered - TSIOBufferReaderAvail(output_reader_);
+  if (len > room) len = room > 0 ? room : 0;
+  if (len > 0) {
+    Run(reader, len);
+    TSIOBufferReaderConsume(reader, len);
+    TSVIONDoneSet(input_vio, TSVIONDoneGet(input_vio) + len);
+    TSVIOReenable(output_vio_);
+  }
+
+  if (TSVIONTodoGet(input_vio) > 0) {
+    // With the output full, the client side's WRITE_READY brings us
+    // back once it has taken some
+    if (len > 0) TSContCall(TSVIOContGet(input_vio), TS_EVENT_VCONN_WRITE_READY, input_vio);
+    return;
+  }
+
+  done_ = true;
+  Run(NULL, 0);
+  TSVIONBytesSet(output_vio_, written_);
+  TSVIOReenable(output_vio_);
+  TSContCall(TSVIOContGet(input_vio), TS_EVENT_VCONN_WRITE_COMPLETE, input_vio);
+}
+
+void BodyTransform::Run(TSIOBufferReader reader, int64_t len) {
+  if (failed_) {
+    if (reader != NULL) written_ += TSIOBufferCopy(output_buffer_, reader, len, 0);
+    return;
+  }
+
+  Isolate* isolate = processor_->GetIsolate();
+  TraceSpan wait("lock wait");
+  v8::Locker locker(isolate);
+  wait.End();
+  TraceSpan span("TransformBody");
+  isolate->Enter();
+  written_ += processor_->TransformBody(&state_, reader, len, output_buffer_, &failed_);
+  if (reader == NULL || failed_) state_.Reset();
+  isolate->Exit();
+}
+
+void JsHttpRequestProcessor::HookResponse(TSHttpTxn txn, TSRemapRequestInfo* rri) {
+  if (response_cont_ == NULL) return;
+  // Responses to HEAD have no body to append to
+  int len;
+  const char* method = TSHttpHdrMethodGet(rri->requestBufp, rri->requestHdrp, &len);
+  if (method != NULL && len == 4 && strncmp(method, "HEAD", 4) == 0) return;
+  Retain();
+  TSHttpTxnHookAdd(txn, TS_HTTP_CACHE_LOOKUP_COMPLETE_HOOK, response_cont_);
+  TSHttpTxnHookAdd(txn, TS_HTTP_READ_RESPONSE_HDR_HOOK, response_cont_);
+  TSHttpTxnHookAdd(txn, TS_HTTP_TXN_CLOSE_HOOK, response_cont_);
+}
+
+// Fresh cache hits are transformed at cache lookup, responses from the
+// origin when their header arrives.  A stale hit the origin confirms
+// with a 304 is served as cached.
+int JsHttpRequestProcessor::ResponseHandler(TSCont contp, TSEvent event, void* edata) {
+  TSHttpTxn txn = static_cast<TSHttpTxn>(edata);
+  JsHttpRequestProcessor* processor =
+      static_cast<JsHttpRequestProcessor*>(TSContDataGet(contp));
+  if (event == TS_EVENT_HTTP_TXN_CLOSE) {
+    TSHttpTxnReenable(txn, TS_EVENT_HTTP_CONTINUE);
+    processor->Release();
+    return 0;
+  }
+
+  TSMBuffer bufp;
+  TSMLoc hdr;
+  bool found = false;
+  if (event == TS_EVENT_HTTP_READ_RESPONSE_HDR) {
+    found = TSHttpTxnServerRespGet(txn, &bufp, &hdr) == TS_SUCCESS;
+  } else if (event == TS_EVENT_HTTP_CACHE_LOOKUP_COMPLETE) {
+    int lookup;
+    found = TSHttpTxnCacheLookupStatusGet(txn, &lookup) == TS_SUCCESS &&
+            lookup == TS_CACHE_LOOKUP_HIT_FRESH &&
+            TSHttpTxnCachedRespGet(txn, &bufp, &hdr) == TS_SUCCESS;
+  }
+  if (found) {
+    if (TSHttpHdrStatusGet(bufp, hdr) == TS_HTTP_STATUS_OK) {
+      // Cache hits go through the script again, so the cache keeps the
+      // body as the origin sent it
+      TSHttpTxnUntransformedRespCache(txn, 1);
+      TSHttpTxnTransformedRespCache(txn, 0);
+      BodyTransform::Add(processor, txn);
+    }
+    TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr);
+  }
+  TSHttpTxnReenable(txn, TS_EVENT_HTTP_CONTINUE);
+  return 0;
+}
+
+static char* ArrayBufferData(Local<ArrayBuffer> buffer) {
+#if V8_MAJOR_VERSION >= 8
+  return static_cast<char*>(buffer->GetBackingStore()->Data());
+#else
+  return static_cast<char*>(buffer->GetContents().Data());
+#endif
+}
+
+// A copy of len bytes at data in a buffer of V8's own.  Buffer blocks
+// are shared with the cache and go back to ATS, so the script never
+// gets to see them in place.
+static Local<ArrayBuffer> CopyArrayBuffer(Isolate* isolate, const char* data, size_t len) {
+  Local<ArrayBuffer> buffer = ArrayBuffer::New(isolate, len);
+  if (len > 0) memcpy(ArrayBufferData(buffer), data, len);
+  return buffer;
+}
+
+int64_t JsHttpRequestProcessor::TransformBody(Global<Object>* state, TSIOBufferReader reader,
+                                              int64_t len, TSIOBuffer output, bool* failed) {
+  HandleScope handle_scope(GetIsolate());
+
+  v8::Local<v8::Context> context =
+      v8::Local<v8::Context>::New(GetIsolate(), context_);
+  Context::Scope context_scope(context);
+  RunningScope running(this);
+
+  if (state->IsEmpty()) state->Reset(GetIsolate(), Object::New(GetIsolate()));
+  Local<Object> state_obj = Local<Object>::New(GetIsolate(), *state);
+
+  TSHRTime start = TShrtime();
+  int chunks = 0;
+  int64_t written = 0;
+  int64_t offset = 0;
+  if (reader == NULL) {
+    // What the script returns at the end is appended
+    chunks++;
+    CallTransformBody(context, v8::Null(GetIsolate()), state_obj, output, &written, failed);
+  }
+  for (TSIOBufferBlock block = reader != NULL ? TSIOBufferReaderStart(reader) : NULL;
+       block != NULL && offset < len; block = TSIOBufferBlockNext(block)) {
+    int64_t avail = 0;
+    const char* data = TSIOBufferBlockReadStart(block, reader, &avail);
+    avail = std::min(avail, len - offset);
+    if (avail <= 0) continue;
+
+    bool replaced = false;
+    if (!*failed) {
+      HandleScope chunk_scope(GetIsolate());
+      Local<ArrayBuffer> chunk = CopyArrayBuffer(GetIsolate(), data, avail);
+      chunks++;
+      replaced = CallTransformBody(context, chunk, state_obj, output, &written, failed);
+    }
+    // Left alone, the block is passed on by reference
+    if (!replaced) written += TSIOBufferCopy(output, reader, avail, offset);
+    offset += avail;
+  }
+
+  stats_.Body(chunks, TShrtime() - start, offset, written);
+  return written;
+}
+
+bool JsHttpRequestProcessor::CallTransformBody(Local<Context> context, Local<Value> chunk,
+                                               Local<Object> state, TSIOBuffer output,
+                                               int64_t* written, bool* failed) {
+  TryCatch try_catch(GetIsolate());
+
+  const int argc = 2;
+  Local<Value> argv[argc] = {chunk, state};
+  v8::Local<v8::Function> transform =
+      v8::Local<v8::Function>::New(GetIsolate(), transform_body_);
+  Local<Value> result;
+  if (!transform->Call(context, context->Global(), argc, argv).ToLocal(&result)) {
+    *failed = true;
+    stats_.Exception(try_catch.HasTerminated());
+    String::Utf8Value error(GetIsolate(), try_catch.Exception());
+    Error(*error);
+    return false;
+  }
+
+  // Undefined passes the chunk on as ATS holds it
+  if (result->IsUndefined()) return false;
+  if (result->IsNull()) return true;
+  if (result->IsString()) {
+    Local<String> str = result.As<String>();
+    string utf8(str->Utf8Length(GetIsolate()), '\0');
+    str->WriteUtf8(GetIsolate(), &utf8[0], static_cast<int>(utf8.length()), NULL,
+                   String::NO_NULL_TERMINATION);
+    *written += TSIOBufferWrite(output, utf8.data(), utf8.length());
+    return true;
+  }
+
+  // The chunk itself, changed or not, is written like any other buffer
+  Local<ArrayBuffer> buffer;
+  size_t offset = 0;
+  size_t length;
+  if (result->IsArrayBuffer()) {
+    buffer = result.As<ArrayBuffer>();
+    length = buffer->ByteLength();
+  } else if (result->IsArrayBufferView()) {
+    Local<v8::ArrayBufferView> view = result.As<v8::ArrayBufferView>();
+    buffer = view->Buffer();
+    offset = view->ByteOffset();
+    length = view->ByteLength();
+  } else {
+    *failed = true;
+    Error("TransformBody must return a string, an ArrayBuffer or a view of one, null or undefined");
+    return false;
+  }
+  if (length > 0) *written += TSIOBufferWrite(output, ArrayBufferData(buffer) + offset, length);
+  return true;
+}
+
+// Reads a file into a v8 string.
+MaybeLocal<String> JsHttpRequestProcessor::ReadFile(Isolate* isolate, const string& name) {
+  FILE* file = fopen(name.c_str(), "rb");
+  if (file == NULL) return MaybeLocal<String>();
+
+  fseek(file, 0, SEEK_END);
+  size_t size = ftell(file);
+  rewind(file);
+
+  std::unique_ptr<char> chars(new char[size + 1]);
+  chars.get()[size] = '\0';
+  for (size_t i = 0; i < size;) {
+    i += fread(&chars.get()[i], 1, size - i, file);
+    if (ferror(file)) {
+      fclose(file);
+      return MaybeLocal<String>();
+    }
+  }
+  fclose(file);
+  MaybeLocal<String> result = String::NewFromUtf8(
+      isolate, chars.get(), NewStringType::kNormal, static_cast<int>(size));
+  return result;
+}
+
+/**
+ * Times GC pauses through the isolate's GC prologue and epilogue
+ * callbacks.  Pauses are published per GC type as
+ * plugin.v8.gc.<type>.*, charged to the instance whose script was
+ * running, and logged when longer than the log threshold.  Scavenges
+ * run often enough that the callbacks only take timestamps for them;
+ * heap statistics, and so freed bytes, are only read around full GCs.
+ */
+class GcMonitor {
+ public:
+  static void Initialize(Isolate* isolate);
+
+  // Log pauses of at least ms milliseconds; 0 turns logging off.
+  static void SetLogThreshold(int ms) { log_threshold_ms_ = ms; }
+
+ private:
+  enum Type { kScavenge, kMarkSweep, kIncrementalMarking, kWeakCallbacks, kOther, kTypeCount };
+  enum Counter { kCount, kPauseUs, kFreedBytes, kLongPauses, kPauseFirst,
+                 kCounterCount = kPauseFirst + 6 };
+
+  static Type TypeOf(v8::GCType type);
+  static void Prologue(Isolate* isolate, v8::GCType type, v8::GCCallbackFlags flags);
+  static void Epilogue(Isolate* isolate, v8::GCType type, v8::GCCallbackFlags flags);
+
+  static const char* const kTypeNames[kTypeCount];
+  static const char* const kCounterNames[kCounterCount];
+  static const int64_t kBucketLimitsUs[kCounterCount - kPauseFirst - 1];
+
+  static ShardedStats stats_[kTypeCount];
+  static std::atomic<int> log_threshold_ms_;
+
+  // Only touched with the isolate locked.  used_before_ is only
+  // sampled for kMarkSweep.
+  static TSHRTime start_[kTypeCount];
+  static size_t used_before_;
+};
+
+const char* const GcMonitor::kTypeNames[kTypeCount] = {
+    "scavenge", "mark_sweep", "incremental_marking", "weak_callbacks", "other"};
+const char* const GcMonitor::kCounterNames[kCounterCount] = {
+    "count", "pause_us", "freed_bytes", "long_pauses",
+    "pause.le_100us", "pause.le_1ms", "pause.le_5ms", "pause.le_10ms", "pause.le_50ms",
+    "pause.gt_50ms"};
+const int64_t GcMonitor::kBucketLimitsUs[kCounterCount - kPauseFirst - 1] = {
+    100, 1000, 5000, 10000, 50000};
+ShardedStats GcMonitor::stats_[kTypeCount];
+std::atomic<int> GcMonitor::log_threshold_ms_(0);
+TSHRTime GcMonitor::start_[kTypeCount];
+size_t GcMonitor::used_before_ = 0;
+
+void GcMonitor::Initialize(Isolate* isolate) {
+  for (int i = 0; i < kTypeCount; i++) {
+    stats_[i].Initialize(string("plugin." PLUGIN_NAME ".gc.") + kTypeNames[i],
+                         kCounterNames, kCounterCount);
+  }
+  isolate->AddGCPrologueCallback(Prologue);
+  isolate->AddGCEpilogueCallback(Epilogue);
+}
+
+GcMonitor::Type GcMonitor::TypeOf(v8::GCType type) {
+  if (type & v8::kGCTypeScavenge) return kScavenge;
+  if (type & v8::kGCTypeMarkSweepCompact) return kMarkSweep;
+  if (type & v8::kGCTypeIncrementalMarking) return kIncrementalMarking;
+  if (type & v8::kGCTypeProcessWeakCallbacks) return kWeakCallbacks;
+  return kOther;
+}
+
+void GcMonitor::Prologue(Isolate* isolate, v8::GCType type, v8::GCCallbackFlags flags) {
+  Type index = TypeOf(type);
+  if (index == kMarkSweep) {
+    v8::HeapStatistics heap;
+    isolate->GetHeapStatistics(&heap);
+    used_before_ = heap.used_heap_size();
+  }
+  start_[index] = TShrtime();
+}
+
+void GcMonitor::Epilogue(Isolate* isolate, v8::GCType type, v8::GCCallbackFlags flags) {
+  Type index = TypeOf(type);
+  TSHRTime pause = TShrtime() - start_[index];
+  v8::HeapStatistics heap;
+  if (index == kMarkSweep) isolate->GetHeapStatistics(&heap);
+  size_t used_after = heap.used_heap_size();
+
+  ShardedStats& stats = stats_[index];
+  stats.Add(kCount, 1);
+  stats.Add(kPauseUs, pause / TS_HRTIME_USECOND);
+  if (used_before_ > used_after && index == kMarkSweep) {
+    stats.Add(kFreedBytes, used_before_ - used_after);
+  }
+  int bucket = 0;
+  while (bucket < kCounterCount - kPauseFirst - 1 &&
+         pause / TS_HRTIME_USECOND > kBucketLimitsUs[bucket]) {
+    bucket++;
+  }
+  stats.Add(kPauseFirst + bucket, 1);
+
+  IsolateData* data = IsolateData::Get(isolate);
+  data->gc_count++;
+  data->gc_pause += pause;
+  if (data->running != NULL) data->running->stats()->GcPause(pause);
+
+  int threshold_ms = log_threshold_ms_.load(std::memory_order_relaxed);
+  if (threshold_ms > 0 && pause >= threshold_ms * TS_HRTIME_MSECOND) {
+    stats.Add(kLongPauses, 1);
+    const char* running = data->running != NULL ? data->running->name().c_str() : "no script";
+    char msg[256];
+    if (index == kMarkSweep) {
+      snprintf(msg, sizeof(msg), "GC %s paused %.1f ms, heap used %zu KB -> %zu KB of %zu KB, during %s",
+               kTypeNames[index], static_cast<double>(pause) / TS_HRTIME_MSECOND,
+               used_before_ / 1024, used_after / 1024, heap.total_heap_size() / 1024, running);
+    } else {
+      snprintf(msg, sizeof(msg), "GC %s paused %.1f ms, during %s",
+               kTypeNames[index], static_cast<double>(pause) / TS_HRTIME_MSECOND, running);
+    }
+    HttpRequestProcessor::Error(msg);
+  }
+}
+
+/**
+ * Samples the isolate's heap statistics on the task thread pool and
+ * publishes them as gauges: plugin.v8.heap.* for the whole heap,
+ * plugin.v8.heap.space.<space>.* per heap space and, where V8 can
+ * measure memory per context, each instance's heap_bytes.  Each tick
+ * also runs the tasks V8 has posted to the isolate's message loop.
+ */
+class HeapSampler {
+ public:
+  static void Start();
+
+  // Seconds between samples; takes effect after the current one.
+  static void SetInterval(int seconds) {
+    if (seconds > 0) interval_s_ = seconds;
+  }
+
+ private:
+  static int Sample(TSCont contp, TSEvent event, void* edata);
+  static void SetGauge(const string& name, int64_t value);
+
+#if V8_MAJOR_VERSION >= 9
+  // Hands each instance the size of its context.
+  class ContextMeasurement : public v8::MeasureMemoryDelegate {
+   public:
+    virtual bool ShouldMeasure(Local<Context> context) { return true; }
+    virtual void MeasurementComplete(
+        const std::vector<std::pair<Local<Context>, size_t> >& context_sizes_in_bytes,
+        size_t unattributed_size_in_bytes);
+  };
+#endif
+
+  static std::atomic<int> interval_s_;
+  // Stat ids by name; only used from the sampler's continuation.
+  static map<string, int> gauges_;
+};
+
+std::atomic<int> HeapSampler::interval_s_(10);
+map<string, int> HeapSampler::gauges_;
+
+void HeapSampler::Start() {
+  TSCont sampler = TSContCreate(Sample, TSMutexCreate());
+  TSContScheduleOnPool(sampler, static_cast<TSHRTime>(interval_s_) * 1000, TS_THREAD_POOL_TASK);
+}
+
+void HeapSampler::SetGauge(const string& name, int64_t value) {
+  map<string, int>::iterator iter = gauges_.find(name);
+  int id;
+  if (iter != gauges_.end()) {
+    id = iter->second;
+  } else {
+    string stat = "plugin." PLUGIN_NAME ".heap." + name;
+    if (TSStatFindName(stat.c_str(), &id) != TS_SUCCESS) {
+      id = TSStatCreate(stat.c_str(), TS_RECORDDATATYPE_INT, TS_STAT_NON_PERSISTENT, TS_STAT_SYNC_SUM);
+    }
+    gauges_[name] = id;
+  }
+  if (id != TS_ERROR) TSStatIntSet(id, value);
+}
+
+int HeapSampler::Sample(TSCont contp, TSEvent event, void* edata) {
+  {
+    v8::Locker locker(isolate);
+    isolate->Enter();
+    {
+      HandleScope handle_scope(isolate);
+      while (v8::platform::PumpMessageLoop(platform.get(), isolate)) {
+      }
+
+      v8::HeapStatistics heap;
+      isolate->GetHeapStatistics(&heap);
+      SetGauge("total_bytes", heap.total_heap_size());
+      SetGauge("used_bytes", heap.used_heap_size());
+      SetGauge("limit_bytes", heap.heap_size_limit());
+      SetGauge("physical_bytes", heap.total_physical_size());
+      SetGauge("external_bytes", heap.external_memory());
+      SetGauge("malloced_bytes", heap.malloced_memory());
+      SetGauge("native_contexts", heap.number_of_native_contexts());
+      SetGauge("detached_contexts", heap.number_of_detached_contexts());
+
+      size_t spaces = isolate->NumberOfHeapSpaces();
+      for (size_t i = 0; i < spaces; i++) {
+        v8::HeapSpaceStatistics space;
+        if (!isolate->GetHeapSpaceStatistics(&space, i)) continue;
+        string prefix = string("space.") + space.space_name() + ".";
+        SetGauge(prefix + "size_bytes", space.space_size());
+        SetGauge(prefix + "used_bytes", space.space_used_size());
+        SetGauge(prefix + "available_bytes", space.space_available_size());
+      }
+
+#if V8_MAJOR_VERSION >= 9
+      // Completes with a later GC, on a later tick's message loop
+      isolate->MeasureMemory(std::unique_ptr<v8::MeasureMemoryDelegate>(new ContextMeasurement()));
+#endif
+    }
+    isolate->Exit();
+  }
+
+  TSContScheduleOnPool(contp, static_cast<TSHRTime>(interval_s_) * 1000, TS_THREAD_POOL_TASK);
+  return 0;
+}
+
+#if V8_MAJOR_VERSION >= 9
+void HeapSampler::ContextMeasurement::MeasurementComplete(
+    const std::vector<std::pair<Local<Context>, size_t> >& context_sizes_in_bytes,
+    size_t unattributed_size_in_bytes) {
+  for (size_t i = 0; i < context_sizes_in_bytes.size(); i++) {
+    Local<Context> context = context_sizes_in_bytes[i].first;
+    JsHttpRequestProcessor* processor = static_cast<JsHttpRequestProcessor*>(
+        context->GetAlignedPointerFromEmbedderData(IsolateData::kContextProcessorIndex));
+    if (processor != NULL) processor->stats()->HeapBytes(context_sizes_in_bytes[i].second);
+  }
+  SetGauge("unattributed_bytes", unattributed_size_in_bytes);
+}
+#endif
+
+// Where profiles and other diagnostic dumps are written.
+static string dump_dir;
+
+// A new file name in dump_dir, e.g. v8-1234-20190101-120000.cpuprofile.
+static string DumpPath(const char* ext) {
+  char name[64];
+  time_t now = time(NULL);
+  struct tm tm;
+  localtime_r(&now, &tm);
+  size_t len = snprintf(name, sizeof(name), "v8-%d-", static_cast<int>(getpid()));
+  strftime(name + len, sizeof(name) - len, "%Y%m%d-%H%M%S", &tm);
+  return dump_dir + "/" + name + "." + ext;
+}
+
+// Write a C string as a JSON string literal.
+static void WriteJsonString(FILE* file, const char* str) {
+  fputc('"', file);
+  for (const unsigned char* c = reinterpret_cast<const unsigned char*>(str); *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', file);
+      fputc(*c, file);
+    } else if (*c < 0x20) {
+      fprintf(file, "\\u%04x", *c);
+    } else {
+      fputc(*c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+/**
+ * On demand CPU profiling of the isolate, written as Chrome DevTools
+ * .cpuprofile files.
+ */
+class CpuProfiling {
+ public:
+  // Start sampling every interval_us microseconds.  The profile is
+  // stopped and written after the given number of seconds, if it has
+  // not been stopped before.
+  static bool Start(Isolate* isolate, int seconds, int interval_us);
+
+  // Stop sampling and write the profile.  Returns false if no
+  // profile was running or it could not be written.
+  static bool Stop(Isolate* isolate) { return Stop(isolate, 0); }
+
+ private:
+  // As Stop, but only if the running profile is the one the timer
+  // of the given generation was started for; 0 stops any profile.
+  static bool Stop(Isolate* isolate, intptr_t generation);
+  static int StopTimer(TSCont contp, TSEvent event, void* edata);
+  static bool Write(const v8::CpuProfile* profile, const string& path);
+  static void WriteNode(FILE* file, const v8::CpuProfileNode* node, bool* first);
+
+  static std::mutex mutex_;
+  static v8::CpuProfiler* profiler_;
+  // Tells the timer of a stopped profile apart from the current one.
+  static intptr_t generation_;
+};
+
+std::mutex CpuProfiling::mutex_;
+v8::CpuProfiler* CpuProfiling::profiler_ = NULL;
+intptr_t CpuProfiling::generation_ = 0;
+
+bool CpuProfiling::Start(Isolate* isolate, int seconds, int interval_us) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (profiler_ != NULL) return false;
+
+  {
+    v8::Locker locker(isolate);
+    isolate->Enter();
+    {
+      HandleScope handle_scope(isolate);
+      profiler_ = v8::CpuProfiler::New(isolate);
+      profiler_->SetSamplingInterval(interval_us);
+      profiler_->StartProfiling(
+          String::NewFromUtf8(isolate, PLUGIN_NAME, NewStringType::kNormal).ToLocalChecked(),
+          true);
+    }
+    isolate->Exit();
+  }
+
+  TSCont timer = TSContCreate(StopTimer, TSMutexCreate());
+  TSContDataSet(timer, reinterpret_cast<void*>(++generation_));
+  TSContScheduleOnPool(timer, static_cast<TSHRTime>(seconds) * 1000, TS_THREAD_POOL_TASK);
+  return true;
+}
+
+int CpuProfiling::StopTimer(TSCont contp, TSEvent event, void* edata) {
+  Stop(isolate, reinterpret_cast<intptr_t>(TSContDataGet(contp)));
+  TSContDestroy(contp);
+  return 0;
+}
+
+bool CpuProfiling::Stop(Isolate* isolate, intptr_t generation) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (profiler_ == NULL) return false;
+  if (generation != 0 && generation != generation_) return false;
+  generation_++;
+
+  bool ok;
+  string path = DumpPath("cpuprofile");
+  {
+    v8::Locker locker(isolate);
+    isolate->Enter();
+    {
+      HandleScope handle_scope(isolate);
+      v8::CpuProfile* profile = profiler_->StopProfiling(
+          String::NewFromUtf8(isolate, PLUGIN_NAME, NewStringType::kNormal).ToLocalChecked());
+      ok = profile != NULL && Write(profile, path);
+      if (profile != NULL) profile->Delete();
+      profiler_->Dispose();
+      profiler_ = NULL;
+    }
+    isolate->Exit();
+  }
+
+  if (ok) TSDebug(PLUGIN_NAME, "wrote CPU profile %s", path.c_str());
+  return ok;
+}
+
+bool CpuProfiling::Write(const v8::CpuProfile* profile, const string& path) {
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == NULL) return false;
+
+  bool first = true;
+  fputs("{\"nodes\":[", file);
+  WriteNode(file, profile->GetTopDownRoot(), &first);
+  fprintf(file, "],\"startTime\":%lld,\"endTime\":%lld,\"samples\":[",
+          static_cast<long long>(profile->GetStartTime()),
+          static_cast<long long>(profile->GetEndTime()));
+
+  int count = profile->GetSamplesCount();
+  for (int i = 0; i < count; i++) {
+    fprintf(file, i == 0 ? "%u" : ",%u", profile->GetSample(i)->GetNodeId());
+  }
+  fputs("],\"timeDeltas\":[", file);
+  int64_t last = profile->GetStartTime();
+  for (int i = 0; i < count; i++) {
+    int64_t timestamp = profile->GetSampleTimestamp(i);
+    fprintf(file, i == 0 ? "%lld" : ",%lld", static_cast<long long>(timestamp - last));
+    last = timestamp;
+  }
+  fputs("]}\n", file);
+
+  bool ok = !ferror(file);
+  fclose(file);
+  return ok;
+}
+
+void CpuProfiling::WriteNode(FILE* file, const v8::CpuProfileNode* node, bool* first) {
+  // DevTools numbers lines and columns from 0, V8 from 1
+  fprintf(file, "%s{\"id\":%u,\"callFrame\":{\"functionName\":", *first ? "" : ",",
+          node->GetNodeId());
+  *first = false;
+  WriteJsonString(file, node->GetFunctionNameStr());
+  fprintf(file, ",\"scriptId\":\"%d\",\"url\":", node->GetScriptId());
+  WriteJsonString(file, node->GetScriptResourceNameStr());
+  fprintf(file, ",\"lineNumber\":%d,\"columnNumber\":%d},\"hitCount\":%u,\"children\":[",
+          node->GetLineNumber() - 1, node->GetColumnNumber() - 1, node->GetHitCount());
+  int children = node->GetChildrenCount();
+  for (int i = 0; i < children; i++) {
+    fprintf(file, i == 0 ? "%u" : ",%u", node->GetChild(i)->GetNodeId());
+  }
+  fputs("]}", file);
+
+  for (int i = 0; i < children; i++) {
+    WriteNode(file, node->GetChild(i), first);
+  }
+}
+
+/**
+ * Heap snapshots and the sampling heap profiler, written as Chrome
+ * DevTools .heapsnapshot and .heapprofile files.
+ */
+class HeapProfiling {
+ public:
+  // Take a snapshot of the whole heap.  Requests wait for the isolate
+  // while the snapshot is taken and written.
+  static bool Snapshot(Isolate* isolate);
+
+  // Sample an allocation about every interval bytes, recording stacks
+  // up to stack_depth frames.
+  static bool StartSampling(Isolate* isolate, int interval, int stack_depth);
+
+  // Stop sampling and write the allocation profile.
+  static bool StopSampling(Isolate* isolate);
+
+ private:
+  // Streams a heap snapshot into a file.
+  class FileOutputStream : public v8::OutputStream {
+   public:
+    explicit FileOutputStream(FILE* file) : file_(file) { }
+    virtual void EndOfStream() { }
+    virtual int GetChunkSize() { return 64 * 1024; }
+    virtual WriteResult WriteAsciiChunk(char* data, int size) {
+      return fwrite(data, 1, size, file_) == static_cast<size_t>(size) ? kContinue : kAbort;
+    }
+
+   private:
+    FILE* file_;
+  };
+
+  static void WriteNode(FILE* file, Isolate* isolate,
+                        const v8::AllocationProfile::Node* node);
+
+  static std::mutex mutex_;
+  static bool sampling_;
+};
+
+std::mutex HeapProfiling::mutex_;
+bool HeapProfiling::sampling_ = false;
+
+bool HeapProfiling::Snapshot(Isolate* isolate) {
+  string path = DumpPath("heapsnapshot");
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == NULL) return false;
+
+  {
+    v8::Locker locker(isolate);
+    isolate->Enter();
+    {
+      HandleScope handle_scope(isolate);
+      const v8::HeapSnapshot* snapshot = isolate->GetHeapProfiler()->TakeHeapSnapshot();
+      FileOutputStream stream(file);
+      snapshot->Serialize(&stream, v8::HeapSnapshot::kJSON);
+      const_cast<v8::HeapSnapshot*>(snapshot)->Delete();
+    }
+    isolate->Exit();
+  }
+
+  bool ok = !ferror(file);
+  fclose(file);
+  if (ok) TSDebug(PLUGIN_NAME, "wrote heap snapshot %s", path.c_str());
+  return ok;
+}
+
+bool HeapProfiling::StartSampling(Isolate* isolate, int interval, int stack_depth) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (sampling_) return false;
+
+  v8::Locker locker(isolate);
+  isolate->Enter();
+  sampling_ = isolate->GetHeapProfiler()->StartSamplingHeapProfiler(interval, stack_depth);
+  isolate->Exit();
+  return sampling_;
+}
+
+bool HeapProfiling::StopSampling(Isolate* isolate) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!sampling_) return false;
+  sampling_ = false;
+
+  string path = DumpPath("heapprofile");
+  FILE* file = fopen(path.c_str(), "w");
+
+  v8::Locker locker(isolate);
+  isolate->Enter();
+  {
+    HandleScope handle_scope(isolate);
+    v8::HeapProfiler* heap_profiler = isolate->GetHeapProfiler();
+    std::unique_ptr<v8::AllocationProfile> profile(heap_profiler->GetAllocationProfile());
+    if (file != NULL && profile) {
+      fputs("{\"head\":", file);
+      WriteNode(file, isolate, profile->GetRootNode());
+      fputs(",\"samples\":[", file);
+      const vector<v8::AllocationProfile::Sample>& samples = profile->GetSamples();
+      for (size_t i = 0; i < samples.size(); i++) {
+        fprintf(file, "%s{\"size\":%llu,\"nodeId\":%u,\"ordinal\":%llu}", i == 0 ? "" : ",",
+                static_cast<unsigned long long>(samples[i].size * samples[i].count),
+                samples[i].node_id, static_cast<unsigned long long>(samples[i].sample_id));
+      }
+      fputs("]}\n", file);
+    }
+    heap_profiler->StopSamplingHeapProfiler();
+  }
+  isolate->Exit();
+
+  if (file == NULL) return false;
+  bool ok = !ferror(file);
+  fclose(file);
+  if (ok) TSDebug(PLUGIN_NAME, "wrote heap profile %s", path.c_str());
+  return ok;
+}
+
+void HeapProfiling::WriteNode(FILE* file, Isolate* isolate,
+                              const v8::AllocationProfile::Node* node) {
+  size_t self_size = 0;
+  for (size_t i = 0; i < node->allocations.size(); i++) {
+    self_size += node->allocations[i].size * node->allocations[i].count;
+  }
+
+  String::Utf8Value name(isolate, node->name);
+  String::Utf8Value script_name(isolate, node->script_name);
+  fputs("{\"callFrame\":{\"functionName\":", file);
+  WriteJsonString(file, *name != NULL ? *name : "");
+  fprintf(file, ",\"scriptId\":\"%d\",\"url\":", node->script_id);
+  WriteJsonString(file, *script_name != NULL ? *script_name : "");
+  // DevTools numbers lines and columns from 0, V8 from 1
+  fprintf(file, ",\"lineNumber\":%d,\"columnNumber\":%d},\"selfSize\":%llu,\"id\":%u,\"children\":[",
+          node->line_number - 1, node->column_number - 1,
+          static_cast<unsigned long long>(self_size), node->node_id);
+  for (size_t i = 0; i < node->children.size(); i++) {
+    if (i > 0) fputc(',', file);
+    WriteNode(file, isolate, node->children[i]);
+  }
+  fputs("]}", file);
+}
+
+/**
+ * Bounded windows of V8 tracing, written as Chrome trace JSON files
+ * that chrome://tracing and Perfetto's UI load.  The platform keeps a
+ * single trace buffer for its lifetime, since V8's background threads
+ * may still be adding to it when tracing stops; each window only
+ * points the buffer's writer at a new file.
+ */
+class Tracing {
+ public:
+  // The trace writer handed to the platform.  Must be called before
+  // the platform is created.
+  static std::unique_ptr<v8::TracingController> NewController();
+
+  // Record the given comma separated categories for the given number
+  // of seconds, unless stopped before.
+  static bool Start(int seconds, const string& categories);
+
+  // Stop recording and finish the file.  Returns false if no trace
+  // was running or it could not be written.
+  static bool Stop() { return Stop(0); }
+
+ private:
+#if !defined(V8_USE_PERFETTO)
+  // Forwards events to a JSON writer for the current file.  Only
+  // called by the buffer, from the thread flushing it.
+  class FileWriter : public v8::platform::tracing::TraceWriter {
+   public:
+    void AppendTraceEvent(v8::platform::tracing::TraceObject* event) override {
+      if (json_) json_->AppendTraceEvent(event);
+    }
+    void Flush() override {
+      if (json_) json_->Flush();
+    }
+
+    bool Open(const string& path) {
+      stream_.open(path.c_str());
+      if (!stream_) return false;
+      json_.reset(v8::platform::tracing::TraceWriter::CreateJSONTraceWriter(stream_));
+      return true;
+    }
+    // The JSON writer closes the event array when it is destroyed.
+    bool Close() {
+      json_.reset();
+      stream_.close();
+      return !stream_.fail();
+    }
+
+   private:
+    std::ofstream stream_;
+    std::unique_ptr<v8::platform::tracing::TraceWriter> json_;
+  };
+
+  static FileWriter* writer_;
+#endif
+
+  // As Stop, but only if the running trace is the one the timer of the
+  // given generation was started for; 0 stops any trace.
+  static bool Stop(intptr_t generation);
+  static int StopTimer(TSCont contp, TSEvent event, void* edata);
+
+  static std::mutex mutex_;
+  static bool running_;
+  static string path_;
+  static intptr_t generation_;
+};
+
+#if !defined(V8_USE_PERFETTO)
+Tracing::FileWriter* Tracing::writer_ = NULL;
+#endif
+std::mutex Tracing::mutex_;
+bool Tracing::running_ = false;
+string Tracing::path_;
+intptr_t Tracing::generation_ = 0;
+
+std::unique_ptr<v8::TracingController> Tracing::NewController() {
+  tracing = new v8::platform::tracing::TracingController();
+#if !defined(V8_USE_PERFETTO)
+  writer_ = new FileWriter();
+  tracing->Initialize(v8::platform::tracing::TraceBuffer::CreateTraceBufferRingBuffer(
+      v8::platform::tracing::TraceBuffer::kRingBufferChunks, writer_));
+#endif
+  return std::unique_ptr<v8::TracingController>(tracing);
+}
+
+bool Tracing::Start(int seconds, const string& categories) {
+#if defined(V8_USE_PERFETTO)
+  return false;
+#else
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (running_) return false;
 
-  // It is a function; cast it to a Function
-  Local<Function> process_fun = Local<Function>::Cast(process_val);
+  path_ = DumpPath("trace.json");
+  if (!writer_->Open(path_)) return false;
 
-  // Store the function in a Global handle, since we also want
-  // that to remain after this call returns
-  process_.Reset(GetIsolate(), process_fun);
+  // The buffer is a ring, so a busy window keeps its latest events
+  v8::platform::tracing::TraceConfig* config = new v8::platform::tracing::TraceConfig();
+  config->SetTraceRecordMode(v8::platform::tracing::RECORD_CONTINUOUSLY);
+  size_t start = 0;
+  while (start <= categories.length()) {
+    size_t comma = categories.find(',', start);
+    if (comma == string::npos) comma = categories.length();
+    if (comma > start) config->AddIncludedCategory(categories.substr(start, comma - start).c_str());
+    start = comma + 1;
+  }
+  tracing->StartTracing(config);
+  running_ = true;
 
-  // All done; all went well
+  TSCont timer = TSContCreate(StopTimer, TSMutexCreate());
+  TSContDataSet(timer, reinterpret_cast<void*>(++generation_));
+  TSContScheduleOnPool(timer, static_cast<TSHRTime>(seconds) * 1000, TS_THREAD_POOL_TASK);
   return true;
+#endif
 }
 
-bool JsHttpRequestProcessor::InstallMaps(map<string, string>* opts) {
-  HandleScope handle_scope(GetIsolate());
-
-  // Wrap the map object in a JavaScript wrapper
-  Local<Object> opts_obj = WrapMap(opts);
-
-  v8::Local<v8::Context> context =
-      v8::Local<v8::Context>::New(GetIsolate(), context_);
+int Tracing::StopTimer(TSCont contp, TSEvent event, void* edata) {
+  Stop(reinterpret_cast<intptr_t>(TSContDataGet(contp)));
+  TSContDestroy(contp);
+  return 0;
+}
 
-  // Set the options object as a property on the global object.
-  context->Global()
-      ->Set(context,
-            String::NewFromUtf8(GetIsolate(), "options", NewStringType::kNormal)
-                .ToLocalChecked(),
-            opts_obj)
-      .FromJust();
+bool Tracing::Stop(intptr_t generation) {
+#if defined(V8_USE_PERFETTO)
+  (void)generation;
+  return false;
+#else
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!running_) return false;
+  if (generation != 0 && generation != generation_) return false;
+  generation_++;
+  running_ = false;
 
-  return true;
+  // Stopping flushes the buffer into the writer
+  tracing->StopTracing();
+  bool ok = writer_->Close();
+  if (ok) TSDebug(PLUGIN_NAME, "wrote trace %s", path_.c_str());
+  return ok;
+#endif
 }
 
-// Utility function that wraps a C++ http request object in a
-// JavaScript object.
-Local<Object> JsHttpRequestProcessor::WrapMap(map<string, string>* obj) {
-  // Local scope for temporary handles.
-  EscapableHandleScope handle_scope(GetIsolate());
+/**
+ * A perf map file (/tmp/perf-<pid>.map) of the code V8 generates, so
+ * "perf record" of traffic_server names JS frames next to native ones.
+ * Enabling truncates the file and lists the code that already exists;
+ * disabling stops updates but keeps the file for "perf report".
+ */
+class PerfMap {
+ public:
+  static bool Enable(Isolate* isolate);
+  static void Disable(Isolate* isolate);
 
-  // Fetch the template for creating JavaScript map wrappers.
-  // It only has to be created once, which we do on demand.
-  if (map_template_.IsEmpty()) {
-    Local<ObjectTemplate> raw_template = MakeMapTemplate(GetIsolate());
-    map_template_.Reset(GetIsolate(), raw_template);
-  }
-  Local<ObjectTemplate> templ =
-      Local<ObjectTemplate>::New(GetIsolate(), map_template_);
+ private:
+  static void CodeEvent(const v8::JitCodeEvent* event);
 
-  // Create an empty map wrapper.
-  Local<Object> result =
-      templ->NewInstance(GetIsolate()->GetCurrentContext()).ToLocalChecked();
+  static std::mutex mutex_;
+  static FILE* file_;
+};
 
-  // Wrap the raw C++ pointer in an External so it can be referenced
-  // from within JavaScript.
-  Local<External> map_ptr = External::New(GetIsolate(), obj);
+std::mutex PerfMap::mutex_;
+FILE* PerfMap::file_ = NULL;
 
-  // Store the map pointer in the JavaScript wrapper.
-  result->SetInternalField(0, map_ptr);
+// The isolate is locked before mutex_, as rules enabling the map
+// already hold the isolate.
+bool PerfMap::Enable(Isolate* isolate) {
+  v8::Locker locker(isolate);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_ != NULL) return true;
 
-  // Return the result through the current handle scope.  Since each
-  // of these handles will go away when the handle scope is deleted
-  // we need to call Close to let one, the result, escape into the
-  // outer handle scope.
-  return handle_scope.Escape(result);
-}
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", static_cast<int>(getpid()));
+  file_ = fopen(path, "w");
+  if (file_ == NULL) return false;
+  // perf may read the map while we are running
+  setvbuf(file_, NULL, _IOLBF, 0);
 
-// Utility function that extracts the C++ map pointer from a wrapper
-// object.
-map<string, string>* JsHttpRequestProcessor::UnwrapMap(Local<Object> obj) {
-  Local<External> field = Local<External>::Cast(obj->GetInternalField(0));
-  void* ptr = field->Value();
-  return static_cast<map<string, string>*>(ptr);
+  isolate->Enter();
+  isolate->SetJitCodeEventHandler(v8::kJitCodeEventEnumExisting, CodeEvent);
+  isolate->Exit();
+  TSDebug(PLUGIN_NAME, "writing perf map %s", path);
+  return true;
 }
 
+void PerfMap::Disable(Isolate* isolate) {
+  v8::Locker locker(isolate);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_ == NULL) return;
 
-// Convert a JavaScript string to a std::string.  To not bother too
-// much with string encodings we just use ascii.
-string ObjectToString(v8::Isolate* isolate, Local<Value> value) {
-  String::Utf8Value utf8_value(isolate, value);
-  return string(*utf8_value);
+  isolate->Enter();
+  isolate->SetJitCodeEventHandler(v8::kJitCodeEventDefault, NULL);
+  isolate->Exit();
+  fclose(file_);
+  file_ = NULL;
 }
 
-void JsHttpRequestProcessor::MapGet(Local<Name> name,
-                                    const PropertyCallbackInfo<Value>& info) {
-  if (name->IsSymbol()) return;
+// Runs on whichever thread holds the isolate, so file_ is stable.
+// Interpreted functions have no machine code of their own and show up
+// as the interpreter's entry trampoline.
+void PerfMap::CodeEvent(const v8::JitCodeEvent* event) {
+  if (file_ == NULL || event->code_type != v8::JitCodeEvent::JIT_CODE) return;
 
-  // Fetch the map wrapped by this object.
-  map<string, string>* obj = UnwrapMap(info.Holder());
+  switch (event->type) {
+    case v8::JitCodeEvent::CODE_ADDED:
+      fprintf(file_, "%lx %lx %.*s\n", reinterpret_cast<unsigned long>(event->code_start),
+              static_cast<unsigned long>(event->code_len),
+              static_cast<int>(event->name.len), event->name.str);
+      break;
+    case v8::JitCodeEvent::CODE_MOVED:
+      // perf takes the last entry for an address
+      fprintf(file_, "%lx %lx %.*s\n", reinterpret_cast<unsigned long>(event->new_code_start),
+              static_cast<unsigned long>(event->code_len),
+              static_cast<int>(event->name.len), event->name.str);
+      break;
+    default:
+      break;
+  }
+}
 
-  // Convert the JavaScript string to a std::string.
-  string key = ObjectToString(info.GetIsolate(), Local<String>::Cast(name));
+/**
+ * Deoptimization and inline cache health of the scripts.  V8 can only
+ * log these events to its own log file, and its flags have to be set
+ * before V8 is initialized, so the mode is turned on by pointing the
+ * TS_V8_DEOPT_LOG environment variable of traffic_server at a file.
+ * A report parses the events logged since the last reset and writes
+ * them out grouped by script, with the rules that run each script.
+ */
+class DeoptLog {
+ public:
+  // Set the V8 flags if TS_V8_DEOPT_LOG is set.  Must be called
+  // before v8::V8::Initialize().
+  static void Configure();
+  static bool Enabled() { return !path_.empty(); }
 
-  // Look up the value if it exists using the standard STL ideom.
-  map<string, string>::iterator iter = obj->find(key);
+  static void Register(const string& file, const string& name);
+  static void Unregister(const string& file, const string& name);
 
-  // If the key is not present return an empty handle as signal
-  if (iter == obj->end()) return;
+  static bool Report();
+  static void Reset();
 
-  // Otherwise fetch the value and wrap it in a JavaScript string
-  const string& value = (*iter).second;
-  info.GetReturnValue().Set(
-      String::NewFromUtf8(info.GetIsolate(), value.c_str(),
-                          NewStringType::kNormal,
-                          static_cast<int>(value.length())).ToLocalChecked());
-}
+ private:
+  static vector<string> SplitLine(const string& line);
 
-void JsHttpRequestProcessor::MapSet(Local<Name> name, Local<Value> value_obj,
-                                    const PropertyCallbackInfo<Value>& info) {
-  if (name->IsSymbol()) return;
+  static string path_;
+  static long offset_;
+  static std::mutex mutex_;
+  static map<string, std::set<string> > scripts_;
+};
 
-  // Fetch the map wrapped by this object.
-  map<string, string>* obj = UnwrapMap(info.Holder());
+string DeoptLog::path_;
+long DeoptLog::offset_ = 0;
+std::mutex DeoptLog::mutex_;
+map<string, std::set<string> > DeoptLog::scripts_;
 
-  // Convert the key and value to std::strings.
-  string key = ObjectToString(info.GetIsolate(), Local<String>::Cast(name));
-  string value = ObjectToString(info.GetIsolate(), value_obj);
+void DeoptLog::Configure() {
+  const char* path = getenv("TS_V8_DEOPT_LOG");
+  if (path == NULL || *path == '\0') return;
+  path_ = path;
 
-  // Update the map.
-  (*obj)[key] = value;
+  // --trace-ic was renamed --log-ic in V8 8.0
+  string flags = "--log-deopt --no-logfile-per-isolate --logfile=" + path_;
+#if V8_MAJOR_VERSION >= 8
+  flags += " --log-ic";
+#else
+  flags += " --trace-ic";
+#endif
+  v8::V8::SetFlagsFromString(flags.c_str());
+  TSDebug(PLUGIN_NAME, "logging deopts to %s", path);
+}
 
-  // Return the value; any non-empty handle will work.
-  info.GetReturnValue().Set(value_obj);
+void DeoptLog::Register(const string& file, const string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  scripts_[file].insert(name);
 }
 
-Local<ObjectTemplate> JsHttpRequestProcessor::MakeMapTemplate(
-    Isolate* isolate) {
-  EscapableHandleScope handle_scope(isolate);
+void DeoptLog::Unregister(const string& file, const string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  map<string, std::set<string> >::iterator it = scripts_.find(file);
+  if (it == scripts_.end()) return;
+  it->second.erase(name);
+  if (it->second.empty()) scripts_.erase(it);
+}
 
-  Local<ObjectTemplate> result = ObjectTemplate::New(isolate);
-  result->SetInternalFieldCount(1);
-  result->SetHandler(NamedPropertyHandlerConfiguration(MapGet, MapSet));
+// Start the next report from the current end of the log.
+void DeoptLog::Reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  FILE* file = fopen(path_.c_str(), "r");
+  if (file == NULL) return;
+  fseek(file, 0, SEEK_END);
+  offset_ = ftell(file);
+  fclose(file);
+}
 
-  // Again, return the result through the current handle scope.
-  return handle_scope.Escape(result);
+// V8 log lines are comma separated; commas inside fields are escaped.
+vector<string> DeoptLog::SplitLine(const string& line) {
+  vector<string> fields;
+  size_t start = 0;
+  for (;;) {
+    size_t comma = line.find(',', start);
+    fields.push_back(line.substr(start, comma == string::npos ? string::npos : comma - start));
+    if (comma == string::npos) break;
+    start = comma + 1;
+  }
+  return fields;
 }
 
-bool JsHttpRequestProcessor::ExecuteScript(Local<String> script) {
-  HandleScope handle_scope(GetIsolate());
+/**
+ * A code-deopt line ends with the deopt kind, the source position and
+ * the reason.  The position reads <file:line:column>, followed by
+ * "inlined at <...>" when the deopting code was inlined; the first one
+ * names the script.  IC lines only have the line and column, so
+ * transitions to megamorphic are reported for the isolate as a whole.
+ */
+bool DeoptLog::Report() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  FILE* log = fopen(path_.c_str(), "r");
+  if (log == NULL) return false;
+  fseek(log, offset_, SEEK_SET);
 
-  // We're just about to compile the script; set up an error handler to
-  // catch any exceptions the script might throw.
-  TryCatch try_catch(GetIsolate());
+  // script -> (location, kind, reason) -> count
+  typedef std::tuple<string, string, string> Deopt;
+  map<string, map<Deopt, int> > deopts;
+  // IC type and line:column -> count
+  map<string, int> megamorphic;
 
-  Local<Context> context(GetIsolate()->GetCurrentContext());
+  char buf[4096];
+  string line;
+  while (fgets(buf, sizeof(buf), log) != NULL) {
+    line += buf;
+    if (line.empty() || line[line.length() - 1] != '\n') continue;
+    line.erase(line.length() - 1);
+    vector<string> fields = SplitLine(line);
+    line.clear();
 
-  // Compile the script and check for errors.
-  Local<Script> compiled_script;
-  if (!Script::Compile(context, script).ToLocal(&compiled_script)) {
-    String::Utf8Value error(GetIsolate(), try_catch.Exception());
-    Error(*error);
-    // The script failed to compile; bail out.
-    return false;
+    if (fields[0] == "code-deopt" && fields.size() >= 4) {
+      const string& location = fields[fields.size() - 2];
+      size_t open = location.find('<');
+      size_t close = location.find('>');
+      string position = open == string::npos || close == string::npos
+          ? location : location.substr(open + 1, close - open - 1);
+      // the script is everything before ":line:column"
+      string script = position;
+      for (int i = 0; i < 2; i++) {
+        size_t colon = script.rfind(':');
+        if (colon != string::npos) script.erase(colon);
+      }
+      Deopt key(position, fields[fields.size() - 3], fields[fields.size() - 1]);
+      deopts[script][key]++;
+    } else if (fields[0].length() > 2 &&
+               fields[0].compare(fields[0].length() - 2, 2, "IC") == 0) {
+      // ...,line,column,old state,new state,map,...
+      for (size_t i = 4; i + 1 < fields.size(); i++) {
+        if (fields[i].length() == 1 && fields[i + 1].length() == 1) {
+          if (fields[i + 1] == "N") {
+            megamorphic[fields[0] + " " + fields[i - 2] + ":" + fields[i - 1]]++;
+          }
+          break;
+        }
+      }
+    }
   }
+  fclose(log);
 
-  // Run the script!
-  Local<Value> result;
-  if (!compiled_script->Run(context).ToLocal(&result)) {
-    // The TryCatch above is still in effect and will have caught the error.
-    String::Utf8Value error(GetIsolate(), try_catch.Exception());
-    Error(*error);
-    // Running the script failed; bail out.
-    return false;
+  string path = DumpPath("deopt");
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == NULL) return false;
+
+  for (map<string, map<Deopt, int> >::iterator it = deopts.begin(); it != deopts.end(); ++it) {
+    int total = 0;
+    for (map<Deopt, int>::iterator d = it->second.begin(); d != it->second.end(); ++d) {
+      total += d->second;
+    }
+    fprintf(file, "%s: %d deopts", it->first.c_str(), total);
+    map<string, std::set<string> >::iterator rules = scripts_.find(it->first);
+    if (rules != scripts_.end()) {
+      const char* sep = " (";
+      for (std::set<string>::iterator r = rules->second.begin(); r != rules->second.end(); ++r) {
+        fprintf(file, "%s%s", sep, r->c_str());
+        sep = ", ";
+      }
+      fputs(")", file);
+    }
+    fputs("\n", file);
+    for (map<Deopt, int>::iterator d = it->second.begin(); d != it->second.end(); ++d) {
+      fprintf(file, "  %6d  %s  %s: %s\n", d->second, std::get<0>(d->first).c_str(),
+              std::get<1>(d->first).c_str(), std::get<2>(d->first).c_str());
+    }
+  }
+  if (!megamorphic.empty()) {
+    fputs("megamorphic inline caches:\n", file);
+    for (map<string, int>::iterator it = megamorphic.begin(); it != megamorphic.end(); ++it) {
+      fprintf(file, "  %6d  %s\n", it->second, it->first.c_str());
+    }
   }
 
-  return true;
+  bool ok = ferror(file) == 0;
+  if (fclose(file) != 0) ok = false;
+  if (ok) TSDebug(PLUGIN_NAME, "wrote deopt report %s", path.c_str());
+  return ok;
 }
 
-TSRemapStatus JsHttpRequestProcessor::Process() {
- 
-  // Create a handle scope to keep the temporary object references.
-  HandleScope handle_scope(GetIsolate());
+// Split a plugin message into whitespace separated words.
+static vector<string> SplitMessage(const TSPluginMsg* msg) {
+  vector<string> words;
+  const char* data = static_cast<const char*>(msg->data);
+  size_t i = 0;
+  while (i < msg->data_size) {
+    while (i < msg->data_size && isspace(data[i])) i++;
+    size_t start = i;
+    while (i < msg->data_size && data[i] != '\0' && !isspace(data[i])) i++;
+    if (i > start) words.push_back(string(data + start, i - start));
+    if (i < msg->data_size && data[i] == '\0') break;
+  }
+  return words;
+}
 
-  v8::Local<v8::Context> context =
-      v8::Local<v8::Context>::New(GetIsolate(), context_);
+static void ProfileCommand(const vector<string>& args) {
+  if (args.size() >= 2 && args[1] == "start") {
+    int seconds = args.size() >= 3 ? atoi(args[2].c_str()) : 30;
+    int interval_us = args.size() >= 4 ? atoi(args[3].c_str()) : 1000;
+    if (seconds <= 0) seconds = 30;
+    if (interval_us <= 0) interval_us = 1000;
+    if (!CpuProfiling::Start(isolate, seconds, interval_us)) {
+      TSError("[v8] a CPU profile is already running");
+    }
+  } else if (args.size() >= 2 && args[1] == "stop") {
+    if (!CpuProfiling::Stop(isolate)) {
+      TSError("[v8] no CPU profile written, none running or %s not writable", dump_dir.c_str());
+    }
+  } else {
+    TSError("[v8] usage: profile start [seconds] [interval_us] | profile stop");
+  }
+}
 
-  // Enter this processor's context so all the remaining operations
-  // take place there
-  Context::Scope context_scope(context);
+static void HeapCommand(const vector<string>& args) {
+  if (args.size() >= 2 && args[1] == "snapshot") {
+    if (!HeapProfiling::Snapshot(isolate)) {
+      TSError("[v8] unable to write a heap snapshot to %s", dump_dir.c_str());
+    }
+  } else if (args.size() >= 3 && args[1] == "sample" && args[2] == "start") {
+    int interval = args.size() >= 4 ? atoi(args[3].c_str()) : 512 * 1024;
+    int stack_depth = args.size() >= 5 ? atoi(args[4].c_str()) : 16;
+    if (interval <= 0) interval = 512 * 1024;
+    if (stack_depth <= 0) stack_depth = 16;
+    if (!HeapProfiling::StartSampling(isolate, interval, stack_depth)) {
+      TSError("[v8] the sampling heap profiler is already running");
+    }
+  } else if (args.size() >= 3 && args[1] == "sample" && args[2] == "stop") {
+    if (!HeapProfiling::StopSampling(isolate)) {
+      TSError("[v8] no heap profile written, none running or %s not writable", dump_dir.c_str());
+    }
+  } else {
+    TSError("[v8] usage: heap snapshot | heap sample start [interval_bytes] [stack_depth] | heap sample stop");
+  }
+}
 
-  // Set up an exception handler before calling the Process function
-  TryCatch try_catch(GetIsolate());
+static void PerfCommand(const vector<string>& args) {
+  if (args.size() >= 2 && args[1] == "start") {
+    if (!PerfMap::Enable(isolate)) {
+      TSError("[v8] unable to create the perf map file");
+    }
+  } else if (args.size() >= 2 && args[1] == "stop") {
+    PerfMap::Disable(isolate);
+  } else {
+    TSError("[v8] usage: perf start | perf stop");
+  }
+}
 
-  // Invoke the process function, giving the global object as 'this'
-  const int argc = 0;
-  v8::Local<v8::Function> process =
-      v8::Local<v8::Function>::New(GetIsolate(), process_);
-  Local<Value> result;
-  if (!process->Call(context, context->Global(), argc, NULL).ToLocal(&result)) {
-    String::Utf8Value error(GetIsolate(), try_catch.Exception());
-    Error(*error);
-    return TSREMAP_NO_REMAP;
+static void TraceCommand(const vector<string>& args) {
+  if (args.size() >= 2 && args[1] == "start") {
+    int seconds = args.size() >= 3 ? atoi(args[2].c_str()) : 10;
+    if (seconds <= 0) seconds = 10;
+    string categories = args.size() >= 4
+        ? args[3]
+        : "ats,v8,v8.execute,disabled-by-default-v8.compile,disabled-by-default-v8.gc";
+    if (!Tracing::Start(seconds, categories)) {
+      TSError("[v8] unable to start a trace, one is already running or %s is not writable",
+              dump_dir.c_str());
+    }
+  } else if (args.size() >= 2 && args[1] == "stop") {
+    if (!Tracing::Stop()) {
+      TSError("[v8] no trace written, none running or %s not writable", dump_dir.c_str());
+    }
+  } else {
+    TSError("[v8] usage: trace start [seconds] [categories] | trace stop");
   }
-  return TSREMAP_NO_REMAP;
 }
 
-// Reads a file into a v8 string.
-MaybeLocal<String> JsHttpRequestProcessor::ReadFile(Isolate* isolate, const string& name) {
-  FILE* file = fopen(name.c_str(), "rb");
-  if (file == NULL) return MaybeLocal<String>();
+static void DeoptCommand(const vector<string>& args) {
+  if (!DeoptLog::Enabled()) {
+    TSError("[v8] deopt logging is off, set TS_V8_DEOPT_LOG for traffic_server");
+  } else if (args.size() >= 2 && args[1] == "report") {
+    if (!DeoptLog::Report()) {
+      TSError("[v8] no deopt report written, unable to read the V8 log or write to %s", dump_dir.c_str());
+    }
+  } else if (args.size() >= 2 && args[1] == "reset") {
+    DeoptLog::Reset();
+  } else {
+    TSError("[v8] usage: deopt report | deopt reset");
+  }
+}
 
-  fseek(file, 0, SEEK_END);
-  size_t size = ftell(file);
-  rewind(file);
+/**
+ * Handles "traffic_ctl plugin msg v8 <command> [args...]".
+ */
+static int MessageHandler(TSCont contp, TSEvent event, void* edata) {
+  const TSPluginMsg* msg = static_cast<const TSPluginMsg*>(edata);
+  if (event != TS_EVENT_LIFECYCLE_MSG || strcmp(msg->tag, PLUGIN_NAME) != 0) return 0;
 
-  std::unique_ptr<char> chars(new char[size + 1]);
-  chars.get()[size] = '\0';
-  for (size_t i = 0; i < size;) {
-    i += fread(&chars.get()[i], 1, size - i, file);
-    if (ferror(file)) {
-      fclose(file);
-      return MaybeLocal<String>();
-    }
+  vector<string> args = SplitMessage(msg);
+  if (args.empty()) return 0;
+
+  if (args[0] == "profile") {
+    ProfileCommand(args);
+  } else if (args[0] == "heap") {
+    HeapCommand(args);
+  } else if (args[0] == "perf") {
+    PerfCommand(args);
+  } else if (args[0] == "trace") {
+    TraceCommand(args);
+  } else if (args[0] == "deopt") {
+    DeoptCommand(args);
+  } else {
+    TSError("[v8] unknown plugin message command: %s", args[0].c_str());
   }
-  fclose(file);
-  MaybeLocal<String> result = String::NewFromUtf8(
-      isolate, chars.get(), NewStringType::kNormal, static_cast<int>(size));
-  return result;
+  return 0;
 }
 
 TSReturnCode
@@ -426,25 +4909,72 @@ TSRemapInit(TSRemapInterface *, char *, int)
 {
   TSDebug(PLUGIN_NAME, "TSRemapInit()");
 
+  ScriptMetrics::time_origin = TShrtime();
+
   // Initialize V8.
+  DeoptLog::Configure();
   v8::V8::InitializeICUDefaultLocation("/tmp");
   v8::V8::InitializeExternalStartupData("/tmp");
-  platform = v8::platform::NewDefaultPlatform();
+  platform = v8::platform::NewDefaultPlatform(
+      0, v8::platform::IdleTaskSupport::kDisabled,
+      v8::platform::InProcessStackDumping::kDisabled, Tracing::NewController());
   v8::V8::InitializePlatform(platform.get());
   v8::V8::Initialize();
 
+  if (!ErrorLog::Initialize()) {
+    TSError("[v8] unable to create the error log, using diagnostics.log");
+  }
+  if (!EventLog::Initialize()) {
+    TSError("[v8] unable to create the event log, emit() is disabled");
+  }
+  if (!SlowLog::Initialize()) {
+    TSError("[v8] unable to create the slow call log, slow_ms is disabled");
+  }
+  if (!TxnScriptTime::Initialize()) {
+    TSError("[v8] no transaction user arg left, log_fields is disabled");
+  }
+  TSThreadCreate(LogThread, NULL);
+  ShardedStats::StartFlusher();
+
+  HeapSampler::Start();
+
+  dump_dir = TSRuntimeDirGet();
+  TSLifecycleHookAdd(TS_LIFECYCLE_MSG_HOOK, TSContCreate(MessageHandler, NULL));
+
   // create isolate
   create_params.array_buffer_allocator =
       v8::ArrayBuffer::Allocator::NewDefaultAllocator();
   isolate = v8::Isolate::New(create_params);
-  //v8::Locker locker(isolate);
-  //isolate->Enter();
-  //isolate->Exit();
-  //v8::Unlocker unlocker(isolate);
+
+  {
+    // create the per isolate templates
+    v8::Locker locker(isolate);
+    isolate->Enter();
+    JsHttpRequestProcessor::SetupIsolate(isolate);
+    GcMonitor::Initialize(isolate);
+    Inspector::Start(isolate);
+    isolate->Exit();
+  }
 
   return TS_SUCCESS;
 }
 
+// Stats of an instance are named after its script and the rule's
+// "from" URL, e.g. test.test.com for test.js on http://test.com/.
+static string StatsName(const char* from_url, const string& file) {
+  size_t slash = file.rfind('/');
+  string script = file.substr(slash == string::npos ? 0 : slash + 1);
+  size_t dot = script.rfind('.');
+  if (dot != string::npos && dot > 0) script.erase(dot);
+
+  string rule(from_url);
+  size_t scheme = rule.find("://");
+  if (scheme != string::npos) rule.erase(0, scheme + 3);
+  while (!rule.empty() && rule[rule.length() - 1] == '/') rule.erase(rule.length() - 1);
+
+  return script + "." + rule;
+}
+
 TSReturnCode
 TSRemapNewInstance(int argc, char *argv[], void **ih, char *errbuf, int errbuf_size)
 {
@@ -481,19 +5011,44 @@ TSRemapNewInstance(int argc, char *argv[], void **ih, char *errbuf, int errbuf_s
     // creating the processor
     string file(script);
     processor = new JsHttpRequestProcessor(isolate, file);
+    processor->SetName(StatsName(argv[0], file));
   }
  
   {
-    // no options passed in for now
+    // Remaining parameters are options of the form key=value; a bare
+    // key is taken as "true".
     map<string, string> options;
+    for (int i = 3; i < argc; i++) {
+      const char* eq = strchr(argv[i], '=');
+      if (eq == NULL) {
+        options[argv[i]] = "true";
+      } else {
+        options[string(argv[i], eq - argv[i])] = string(eq + 1);
+      }
+    }
     // Initialize the context and process inside the processor , as well as setting up the global object
     if (!processor->Initialize(&options)) {
       strncpy(errbuf, "[TSRemapNewInstance] - Error initializing processor !!", errbuf_size - 1);
       errbuf[errbuf_size - 1] = '\0';
       return TS_ERROR;
     }  
+
+    // The perf map is isolate wide; any rule can turn it on
+    if (options["perf_map"] == "true" && !PerfMap::Enable(isolate)) {
+      TSError("[v8] unable to create the perf map file");
+    }
+
+    // So are the GC pause log threshold and the heap sample interval;
+    // the last rule setting them wins
+    if (options.count("gc_log_ms")) {
+      GcMonitor::SetLogThreshold(atoi(options["gc_log_ms"].c_str()));
+    }
+    if (options.count("heap_stats_interval")) {
+      HeapSampler::SetInterval(atoi(options["heap_stats_interval"].c_str()));
+    }
   }
 
+  if (DeoptLog::Enabled()) DeoptLog::Register(processor->file(), processor->name());
   *ih = processor; 
 
   isolate->Exit();
@@ -507,16 +5062,18 @@ TSRemapDeleteInstance(void *ih)
 {
   TSDebug(PLUGIN_NAME, "tsRemapDeleteInstance()");
 
-  v8::Locker locker(isolate);
-  isolate->Enter();
-
   // Getting processor
   JsHttpRequestProcessor *processor = ((JsHttpRequestProcessor *)ih);
 
-  delete processor;
+  {
+    v8::Locker locker(isolate);
+    isolate->Enter();
+    if (DeoptLog::Enabled()) DeoptLog::Unregister(processor->file(), processor->name());
+    isolate->Exit();
+  }
 
-  isolate->Exit();
-  v8::Unlocker unlocker(isolate);
+  // Transactions still queued for a batch keep it until they close
+  processor->Release();
 }
 
 TSRemapStatus
@@ -524,16 +5081,46 @@ TSRemapDoRemap(void *ih, TSHttpTxn txn, TSRemapRequestInfo *rri)
 {
   TSDebug(PLUGIN_NAME, "TSRemapDoRemap()");
 
-  v8::Locker locker(isolate);
-  isolate->Enter();
-  
   // Getting processor
   JsHttpRequestProcessor *processor = ((JsHttpRequestProcessor *)ih);
 
-  TSRemapStatus res = processor->Process();
+  processor->Capture(txn, rri);
+  processor->HookResponse(txn, rri);
+
+  // Batched requests are decided later by the batch worker, which
+  // takes the isolate lock once for the whole batch.
+  if (processor->IsBatching()) {
+    return processor->QueueRequest(txn, rri);
+  }
+
+  TxnHttpRequest request(txn, rri->requestBufp, rri->requestHdrp, rri->requestUrl);
+  Shadow::Entry* shadowed = processor->shadow() != NULL ? processor->shadow()->Sample(&request) : NULL;
+
+  TraceSpan wait("lock wait");
+  TSHRTime wait_start = TShrtime();
+  v8::Locker locker(isolate);
+  wait.End();
+  isolate->Enter();
+
+  TSHRTime start = TShrtime();
+  IsolateData::Get(isolate)->lock_wait = start - wait_start;
+
+  TSRemapStatus res = processor->Process(&request);
+  if (HttpRequestProcessor::IsRemapped(res)) {
+    request.ApplyRewrites(rri->requestBufp, rri->requestUrl);
+  }
+
+  TSHRTime elapsed = TShrtime() - start;
 
   isolate->Exit();
   v8::Unlocker unlocker(isolate);
 
+  if (processor->LogsFields()) {
+    TxnScriptTime::Track(txn);
+    TxnScriptTime::Add(txn, TxnScriptTime::kLockWait, start - wait_start);
+    TxnScriptTime::Add(txn, TxnScriptTime::kRemap, elapsed);
+  }
+  if (shadowed != NULL) processor->shadow()->Submit(shadowed, res, &request);
+
   return res;
 }